@@ -3,9 +3,24 @@
 ** See Copyright Notice in luaproc.h
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE  /* cpu affinity */
+#endif
+
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
@@ -15,7 +30,41 @@
 
 #define FALSE 0
 #define TRUE  !FALSE
-#define LUAPROC_SCHED_WORKERS_TABLE "workertb"
+/* number of local dequeues after which a worker checks the global queue */
+#define LUAPROC_SCHED_GLOBAL_INTERVAL 61
+/* maximum consecutive processes run from a worker's next slot while other
+   processes are waiting in its ready queues */
+#define LUAPROC_SCHED_HANDOFF_MAX 16
+/* number of times processes with ready lua processes may be passed over in
+   favor of higher priority ones before being served */
+#define LUAPROC_SCHED_AGING_LIMIT 8
+/* busy-wait iterations between two spinning rounds */
+#define LUAPROC_SCHED_SPIN_PAUSE 32
+/* spinning rounds between two yields of the processor */
+#define LUAPROC_SCHED_SPIN_YIELD 8
+/* a worker's spin time never adapts below this fraction of the setting */
+#define LUAPROC_SCHED_SPIN_MIN_FRACTION 8
+/* interval (in milliseconds) between two samples of the autoscaler */
+#define LUAPROC_SCHED_AUTOSCALE_PERIOD 10
+/* timer wheel geometry: each level has 2^BITS slots of 2^(BITS*level)
+   milliseconds, so the wheel spans 2^(BITS*LEVELS) milliseconds (longer
+   timers are cascaded down as time goes by) */
+#define LUAPROC_SCHED_WHEEL_BITS   6
+#define LUAPROC_SCHED_WHEEL_LEVELS 4
+#define LUAPROC_SCHED_WHEEL_SLOTS  ( 1 << LUAPROC_SCHED_WHEEL_BITS )
+#define LUAPROC_SCHED_WHEEL_MASK   ( LUAPROC_SCHED_WHEEL_SLOTS - 1 )
+#define LUAPROC_SCHED_WHEEL_SPAN \
+  ( 1UL << ( LUAPROC_SCHED_WHEEL_BITS * LUAPROC_SCHED_WHEEL_LEVELS ))
+/* maximum events the poller thread handles per wakeup */
+#define LUAPROC_SCHED_POLL_EVENTS 64
+/* epoll event data that stops the poller thread */
+#define LUAPROC_SCHED_POLL_STOP   UINT64_MAX
+
+#if defined(__i386__) || defined(__x86_64__)
+#define sched_cpu_relax( ) __builtin_ia32_pause( )
+#else
+#define sched_cpu_relax( ) __atomic_signal_fence( __ATOMIC_SEQ_CST )
+#endif
 
 #if (LUA_VERSION_NUM >= 502)
 #define luaproc_resume( L, from, nargs ) lua_resume( L, from, nargs )
@@ -23,37 +72,201 @@
 #define luaproc_resume( L, from, nargs ) lua_resume( L, nargs )
 #endif
 
+/***********
+ * structs *
+ ***********/
+
+/* worker thread */
+typedef struct stworker worker;
+struct stworker {
+  pthread_t thread;
+  int active;
+  unsigned int ticks;
+  int handoffs;
+  luaproc *runnext;
+  luaproc *running;
+  int hookcount;
+  int budget;
+  struct timespec deadline;
+  int aging[LUAPROC_SCHED_PRIORITY_LEVELS];
+  queue ready_lp_queue[LUAPROC_SCHED_PRIORITY_LEVELS];
+  int spin;                    /* current spin time (microseconds) */
+  int parked;                  /* is the worker in the idle list? */
+  pthread_cond_t cond_wakeup;  /* wakes this worker (and only it) up */
+  worker *nextidle;
+  int cpu;                     /* cpu the worker is pinned to (or -1) */
+  int node;                    /* numa node of that cpu (or -1) */
+  worker *next;
+};
+
+/* parking slot of the main thread, where it waits while the main lua state
+   is blocked (and, if it is allowed to, runs lua processes meanwhile) */
+typedef struct stparkslot {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int woken;    /* has the current wait been satisfied? */
+  int waitall;  /* is the current wait for all lua processes to finish? */
+  int idle;     /* is the thread waiting for lua processes to run as well? */
+} parkslot;
+
+#ifdef __linux__
+/* poller registration of a file descriptor wait; epoll events refer to it by
+   index and generation, so events of waits that already timed out are
+   recognized and dropped */
+typedef struct stfdslot {
+  luaproc *lp;        /* waiting lua process (NULL if the slot is free) */
+  unsigned int gen;
+  int nextfree;
+} fdslot;
+#endif
+
 /********************
  * global variables *
  *******************/
 
-/* ready process list */
-list ready_lp_list;
+/* global ready process queues, one per priority (processes queued from
+   outside workers) */
+queue ready_lp_queue[LUAPROC_SCHED_PRIORITY_LEVELS];
 
-/* ready process queue access mutex */
+/* worker set and idle workers access mutex */
 pthread_mutex_t mutex_sched = PTHREAD_MUTEX_INITIALIZER;
 
 /* active luaproc count access mutex */
 pthread_mutex_t mutex_lp_count = PTHREAD_MUTEX_INITIALIZER;
 
-/* wake worker up conditional variable */
-pthread_cond_t cond_wakeup_worker = PTHREAD_COND_INITIALIZER;
-
 /* no active luaproc conditional variable */
 pthread_cond_t cond_no_active_lp = PTHREAD_COND_INITIALIZER;
 
-/* lua_State used to store workers hash table */
-static lua_State *workerls = NULL;
+/* offload thread pool access mutex */
+pthread_mutex_t mutex_offload = PTHREAD_MUTEX_INITIALIZER;
+
+/* wake offload thread up conditional variable */
+pthread_cond_t cond_offload = PTHREAD_COND_INITIALIZER;
+
+/* timer wheel access mutex */
+pthread_mutex_t mutex_wheel = PTHREAD_MUTEX_INITIALIZER;
+
+/* wake timer thread up conditional variable (uses the monotonic clock) */
+pthread_cond_t cond_wheel;
+
+/* timer thread */
+static pthread_t timerthread;
+
+#ifdef __linux__
+/* poller access mutex */
+pthread_mutex_t mutex_poll = PTHREAD_MUTEX_INITIALIZER;
+
+/* poller thread (created on demand) */
+static pthread_t poller;
+#endif
+
+/* autoscaler settings changed conditional variable */
+pthread_cond_t cond_autoscale = PTHREAD_COND_INITIALIZER;
+
+/* autoscaler thread */
+static pthread_t autoscaler;
+
+/* key to the worker running on the current thread (if any) */
+static pthread_key_t key_worker;
+
+/* key set on offload threads */
+static pthread_key_t key_offload;
+
+/* lua processes waiting for an offload thread and offload threads (protected
+   by 'mutex_offload') */
+static list offload_lp_list;
+static pthread_t *offloaders = NULL;
+
+/* list of all workers, including destroyed ones which can be reused. new
+   workers are only ever prepended, so it can be traversed without locks */
+static worker *workers = NULL;
+
+/* stack of parked workers, most recently parked first (protected by
+   'mutex_sched') */
+static worker *idleworkerslist = NULL;
+
+/* cpus workers are pinned to, if any (protected by 'mutex_sched') */
+static int *affinity = NULL;
+static int affinitycount = 0;
+
+#ifdef __linux__
+/* cpus threads may run on when not pinned */
+static cpu_set_t defaultcpus;
+#endif
 
 int lpcount = 0;         /* number of active luaprocs */
 int workerscount = 0;    /* number of active workers */
 int destroyworkers = 0;  /* number of workers to destroy */
+int idleworkers = 0;     /* number of workers waiting for work */
+int spinningworkers = 0; /* number of workers spinning for work */
+int joiningworkers = 0;  /* are workers being joined? */
+int quantum = 0;         /* default quantum (instructions) */
+int timeslice = 0;       /* default time slice (milliseconds) */
+int spintime = LUAPROC_SCHED_SPIN_DEFAULT;  /* spin time (microseconds) */
+int autoscale = FALSE;   /* is the worker pool sized automatically? */
+int autoscalemin = 0;    /* minimum number of workers when autoscaling */
+int autoscalemax = 0;    /* maximum number of workers when autoscaling */
+int autoscalehyst = 0;   /* time (milliseconds) before resizing */
+int autoscalerstate = 0; /* autoscaler thread: 0 = none, 1 = running,
+                            -1 = must stop */
+int offloadcount = 0;    /* number of offload threads */
+int offloadidle = 0;     /* number of offload threads waiting for work */
+int offloadmax = LUAPROC_SCHED_OFFLOAD_THREADS;  /* maximum offload threads */
+int offloadstop = FALSE; /* are offload threads being joined? */
+int timerstop = FALSE;   /* must the timer thread stop? */
+
+/* timer wheel: each slot is a circular list headed by a sentinel entry
+   (protected by 'mutex_wheel') */
+static timer wheel[LUAPROC_SCHED_WHEEL_LEVELS][LUAPROC_SCHED_WHEEL_SLOTS];
+static int wheelcount[LUAPROC_SCHED_WHEEL_LEVELS];
+static unsigned long wheelnow = 0;   /* next tick (millisecond) to process */
+static unsigned long wheelwake = 0;  /* when the timer thread wakes up */
+static int wheeltimed = FALSE;       /* is the timer thread waiting for a
+                                        timer (rather than for any)? */
+
+/* origin of scheduler time */
+static struct timespec clockbase;
+
+/* main thread's parking slot (protected by its own mutex) and the worker
+   it poses as while running lua processes (only used for preemption) */
+static parkslot mainslot = { PTHREAD_MUTEX_INITIALIZER,
+                             PTHREAD_COND_INITIALIZER, FALSE, FALSE, FALSE };
+static worker mainworker;
+int mainhelps = FALSE;   /* does the main thread run lua processes while it
+                            waits? */
+
+#ifdef __linux__
+/* poller state (protected by 'mutex_poll') */
+static int pollfd = -1;        /* epoll instance (-1 if no poller thread) */
+static int pollstopfd = -1;    /* eventfd that stops the poller thread */
+static fdslot *fdslots = NULL;
+static int fdslotcount = 0;
+static int fdslotfree = -1;    /* first free slot (-1 if none) */
+#endif
 
 /***********************
  * register prototypes *
  ***********************/
 
 static void sched_dec_lpcount( void );
+static luaproc *sched_take_next( worker *self );
+static luaproc *sched_dequeue( worker *self, int wait );
+static luaproc *sched_spin( worker *self );
+static luaproc *sched_park( worker *self );
+static void sched_wakeup( void );
+static void sched_worker_exit( worker *self );
+static void sched_arm_quantum( worker *self, luaproc *lp );
+static int sched_stopped_proc( luaproc *lp, int procstat );
+static void sched_offload_proc( luaproc *lp );
+static void sched_offload_leave( void );
+static void sched_wheel_advance( unsigned long now );
+#ifdef __linux__
+static void sched_fd_release( luaproc *lp );
+static void sched_fd_wait( luaproc *lp );
+#endif
+static int sched_wheel_next( unsigned long *next );
+static int sched_has_work( void );
+static void sched_main_signal( void );
 
 /*******************************
  * worker thread main function *
@@ -62,95 +275,286 @@ static void sched_dec_lpcount( void );
 /* worker thread main function */
 void *workermain( void *args ) {
 
+  worker *self = (worker *)args;
   luaproc *lp;
   int procstat;
 
+  pthread_setspecific( key_worker, self );
+
   /* main worker loop */
   while ( TRUE ) {
-    /*
-      wait until instructed to wake up (because there's work to do
-      or because workers must be destroyed)
-    */
-    pthread_mutex_lock( &mutex_sched );
-    while (( list_count( &ready_lp_list ) == 0 ) && ( destroyworkers <= 0 )) {
-      pthread_cond_wait( &cond_wakeup_worker, &mutex_sched );
-    }
-
-    if ( destroyworkers > 0 ) {  /* check whether workers should be destroyed */
-      
-      destroyworkers--; /* decrease workers to be destroyed count */
-      workerscount--; /* decrease active workers count */
-
-      /* remove worker from workers table */
-      lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
-      lua_pushlightuserdata( workerls, (void *)pthread_self( ));
-      lua_pushnil( workerls );
-      lua_rawset( workerls, -3 );
-      lua_pop( workerls, 1 );
 
-      pthread_cond_signal( &cond_wakeup_worker );  /* wake other workers up */
+    /* check whether workers should be destroyed */
+    if ( __atomic_load_n( &destroyworkers, __ATOMIC_SEQ_CST ) > 0 ) {
+      pthread_mutex_lock( &mutex_sched );
+      if ( destroyworkers > 0 ) {
+        sched_worker_exit( self );  /* does not return */
+      }
       pthread_mutex_unlock( &mutex_sched );
-      pthread_exit( NULL );  /* destroy itself */
     }
 
-    /* remove lua process from the ready queue */
-    lp = list_remove( &ready_lp_list );
-    pthread_mutex_unlock( &mutex_sched );
+    /* get a lua process from the local, global or another worker's queue;
+       if there is none, spin for a while and then wait until there's work to
+       do (or until workers must be destroyed) */
+    lp = sched_take_next( self );
+    if ( lp == NULL ) {
+      lp = sched_dequeue( self, FALSE );
+    }
+    if ( lp == NULL ) {
+      lp = sched_spin( self );
+    }
+    if ( lp == NULL ) {
+      lp = sched_park( self );
+    }
 
-    /* execute the lua code specified in the lua process struct */
-    procstat = luaproc_resume( luaproc_get_state( lp ), NULL,
-                               luaproc_get_numargs( lp ));
+    /* execute the lua code specified in the lua process struct (setting it
+       up first, if it has not run yet) */
+    luaproc_set_worker( lp, self );
+    if (( procstat = luaproc_start( lp )) == 0 ) {
+      sched_arm_quantum( self, lp );
+      procstat = luaproc_resume( luaproc_get_state( lp ), NULL,
+                                 luaproc_get_numargs( lp ));
+      self->running = NULL;
+    }
     /* reset the process argument count */
     luaproc_set_numargs( lp, 0 );
 
-    /* has the lua process sucessfully finished its execution? */
-    if ( procstat == 0 ) {
-      luaproc_set_status( lp, LUAPROC_STATUS_FINISHED );  
-      luaproc_recycle_insert( lp );  /* try to recycle finished lua process */
-      sched_dec_lpcount();  /* decrease active lua process count */
+    /* has the lua process finished, failed or blocked on a channel? */
+    if ( sched_stopped_proc( lp, procstat )) {
+      continue;
     }
 
-    /* has the lua process yielded? */
-    else if ( procstat == LUA_YIELD ) {
+    /* yield to make a blocking call */
+    if ( luaproc_get_status( lp ) == LUAPROC_STATUS_OFFLOAD ) {
+      sched_offload_proc( lp );
+    }
 
-      /* yield attempting to send a message */
-      if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_SEND ) {
-        luaproc_queue_sender( lp );  /* queue lua process on channel */
-        /* unlock channel */
-        luaproc_unlock_channel( luaproc_get_channel( lp ));
-      }
+    /* yield on explicit coroutine.yield call (or preemption) */
+    else { 
+      /* re-insert the job at the end of the global ready process queue,
+         behind processes that were queued before it yielded */
+      queue_insert( &ready_lp_queue[luaproc_get_priority( lp )], lp );
+    }
+  }    
+}
 
-      /* yield attempting to receive a message */
-      else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_RECV ) {
-        luaproc_queue_receiver( lp );  /* queue lua process on channel */
-        /* unlock channel */
-        luaproc_unlock_channel( luaproc_get_channel( lp ));
-      }
+/********************************
+ * offload thread main function *
+ ********************************/
+
+/* offload thread main function: runs lua processes moved off the workers to
+   make blocking calls (see luaproc.blocking) */
+void *offloadmain( void *args ) {
+
+  luaproc *lp;
+  lua_State *L;
+  int procstat;
+
+  (void)args;
+
+  pthread_setspecific( key_offload, &offloadcount );  /* any non NULL value */
+
+  pthread_mutex_lock( &mutex_offload );
+  while ( TRUE ) {
+
+    /* wait for a lua process; leave if there are too many offload threads
+       or if they are being joined */
+    while ((( lp = list_remove( &offload_lp_list )) == NULL ) &&
+           ( !offloadstop ) && ( offloadcount <= offloadmax )) {
+      offloadidle++;
+      pthread_cond_wait( &cond_offload, &mutex_offload );
+      offloadidle--;
+    }
+    if ( lp == NULL ) {
+      break;
+    }
+    pthread_mutex_unlock( &mutex_offload );
+
+    /* resume the process without preemption, telling it it has been moved */
+    L = luaproc_get_state( lp );
+    lua_sethook( L, NULL, 0, 0 );
+    lua_pushboolean( L, TRUE );
+    procstat = luaproc_resume( L, NULL, 1 );
+
+    /* processes yielding for any other reason (normally, at the end of the
+       blocking call) go back to the workers */
+    if ( !sched_stopped_proc( lp, procstat )) {
+      sched_queue_proc( lp );
+    }
+
+    pthread_mutex_lock( &mutex_offload );
+  }
+
+  /* threads being joined are waited for; others leave the pool */
+  if ( !offloadstop ) {
+    sched_offload_leave();
+  }
+  pthread_mutex_unlock( &mutex_offload );
+
+  return NULL;
+}
+
+/******************************
+ * timer thread main function *
+ ******************************/
+
+/* timer thread main function: expires timers as time goes by and sleeps
+   until the next timer (or cascade) is due */
+static void *sched_timer_main( void *args ) {
+
+  struct timespec until;
+  unsigned long next;
+
+  (void)args;
+
+  pthread_mutex_lock( &mutex_wheel );
 
-      /* yield on explicit coroutine.yield call */
-      else { 
-        /* re-insert the job at the end of the ready process queue */
-        pthread_mutex_lock( &mutex_sched );
-        list_insert( &ready_lp_list, lp );
-        pthread_mutex_unlock( &mutex_sched );
+  while ( !timerstop ) {
+    sched_wheel_advance( sched_time( ));
+    wheeltimed = sched_wheel_next( &next );
+    if ( wheeltimed ) {
+      wheelwake = next;
+      until.tv_sec = clockbase.tv_sec + next / 1000;
+      until.tv_nsec = clockbase.tv_nsec + ( next % 1000 ) * 1000000L;
+      if ( until.tv_nsec >= 1000000000L ) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
       }
+      pthread_cond_timedwait( &cond_wheel, &mutex_wheel, &until );
+    } else {
+      pthread_cond_wait( &cond_wheel, &mutex_wheel );
     }
+  }
 
-    /* or was there an error executing the lua process? */
-    else {
-      /* print error message */
-      fprintf( stderr, "close lua_State (error: %s)\n",
-               luaL_checkstring( luaproc_get_state( lp ), -1 ));
-      lua_close( luaproc_get_state( lp ));  /* close lua state */
-      sched_dec_lpcount();  /* decrease active lua process count */
+  pthread_mutex_unlock( &mutex_wheel );
+
+  return NULL;
+}
+
+#ifdef __linux__
+/*******************************
+ * poller thread main function *
+ *******************************/
+
+/* poller thread main function: requeues lua processes whose file descriptors
+   became ready */
+static void *sched_poller_main( void *args ) {
+
+  struct epoll_event events[LUAPROC_SCHED_POLL_EVENTS];
+  unsigned int index, gen;
+  luaproc *lp;
+  int i, n, stop = FALSE;
+
+  (void)args;
+
+  while ( !stop ) {
+    n = epoll_wait( pollfd, events, LUAPROC_SCHED_POLL_EVENTS, -1 );
+    pthread_mutex_lock( &mutex_poll );
+    for ( i = 0; i < n; i++ ) {
+      if ( events[i].data.u64 == LUAPROC_SCHED_POLL_STOP ) {
+        stop = TRUE;
+        continue;
+      }
+      index = (unsigned int)( events[i].data.u64 & 0xffffffffU );
+      gen = (unsigned int)( events[i].data.u64 >> 32 );
+      if (( index < (unsigned int)fdslotcount ) &&
+          ( fdslots[index].gen == gen ) && ( fdslots[index].lp != NULL )) {
+        lp = fdslots[index].lp;
+        sched_fd_release( lp );
+        if ( luaproc_get_fdwait( lp )->timed ) {
+          sched_timer_cancel( lp );
+        }
+        luaproc_set_fdresult( lp, NULL );
+        sched_queue_proc( lp );
+      }
     }
-  }    
+    pthread_mutex_unlock( &mutex_poll );
+  }
+
+  return NULL;
 }
+#endif
 
 /***********************
  * auxiliary functions *
  **********************/
 
+/* handle a lua process that has finished, failed or blocked on a channel and
+   return TRUE; return FALSE if the process has yielded for any other reason
+   (and has yet to be handled by the caller) */
+static int sched_stopped_proc( luaproc *lp, int procstat ) {
+
+  /* has the lua process sucessfully finished its execution? */
+  if ( procstat == 0 ) {
+    luaproc_set_status( lp, LUAPROC_STATUS_FINISHED );  
+    luaproc_finish( lp, TRUE );  /* hand its results to joiners, if any */
+    luaproc_recycle_insert( lp );  /* try to recycle finished lua process */
+    sched_dec_lpcount();  /* decrease active lua process count */
+  }
+
+  /* has the lua process yielded? */
+  else if ( procstat == LUA_YIELD ) {
+
+    /* yield attempting to send a message */
+    if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_SEND ) {
+      luaproc_queue_sender( lp );  /* queue lua process on channel */
+      /* unlock channel */
+      luaproc_unlock_channel( luaproc_get_channel( lp ));
+    }
+
+    /* yield attempting to receive a message */
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_RECV ) {
+      luaproc_queue_receiver( lp );  /* queue lua process on channel */
+      /* unlock channel */
+      luaproc_unlock_channel( luaproc_get_channel( lp ));
+    }
+
+    /* yield waiting on several channels */
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_SELECT ) {
+      luaproc_queue_selector( lp );  /* channels are unlocked */
+    }
+
+    /* yield waiting for room in subscriptions to a broadcast channel */
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_PUBLISH ) {
+      luaproc_queue_publisher( lp );
+    }
+
+    /* yield waiting for another lua process to finish */
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_BLOCKED_JOIN ) {
+      luaproc_queue_joiner( lp );  /* joinable is unlocked */
+    }
+
+    /* yield to sleep */
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_SLEEPING ) {
+      sched_timer_add( lp );
+    }
+
+#ifdef __linux__
+    /* yield to wait for a file descriptor */
+    else if ( luaproc_get_status( lp ) == LUAPROC_STATUS_WAITFD ) {
+      sched_fd_wait( lp );
+    }
+#endif
+
+    /* yield for any other reason */
+    else {
+      return FALSE;
+    }
+  }
+
+  /* or was there an error executing the lua process? */
+  else {
+    /* print error message */
+    fprintf( stderr, "close lua_State (error: %s)\n",
+             luaL_checkstring( luaproc_get_state( lp ), -1 ));
+    luaproc_finish( lp, FALSE );  /* joiners get the error message */
+    lua_close( luaproc_get_state( lp ));  /* close lua state */
+    sched_dec_lpcount();  /* decrease active lua process count */
+  }
+
+  return TRUE;
+}
+
 /* decrease active lua process count */
 static void sched_dec_lpcount( void ) {
   pthread_mutex_lock( &mutex_lp_count );
@@ -158,179 +562,1820 @@ static void sched_dec_lpcount( void ) {
   /* if count reaches zero, signal there are no more active processes */
   if ( lpcount == 0 ) {
     pthread_cond_signal( &cond_no_active_lp );
+    /* the main thread may be waiting for that in its parking slot */
+    pthread_mutex_lock( &mainslot.mutex );
+    if ( mainslot.waitall ) {
+      mainslot.woken = TRUE;
+      pthread_cond_signal( &mainslot.cond );
+    }
+    pthread_mutex_unlock( &mainslot.mutex );
   }
   pthread_mutex_unlock( &mutex_lp_count );
 }
 
-/**********************
- * exported functions *
- **********************/
+#if (LUA_VERSION_NUM >= 503)
+#define sched_isyieldable( L ) lua_isyieldable( L )
+#else
+/* conservatively check whether a lua process can yield from a hook: every
+   active function must be a lua function called by name from lua code, except
+   for the bottom one, which the worker resumed (it is unnamed when the lua
+   process was created from a function). functions whose call cannot be named
+   (like metamethods in lua 5.1) or that are named after internal variables
+   (like generic for iterators in lua 5.1) are not trusted */
+static int sched_isyieldable( lua_State *L ) {
+
+  lua_Debug ar, caller;
+  int level;
+
+  for ( level = 0; lua_getstack( L, level, &ar ); level++ ) {
+    lua_getinfo( L, "Sn", &ar );
+    if ( strcmp( ar.what, "C" ) == 0 ) {
+      return FALSE;
+    }
+    if ( lua_getstack( L, level + 1, &caller ) == 0 ) {
+      break;
+    }
+    if (( strcmp( ar.what, "Lua" ) == 0 ) &&
+        (( ar.name == NULL ) || ( ar.name[0] == '(' ) ||
+         ( strcmp( ar.namewhat, "" ) == 0 ) ||
+         ( strcmp( ar.namewhat, "for iterator" ) == 0 ) ||
+         ( strcmp( ar.namewhat, "metamethod" ) == 0 ))) {
+      return FALSE;
+    }
+  }
 
-/* increase active lua process count */
-void sched_inc_lpcount( void ) {
-  pthread_mutex_lock( &mutex_lp_count );
-  lpcount++;
-  pthread_mutex_unlock( &mutex_lp_count );
+  return TRUE;
 }
+#endif
 
-/* local scheduler initialization */
-int sched_init( void ) {
+/* preemption hook: make the lua process running on this worker yield when it
+   has used up its quantum or time slice */
+static void sched_preempt_hook( lua_State *L, lua_Debug *ar ) {
 
-  int i;
-  pthread_t worker;
+  worker *self = (worker *)pthread_getspecific( key_worker );
+  struct timespec now;
+  int expired;
 
-  /* initialize ready process list */
-  list_init( &ready_lp_list );
+  (void)ar;
+
+  /* only preempt a process' main coroutine */
+  if (( self == NULL ) || ( self->running == NULL ) ||
+      ( luaproc_get_state( self->running ) != L )) {
+    return;
+  }
 
-  /* initialize workers table and lua_State used to store it */
-  workerls = luaL_newstate();
-  lua_newtable( workerls );
-  lua_setglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
+  /* a budget of zero means the quantum is used up, a negative one means
+     there is no quantum (only a time slice) */
+  if ( self->budget > 0 ) {
+    self->budget -= self->hookcount;
+    if ( self->budget < 0 ) {
+      self->budget = 0;
+    }
+  }
+  expired = ( self->budget == 0 );
+  if (( !expired ) && ( self->deadline.tv_sec != 0 )) {
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    expired = (( now.tv_sec > self->deadline.tv_sec ) ||
+               (( now.tv_sec == self->deadline.tv_sec ) &&
+                ( now.tv_nsec >= self->deadline.tv_nsec )));
+  }
 
-  /* get ready to access worker threads table */
-  lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
+  /* yield back to the worker, which re-queues the process. if the process
+     cannot yield right now, try again when the hook is next called */
+  if (( expired ) && ( sched_isyieldable( L ))) {
+    lua_yield( L, 0 );
+  }
+}
 
-  /* create default number of initial worker threads */
-  for ( i = 0; i < LUAPROC_SCHED_DEFAULT_WORKER_THREADS; i++ ) {
+/* set (or clear) the preemption hook of a lua process about to be run */
+static void sched_arm_quantum( worker *self, luaproc *lp ) {
 
-    if ( pthread_create( &worker, NULL, workermain, NULL ) != 0 ) {
-      lua_pop( workerls, 1 ); /* pop workers table from stack */
-      return LUAPROC_SCHED_PTHREAD_ERROR;
+  lua_State *L = luaproc_get_state( lp );
+  int q = luaproc_get_quantum( lp );
+  int t = luaproc_get_timeslice( lp );
+
+  if ( q == LUAPROC_SCHED_QUANTUM_DEFAULT ) {
+    q = __atomic_load_n( &quantum, __ATOMIC_RELAXED );
+  }
+  if ( t == LUAPROC_SCHED_QUANTUM_DEFAULT ) {
+    t = __atomic_load_n( &timeslice, __ATOMIC_RELAXED );
+  }
+
+  self->running = lp;
+
+  if (( q == 0 ) && ( t == 0 )) {
+    lua_sethook( L, NULL, 0, 0 );
+    return;
+  }
+
+  if ( t == 0 ) {
+    /* hook is called exactly when the quantum is used up */
+    self->hookcount = q;
+    self->budget = 0;
+    self->deadline.tv_sec = 0;
+  } else {
+    /* hook is called periodically to check the clock (and the quantum) */
+    self->hookcount = LUAPROC_SCHED_TIMESLICE_CHECK;
+    if (( q > 0 ) && ( q < self->hookcount )) {
+      self->hookcount = q;
+    }
+    self->budget = ( q > 0 ) ? q : -1;
+    clock_gettime( CLOCK_MONOTONIC, &self->deadline );
+    self->deadline.tv_sec += t / 1000;
+    self->deadline.tv_nsec += ( t % 1000 ) * 1000000L;
+    if ( self->deadline.tv_nsec >= 1000000000L ) {
+      self->deadline.tv_sec++;
+      self->deadline.tv_nsec -= 1000000000L;
     }
+  }
+  lua_sethook( L, sched_preempt_hook, LUA_MASKCOUNT, self->hookcount );
+}
+
+/* acquire a ready queue's consumer lock. if 'wait' is not set, give up when
+   another worker is already removing from it */
+static int sched_acquire_queue( queue *q, int wait ) {
+  if ( wait ) {
+    queue_lock( q );
+    return TRUE;
+  }
+  return queue_trylock( q );
+}
+
+/* remove and return the first lua process in a ready queue */
+static luaproc *sched_dequeue_from( queue *q, int wait ) {
 
-    /* store worker thread id in a table */
-    lua_pushlightuserdata( workerls, (void *)worker );
-    lua_pushboolean( workerls, TRUE );
-    lua_rawset( workerls, -3 );
+  luaproc *lp;
 
-    workerscount++; /* increase active workers count */
+  if (( queue_count( q ) == 0 ) || ( !sched_acquire_queue( q, wait ))) {
+    return NULL;
   }
+  lp = queue_remove( q );
+  queue_unlock( q );
+
+  return lp;
+}
 
-  lua_pop( workerls, 1 ); /* pop workers table from stack */
+/* return the highest priority with lua processes queued at a worker */
+static int sched_highest_priority( worker *w ) {
 
-  return LUAPROC_SCHED_OK;
+  int prio;
+
+  for ( prio = 0; prio < LUAPROC_SCHED_PRIORITY_LEVELS; prio++ ) {
+    if ( queue_count( &w->ready_lp_queue[prio] ) > 0 ) {
+      return prio;
+    }
+  }
+
+  return -1;
 }
 
-/* set number of active workers */
-int sched_set_numworkers( int numworkers ) {
+/* steal half of the highest priority lua processes queued at another worker;
+   return the first one and queue the remaining ones locally */
+static luaproc *sched_steal_from( worker *self, worker *victim, int wait ) {
+
+  luaproc *lp;
+  list stolen;
+  queue *q;
+  int n, prio;
 
-  int i, delta;
-  pthread_t worker;
+  prio = sched_highest_priority( victim );
 
-  pthread_mutex_lock( &mutex_sched );
+  /* take a process handed off to a worker whose queues are empty */
+  if ( prio < 0 ) {
+    if ( __atomic_load_n( &victim->runnext, __ATOMIC_RELAXED ) != NULL ) {
+      return __atomic_exchange_n( &victim->runnext, NULL, __ATOMIC_ACQ_REL );
+    }
+    return NULL;
+  }
 
-  /* calculate delta between existing workers and set number of workers */
-  delta = numworkers - workerscount;
+  list_init( &stolen );
+  q = &victim->ready_lp_queue[prio];
+  n = ( queue_count( q ) + 1 ) / 2;
+  if ( !sched_acquire_queue( q, wait )) {
+    return NULL;
+  }
+  while (( n-- > 0 ) && (( lp = queue_remove( q )) != NULL )) {
+    list_insert( &stolen, lp );
+  }
+  queue_unlock( q );
 
-  /* create additional workers */
-  if ( numworkers > workerscount ) {
+  lp = list_remove( &stolen );
+  while ( list_count( &stolen ) > 0 ) {
+    queue_insert( &self->ready_lp_queue[prio], list_remove( &stolen ));
+  }
 
-    /* get ready to access worker threads table */
-    lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
+  return lp;
+}
 
-    /* create additional workers */
-    for ( i = 0; i < delta; i++ ) {
+/* steal lua processes from another worker. workers on the thief's numa node
+   are visited first */
+static luaproc *sched_steal( worker *self, int wait ) {
 
-      if ( pthread_create( &worker, NULL, workermain, NULL ) != 0 ) {
-        pthread_mutex_unlock( &mutex_sched );
-        lua_pop( workerls, 1 ); /* pop workers table from stack */
-        return LUAPROC_SCHED_PTHREAD_ERROR;
+  worker *victim;
+  luaproc *lp;
+  int pass, samenode;
+
+  for ( pass = 0; pass < (( self->node >= 0 ) ? 2 : 1 ); pass++ ) {
+    /* visit every other worker, starting right after the thief */
+    victim = self->next;
+    while ( victim != self ) {
+      if ( victim == NULL ) {
+        victim = __atomic_load_n( &workers, __ATOMIC_ACQUIRE );
+        continue;
+      }
+      samenode = (( self->node < 0 ) || ( victim->node == self->node ));
+      if (( samenode == ( pass == 0 )) &&
+          (( lp = sched_steal_from( self, victim, wait )) != NULL )) {
+        return lp;
       }
+      victim = victim->next;
+    }
+  }
+
+  return NULL;
+}
+
+/* return the lua process handed off to a worker, if any. after too many
+   consecutive handoffs, the process goes to the end of the ready queue
+   instead, so processes that keep handing off to each other cannot starve
+   the others */
+static luaproc *sched_take_next( worker *self ) {
+
+  luaproc *lp = NULL;
 
-      /* store worker thread id in a table */
-      lua_pushlightuserdata( workerls, (void *)worker );
-      lua_pushboolean( workerls, TRUE );
-      lua_rawset( workerls, -3 );
+  if ( __atomic_load_n( &self->runnext, __ATOMIC_RELAXED ) != NULL ) {
+    lp = __atomic_exchange_n( &self->runnext, NULL, __ATOMIC_ACQ_REL );
+  }
+  if ( lp == NULL ) {
+    self->handoffs = 0;
+  } else if ( ++self->handoffs > LUAPROC_SCHED_HANDOFF_MAX ) {
+    self->handoffs = 0;
+    queue_insert( &self->ready_lp_queue[luaproc_get_priority( lp )], lp );
+    lp = NULL;
+  }
+
+  return lp;
+}
 
-      workerscount++; /* increase active workers count */
+/* return the priority a worker should dequeue from: the highest one with
+   ready lua processes, unless a lower one has been passed over too many times
+   (aging), so low priority processes are not starved. return -1 if there are
+   no ready processes in the worker's and global queues */
+static int sched_select_priority( worker *self ) {
+
+  int prio, selected = -1;
+
+  for ( prio = 0; prio < LUAPROC_SCHED_PRIORITY_LEVELS; prio++ ) {
+    if (( queue_count( &self->ready_lp_queue[prio] ) == 0 ) &&
+        ( queue_count( &ready_lp_queue[prio] ) == 0 )) {
+      continue;
     }
+    if ( selected < 0 ) {
+      selected = prio;
+    } else if ( ++self->aging[prio] >= LUAPROC_SCHED_AGING_LIMIT ) {
+      selected = prio;
+    }
+  }
+  if ( selected >= 0 ) {
+    self->aging[selected] = 0;
+  }
+
+  return selected;
+}
+
+/* return the next lua process with a given priority from the worker's or
+   the global queue */
+static luaproc *sched_dequeue_priority( worker *self, int prio, int wait ) {
 
-    lua_pop( workerls, 1 ); /* pop workers table from stack */
+  luaproc *lp = NULL;
+
+  /* check the global queue once in a while, so processes queued from
+     outside workers are not starved by busy local queues */
+  if ( self->ticks % LUAPROC_SCHED_GLOBAL_INTERVAL == 0 ) {
+    lp = sched_dequeue_from( &ready_lp_queue[prio], wait );
   }
-  /* destroy existing workers */
-  else if ( numworkers < workerscount ) {
-    destroyworkers = destroyworkers + numworkers;
+  if ( lp == NULL ) {
+    lp = sched_dequeue_from( &self->ready_lp_queue[prio], TRUE );
+  }
+  if ( lp == NULL ) {
+    lp = sched_dequeue_from( &ready_lp_queue[prio], wait );
   }
 
-  pthread_mutex_unlock( &mutex_sched );
+  return lp;
+}
 
-  return LUAPROC_SCHED_OK;
+/* return the next lua process a worker should execute, if any. if 'wait' is
+   set, only return NULL when all ready queues are empty */
+static luaproc *sched_dequeue( worker *self, int wait ) {
+
+  luaproc *lp = NULL;
+  int prio, selected;
+
+  self->ticks++;
+
+  selected = sched_select_priority( self );
+  if ( selected >= 0 ) {
+    lp = sched_dequeue_priority( self, selected, wait );
+    for ( prio = 0; ( lp == NULL ) && ( prio < LUAPROC_SCHED_PRIORITY_LEVELS );
+          prio++ ) {
+      if ( prio != selected ) {
+        lp = sched_dequeue_priority( self, prio, wait );
+      }
+    }
+  }
+  if ( lp == NULL ) {
+    lp = sched_steal( self, wait );
+  }
+
+  return lp;
 }
 
-/* return the number of active workers */
-int sched_get_numworkers( void ) {
+/* check whether there are ready lua processes in any queue (or hand-off
+   slot) */
+static int sched_has_work( void ) {
 
-  int numworkers;
+  worker *w;
+  int prio;
 
-  pthread_mutex_lock( &mutex_sched );
-  numworkers = workerscount;
-  pthread_mutex_unlock( &mutex_sched );
+  for ( prio = 0; prio < LUAPROC_SCHED_PRIORITY_LEVELS; prio++ ) {
+    if ( queue_count( &ready_lp_queue[prio] ) > 0 ) {
+      return TRUE;
+    }
+  }
+  for ( w = __atomic_load_n( &workers, __ATOMIC_ACQUIRE ); w != NULL;
+        w = w->next ) {
+    if (( sched_highest_priority( w ) >= 0 ) ||
+        ( __atomic_load_n( &w->runnext, __ATOMIC_RELAXED ) != NULL )) {
+      return TRUE;
+    }
+  }
 
-  return numworkers;
+  return FALSE;
 }
 
-/* insert lua process in ready queue */
-void sched_queue_proc( luaproc *lp ) {
-  pthread_mutex_lock( &mutex_sched );
-  list_insert( &ready_lp_list, lp );  /* add process to ready queue */
-  /* set process status ready */
-  luaproc_set_status( lp, LUAPROC_STATUS_READY );
-  pthread_cond_signal( &cond_wakeup_worker );  /* wake worker up */
-  pthread_mutex_unlock( &mutex_sched );
+/* return the time elapsed since 'start' in microseconds */
+static long sched_elapsed( struct timespec *start ) {
+
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  return ( now.tv_sec - start->tv_sec ) * 1000000L +
+         ( now.tv_nsec - start->tv_nsec ) / 1000L;
 }
 
-/* join worker threads (called when Lua exits). not joining workers causes a
-   race condition since lua_close unregisters dynamic libs with dlclose and
-   thus libpthreads can be unloaded while there are workers that are still 
-   alive. */
-void sched_join_workers( void ) {
+/* keep looking for a lua process to execute for a while before parking,
+   since waking a parked worker up costs much more than finding work right
+   away. a worker spins for longer after spinning paid off and for shorter
+   after it did not, within the configured spin time. at most half of the
+   workers spin at the same time */
+static luaproc *sched_spin( worker *self ) {
 
-  lua_State *L = luaL_newstate();
-  const char *wtb = "workerstbcopy";
+  luaproc *lp = NULL;
+  struct timespec start;
+  int i, rounds, max;
 
-  /* wait for all running lua processes to finish */
-  sched_wait();
+  max = __atomic_load_n( &spintime, __ATOMIC_RELAXED );
+  if (( self->spin <= 0 ) || ( self->spin > max )) {
+    self->spin = max;
+  }
+  if ( max <= 0 ) {
+    return NULL;
+  }
 
-  /* initialize new state and create table to copy worker ids */
-  lua_newtable( L );
-  lua_setglobal( L, wtb );
-  lua_getglobal( L, wtb );
+  if ( __atomic_add_fetch( &spinningworkers, 1, __ATOMIC_SEQ_CST ) >
+       ( __atomic_load_n( &workerscount, __ATOMIC_RELAXED ) + 1 ) / 2 ) {
+    __atomic_sub_fetch( &spinningworkers, 1, __ATOMIC_SEQ_CST );
+    return NULL;
+  }
 
-  pthread_mutex_lock( &mutex_sched );
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  for ( rounds = 1; ( lp = sched_dequeue( self, FALSE )) == NULL; rounds++ ) {
+    if (( __atomic_load_n( &destroyworkers, __ATOMIC_SEQ_CST ) > 0 ) ||
+        ( sched_elapsed( &start ) >= self->spin )) {
+      break;
+    }
+    /* let other threads run from time to time, in case there are more
+       threads than processors */
+    if ( rounds % LUAPROC_SCHED_SPIN_YIELD == 0 ) {
+      sched_yield();
+    } else {
+      for ( i = 0; i < LUAPROC_SCHED_SPIN_PAUSE; i++ ) {
+        sched_cpu_relax();
+      }
+    }
+  }
 
-  /* determine remaining active worker threads and copy their ids */
-  lua_getglobal( workerls, LUAPROC_SCHED_WORKERS_TABLE );
-  lua_pushnil( workerls );
-  while ( lua_next( workerls, -2 ) != 0 ) {
-    lua_pushlightuserdata( L, lua_touserdata( workerls, -2 ));
-    lua_pushboolean( L, TRUE );
-    lua_rawset( L, -3 );
-    /* pop value, leave key for next iteration */
-    lua_pop( workerls, 1 );
+  /* processes queued while workers were spinning did not wake parked workers
+     up; if this was the last spinning worker, wake one up for the others */
+  if (( __atomic_sub_fetch( &spinningworkers, 1, __ATOMIC_SEQ_CST ) == 0 ) &&
+      ( lp != NULL ) && ( sched_has_work( ))) {
+    sched_wakeup();
   }
 
-  /* pop workers copy table name from stack */
-  lua_pop( L, 1 );
+  /* adapt spin time */
+  if ( lp != NULL ) {
+    self->spin = ( self->spin <= max / 2 ) ? self->spin * 2 : max;
+  } else if ( self->spin / 2 >= max / LUAPROC_SCHED_SPIN_MIN_FRACTION ) {
+    self->spin /= 2;
+  }
 
-  /* set all workers to be destroyed */
-  destroyworkers = workerscount;
+  return lp;
+}
 
-  /* wake workers up */
-  pthread_cond_signal( &cond_wakeup_worker );
-  pthread_mutex_unlock( &mutex_sched );
+/* wake a given parked worker up or, if 'w' is NULL, the most recently parked
+   one (if any). caller MUST lock 'mutex_sched' before calling this function */
+static void sched_unpark( worker *w ) {
 
-  /* join with worker threads (read ids from local table copy ) */
-  lua_getglobal( L, wtb );
-  lua_pushnil( L );
-  while ( lua_next( L, -2 ) != 0 ) {
-    pthread_join(( pthread_t )lua_touserdata( L, -2 ), NULL );
-    /* pop value, leave key for next iteration */
-    lua_pop( L, 1 );
+  worker **p = &idleworkerslist;
+
+  while (( w != NULL ) && ( *p != NULL ) && ( *p != w )) {
+    p = &(*p)->nextidle;
+  }
+  if (( w = *p ) != NULL ) {
+    *p = w->nextidle;
+    w->parked = FALSE;
+    pthread_cond_signal( &w->cond_wakeup );
+  }
+}
+
+/* wake all parked workers up. caller MUST lock 'mutex_sched' before calling
+   this function */
+static void sched_unpark_all( void ) {
+  while ( idleworkerslist != NULL ) {
+    sched_unpark( NULL );
+  }
+}
+
+/* wait until there is a lua process to execute and return it (or destroy
+   the worker if instructed to) */
+static luaproc *sched_park( worker *self ) {
+
+  luaproc *lp;
+
+  pthread_mutex_lock( &mutex_sched );
+
+  /* announce the worker is idle before checking the queues again, so
+     processes queued concurrently are either seen here or signaled */
+  __atomic_add_fetch( &idleworkers, 1, __ATOMIC_SEQ_CST );
+  while ((( lp = sched_take_next( self )) == NULL ) &&
+         (( lp = sched_dequeue( self, TRUE )) == NULL ) &&
+         ( destroyworkers <= 0 )) {
+    /* park in the worker's own slot, so it can be woken up individually */
+    if ( !self->parked ) {
+      self->parked = TRUE;
+      self->nextidle = idleworkerslist;
+      idleworkerslist = self;
+    }
+    pthread_cond_wait( &self->cond_wakeup, &mutex_sched );
+  }
+  __atomic_sub_fetch( &idleworkers, 1, __ATOMIC_SEQ_CST );
+
+  /* leave the idle list if not woken up through it */
+  if ( self->parked ) {
+    sched_unpark( self );
+  }
+
+  if ( lp == NULL ) {
+    sched_worker_exit( self );  /* does not return */
+  }
+
+  pthread_mutex_unlock( &mutex_sched );
+
+  return lp;
+}
+
+/* wake an idle worker up, if there is any and no worker is spinning (a
+   spinning worker finds new processes by itself) */
+static void sched_wakeup( void ) {
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+  if (( __atomic_load_n( &spinningworkers, __ATOMIC_SEQ_CST ) == 0 ) &&
+      ( __atomic_load_n( &idleworkers, __ATOMIC_SEQ_CST ) > 0 )) {
+    pthread_mutex_lock( &mutex_sched );
+    sched_unpark( NULL );
+    pthread_mutex_unlock( &mutex_sched );
+  } else if ( __atomic_load_n( &mainslot.idle, __ATOMIC_SEQ_CST )) {
+    sched_main_signal();  /* let the waiting main thread run it instead */
+  }
+}
+
+/* wake a given worker up if it is parked; otherwise behave as sched_wakeup */
+static void sched_wakeup_worker( worker *w ) {
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+  if ( __atomic_load_n( &idleworkers, __ATOMIC_SEQ_CST ) > 0 ) {
+    pthread_mutex_lock( &mutex_sched );
+    if ( w->parked ) {
+      sched_unpark( w );
+    } else if ( __atomic_load_n( &spinningworkers, __ATOMIC_SEQ_CST ) == 0 ) {
+      sched_unpark( NULL );
+    }
+    pthread_mutex_unlock( &mutex_sched );
+  }
+}
+
+/* return the worker running on the current thread, if any. the main thread
+   poses as a worker while it runs lua processes, but it has no queues of its
+   own: processes it queues go to the global queues */
+static worker *sched_current( void ) {
+
+  worker *self = (worker *)pthread_getspecific( key_worker );
+
+  return ( self == &mainworker ) ? NULL : self;
+}
+
+/* wake the main thread up in its parking slot (to look for lua processes to
+   run, or to check whether its wait is over) */
+static void sched_main_signal( void ) {
+  pthread_mutex_lock( &mainslot.mutex );
+  pthread_cond_signal( &mainslot.cond );
+  pthread_mutex_unlock( &mainslot.mutex );
+}
+
+/* return a ready lua process for the main thread to run while it waits:
+   the highest priority one queued globally or, failing that, at a worker.
+   busy queues are skipped */
+static luaproc *sched_main_dequeue( void ) {
+
+  worker *w;
+  luaproc *lp;
+  int prio;
+
+  for ( prio = 0; prio < LUAPROC_SCHED_PRIORITY_LEVELS; prio++ ) {
+    if (( lp = sched_dequeue_from( &ready_lp_queue[prio], FALSE )) != NULL ) {
+      return lp;
+    }
+    for ( w = __atomic_load_n( &workers, __ATOMIC_ACQUIRE ); w != NULL;
+          w = w->next ) {
+      if (( lp = sched_dequeue_from( &w->ready_lp_queue[prio],
+                                     FALSE )) != NULL ) {
+        return lp;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/* run a lua process on the main thread, as a worker would (except that it
+   is queued back globally when it yields) */
+static void sched_main_run( luaproc *lp ) {
+
+  int procstat;
+
+  pthread_setspecific( key_worker, &mainworker );
+  if (( procstat = luaproc_start( lp )) == 0 ) {
+    sched_arm_quantum( &mainworker, lp );
+    procstat = luaproc_resume( luaproc_get_state( lp ), NULL,
+                               luaproc_get_numargs( lp ));
+    mainworker.running = NULL;
+  }
+  pthread_setspecific( key_worker, NULL );
+  luaproc_set_numargs( lp, 0 );
+
+  if ( !sched_stopped_proc( lp, procstat )) {
+    if ( luaproc_get_status( lp ) == LUAPROC_STATUS_OFFLOAD ) {
+      sched_offload_proc( lp );
+    } else {
+      sched_queue_proc( lp );
+    }
+  }
+}
+
+/* check whether a (real time) deadline has passed */
+static int sched_expired( const struct timespec *until ) {
+
+  struct timespec now;
+
+  clock_gettime( CLOCK_REALTIME, &now );
+
+  return (( now.tv_sec > until->tv_sec ) ||
+          (( now.tv_sec == until->tv_sec ) &&
+           ( now.tv_nsec >= until->tv_nsec )));
+}
+
+#ifdef __linux__
+/* return the numa node of a cpu, or -1 if unknown */
+static int sched_cpu_node( int cpu ) {
+
+  char path[64];
+  DIR *dir;
+  struct dirent *entry;
+  int node = -1;
+
+  sprintf( path, "/sys/devices/system/cpu/cpu%d", cpu );
+  if (( dir = opendir( path )) == NULL ) {
+    return -1;
+  }
+  while (( entry = readdir( dir )) != NULL ) {
+    if ( sscanf( entry->d_name, "node%d", &node ) == 1 ) {
+      break;
+    }
+  }
+  closedir( dir );
+
+  return node;
+}
+#endif
+
+#ifdef __linux__
+/* choose the least used cpu of the affinity set for a worker and return it,
+   filling the worker's cpu set (if there is no affinity set, return -1 and
+   let it run on any cpu). caller MUST lock 'mutex_sched' before calling this
+   function */
+static int sched_choose_cpu( worker *self, cpu_set_t *set ) {
+
+  worker *w;
+  int i, n, cpu = -1, min = 0;
+
+  for ( i = 0; i < affinitycount; i++ ) {
+    for ( n = 0, w = workers; w != NULL; w = w->next ) {
+      if (( w != self ) && ( w->active ) && ( w->cpu == affinity[i] )) {
+        n++;
+      }
+    }
+    if (( cpu < 0 ) || ( n < min )) {
+      cpu = affinity[i];
+      min = n;
+    }
+  }
+
+  if ( cpu < 0 ) {
+    *set = defaultcpus;
+  } else {
+    CPU_ZERO( set );
+    CPU_SET( cpu, set );
+  }
+
+  return cpu;
+}
+#endif
+
+/* pin a running worker to the least used cpu of the affinity set or, if
+   there is no affinity set, let it run on any cpu. caller MUST lock
+   'mutex_sched' before calling this function */
+static int sched_pin_worker( worker *self ) {
+
+#ifdef __linux__
+  cpu_set_t set;
+  int cpu = sched_choose_cpu( self, &set );
+
+  if ( pthread_setaffinity_np( self->thread, sizeof( cpu_set_t ),
+                               &set ) != 0 ) {
+    return LUAPROC_SCHED_AFFINITY_ERROR;
+  }
+  self->cpu = cpu;
+  self->node = ( cpu < 0 ) ? -1 : sched_cpu_node( cpu );
+#else
+  (void)self;
+#endif
+
+  return LUAPROC_SCHED_OK;
+}
+
+/* destroy the calling worker. caller MUST lock 'mutex_sched' before calling
+   this function */
+static void sched_worker_exit( worker *self ) {
+
+  luaproc *lp;
+  int prio, moved = 0;
+
+  destroyworkers--; /* decrease workers to be destroyed count */
+  workerscount--; /* decrease active workers count */
+  self->active = FALSE;
+
+  /* hand processes left in the local queues over to the global queues */
+  if (( lp = __atomic_exchange_n( &self->runnext, NULL,
+                                  __ATOMIC_ACQ_REL )) != NULL ) {
+    queue_insert( &ready_lp_queue[luaproc_get_priority( lp )], lp );
+    moved++;
+  }
+  for ( prio = 0; prio < LUAPROC_SCHED_PRIORITY_LEVELS; prio++ ) {
+    queue_lock( &self->ready_lp_queue[prio] );
+    while (( lp = queue_remove( &self->ready_lp_queue[prio] )) != NULL ) {
+      queue_insert( &ready_lp_queue[prio], lp );
+      moved++;
+    }
+    queue_unlock( &self->ready_lp_queue[prio] );
+  }
+
+  /* workers being joined are waited for, others are not */
+  if ( !joiningworkers ) {
+    pthread_detach( pthread_self( ));
+  }
+
+  /* wake other workers up */
+  if (( moved > 0 ) || ( destroyworkers > 0 )) {
+    sched_unpark_all();
+  }
+  pthread_mutex_unlock( &mutex_sched );
+  pthread_exit( NULL );  /* destroy itself */
+}
+
+/* move a lua process to the offload thread pool, creating a new thread if
+   none is idle (up to the maximum). if there are no offload threads at all,
+   the process goes back to the ready queue and makes its call on a worker */
+static void sched_offload_proc( luaproc *lp ) {
+
+  pthread_t *threads;
+
+  pthread_mutex_lock( &mutex_offload );
+
+  list_insert( &offload_lp_list, lp );
+  if ( offloadidle > 0 ) {
+    pthread_cond_signal( &cond_offload );
+  } else if ( offloadcount < offloadmax ) {
+    threads = (pthread_t *)realloc( offloaders,
+                                    ( offloadcount + 1 ) * sizeof( pthread_t ));
+    if ( threads != NULL ) {
+      offloaders = threads;
+      if ( pthread_create( &offloaders[offloadcount], NULL, offloadmain,
+                           NULL ) == 0 ) {
+#ifdef __linux__
+        /* do not inherit the (pinned) worker's affinity */
+        pthread_setaffinity_np( offloaders[offloadcount], sizeof( cpu_set_t ),
+                                &defaultcpus );
+#endif
+        offloadcount++;
+      }
+    }
+  }
+
+  if ( offloadcount == 0 ) {
+    list_remove( &offload_lp_list );
+    pthread_mutex_unlock( &mutex_offload );
+    sched_queue_proc( lp );
+    return;
+  }
+
+  pthread_mutex_unlock( &mutex_offload );
+}
+
+/* remove the calling thread from the offload thread pool. caller MUST lock
+   'mutex_offload' before calling this function */
+static void sched_offload_leave( void ) {
+
+  int i;
+
+  for ( i = 0; !pthread_equal( offloaders[i], pthread_self( )); i++ );
+  offloaders[i] = offloaders[--offloadcount];
+  pthread_detach( pthread_self( ));
+}
+
+/* link a timer to the wheel slot matching its deadline. caller MUST lock
+   'mutex_wheel' before calling this function */
+static void sched_wheel_insert( timer *t ) {
+
+  unsigned long expires = t->expires;
+  timer *slot;
+  int level;
+
+  /* overdue timers go to the next slot to be processed; timers beyond the
+     wheel's span go to its last slot, to be cascaded down later */
+  if ((long)( expires - wheelnow ) < 0 ) {
+    expires = wheelnow;
+  } else if ( expires - wheelnow >= LUAPROC_SCHED_WHEEL_SPAN ) {
+    expires = wheelnow + LUAPROC_SCHED_WHEEL_SPAN - 1;
+  }
+  for ( level = 0; ( level < LUAPROC_SCHED_WHEEL_LEVELS - 1 ) &&
+        ( expires - wheelnow >=
+          1UL << ( LUAPROC_SCHED_WHEEL_BITS * ( level + 1 ))); level++ );
+
+  slot = &wheel[level][( expires >> ( LUAPROC_SCHED_WHEEL_BITS * level )) &
+                       LUAPROC_SCHED_WHEEL_MASK];
+  t->prev = slot->prev;
+  t->next = slot;
+  slot->prev->next = t;
+  slot->prev = t;
+  t->level = level;
+  wheelcount[level]++;
+}
+
+/* unlink a timer from the wheel. caller MUST lock 'mutex_wheel' before
+   calling this function */
+static void sched_wheel_remove( timer *t ) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  wheelcount[t->level]--;
+  t->level = -1;
+}
+
+/* re-insert the timers of a slot, which move to lower levels. caller MUST
+   lock 'mutex_wheel' before calling this function */
+static void sched_wheel_cascade( timer *slot ) {
+
+  timer *t;
+
+  while (( t = slot->next ) != slot ) {
+    sched_wheel_remove( t );
+    sched_wheel_insert( t );
+  }
+}
+
+/* process all ticks up to 'now', expiring due timers. caller MUST lock
+   'mutex_wheel' before calling this function */
+static void sched_wheel_advance( unsigned long now ) {
+
+  timer *t, *slot;
+  unsigned long skip;
+  int level, index;
+
+  while ((long)( now - wheelnow ) >= 0 ) {
+
+    index = wheelnow & LUAPROC_SCHED_WHEEL_MASK;
+
+    /* while the first level is empty, go straight to the next cascade */
+    if (( wheelcount[0] == 0 ) && ( index != 0 )) {
+      skip = LUAPROC_SCHED_WHEEL_SLOTS - index;
+      if ( skip > now - wheelnow + 1 ) {
+        skip = now - wheelnow + 1;
+      }
+      wheelnow += skip;
+      continue;
+    }
+
+    /* at the start of each round of a level, cascade the timers of the
+       matching slot of the level above */
+    for ( level = 1; ( index == 0 ) && ( level < LUAPROC_SCHED_WHEEL_LEVELS );
+          level++ ) {
+      index = ( wheelnow >> ( LUAPROC_SCHED_WHEEL_BITS * level )) &
+              LUAPROC_SCHED_WHEEL_MASK;
+      sched_wheel_cascade( &wheel[level][index] );
+    }
+
+    /* expire the timers of this tick; those that cannot be handled right now
+       are retried on the next one */
+    slot = &wheel[0][wheelnow & LUAPROC_SCHED_WHEEL_MASK];
+    wheelnow++;
+    while (( t = slot->next ) != slot ) {
+      sched_wheel_remove( t );
+      if ( !luaproc_timeout( t->lp )) {
+        t->expires = wheelnow;
+        sched_wheel_insert( t );
+      }
+    }
+  }
+}
+
+/* return in 'next' when the timer thread must wake up to expire or cascade
+   timers; return FALSE if there are no timers. caller MUST lock
+   'mutex_wheel' before calling this function */
+static int sched_wheel_next( unsigned long *next ) {
+
+  unsigned long unit;
+  int level, i;
+
+  if ( wheelcount[0] > 0 ) {
+    for ( i = 0; i < LUAPROC_SCHED_WHEEL_SLOTS; i++ ) {
+      if ( wheel[0][( wheelnow + i ) & LUAPROC_SCHED_WHEEL_MASK].next !=
+           &wheel[0][( wheelnow + i ) & LUAPROC_SCHED_WHEEL_MASK] ) {
+        *next = wheelnow + i;
+        return TRUE;
+      }
+    }
+  }
+  for ( level = 1; level < LUAPROC_SCHED_WHEEL_LEVELS; level++ ) {
+    if ( wheelcount[level] > 0 ) {
+      unit = 1UL << ( LUAPROC_SCHED_WHEEL_BITS * level );
+      *next = ( wheelnow + unit - 1 ) & ~( unit - 1 );
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+#ifdef __linux__
+/* create the epoll instance and the poller thread, unless already created.
+   caller MUST lock 'mutex_poll' before calling this function */
+static int sched_poller_start( void ) {
+
+  struct epoll_event ev;
+
+  if ( pollfd >= 0 ) {
+    return LUAPROC_SCHED_OK;
+  }
+
+  pollfd = epoll_create1( EPOLL_CLOEXEC );
+  pollstopfd = eventfd( 0, EFD_CLOEXEC );
+  ev.events = EPOLLIN;
+  ev.data.u64 = LUAPROC_SCHED_POLL_STOP;
+  if (( pollfd < 0 ) || ( pollstopfd < 0 ) ||
+      ( epoll_ctl( pollfd, EPOLL_CTL_ADD, pollstopfd, &ev ) != 0 ) ||
+      ( pthread_create( &poller, NULL, sched_poller_main, NULL ) != 0 )) {
+    if ( pollfd >= 0 ) {
+      close( pollfd );
+    }
+    if ( pollstopfd >= 0 ) {
+      close( pollstopfd );
+    }
+    pollfd = pollstopfd = -1;
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+
+  return LUAPROC_SCHED_OK;
+}
+
+/* unregister a lua process' file descriptor wait from the poller. caller MUST
+   lock 'mutex_poll' before calling this function */
+static void sched_fd_release( luaproc *lp ) {
+
+  fdwait *fw = luaproc_get_fdwait( lp );
+
+  epoll_ctl( pollfd, EPOLL_CTL_DEL, fw->fd, NULL );
+  fdslots[fw->slot].lp = NULL;
+  fdslots[fw->slot].gen++;
+  fdslots[fw->slot].nextfree = fdslotfree;
+  fdslotfree = fw->slot;
+  fw->slot = -1;
+}
+
+/* register a lua process that yielded to wait for a file descriptor with the
+   poller; on failure, queue it back with an error */
+static void sched_fd_wait( luaproc *lp ) {
+
+  fdwait *fw = luaproc_get_fdwait( lp );
+  struct epoll_event ev;
+  fdslot *slots;
+  int i, count, slot;
+
+  pthread_mutex_lock( &mutex_poll );
+
+  if ( sched_poller_start() != LUAPROC_SCHED_OK ) {
+    luaproc_set_fdresult( lp, "failed to create poller thread" );
+    sched_queue_proc( lp );
+    pthread_mutex_unlock( &mutex_poll );
+    return;
+  }
+
+  /* grow the registration table if there is no free slot */
+  if ( fdslotfree < 0 ) {
+    count = fdslotcount * 2 + 16;
+    slots = (fdslot *)realloc( fdslots, count * sizeof( fdslot ));
+    if ( slots == NULL ) {
+      luaproc_set_fdresult( lp, "not enough memory" );
+      sched_queue_proc( lp );
+      pthread_mutex_unlock( &mutex_poll );
+      return;
+    }
+    for ( i = count - 1; i >= fdslotcount; i-- ) {
+      slots[i].lp = NULL;
+      slots[i].gen = 0;
+      slots[i].nextfree = fdslotfree;
+      fdslotfree = i;
+    }
+    fdslots = slots;
+    fdslotcount = count;
+  }
+  slot = fdslotfree;
+
+  /* one shot: the poller unregisters the file descriptor when it is ready */
+  ev.events = ( fw->write ? EPOLLOUT : EPOLLIN ) | EPOLLONESHOT;
+  ev.data.u64 = ((uint64_t)fdslots[slot].gen << 32 ) | (unsigned int)slot;
+  if ( epoll_ctl( pollfd, EPOLL_CTL_ADD, fw->fd, &ev ) != 0 ) {
+    /* epoll does not support regular files, which are always ready */
+    if ( errno == EPERM ) {
+      luaproc_set_fdresult( lp, NULL );
+    } else if ( errno == EEXIST ) {
+      luaproc_set_fdresult( lp,
+                            "file descriptor is already being waited for" );
+    } else {
+      luaproc_set_fdresult( lp, strerror( errno ));
+    }
+    sched_queue_proc( lp );
+    pthread_mutex_unlock( &mutex_poll );
+    return;
+  }
+  fdslotfree = fdslots[slot].nextfree;
+  fdslots[slot].lp = lp;
+  fw->slot = slot;
+
+  /* lock order is poller, then timers */
+  if ( fw->timed ) {
+    sched_timer_add( lp );
+  }
+
+  pthread_mutex_unlock( &mutex_poll );
+}
+#endif
+
+/* initialize a set of ready queues (one per priority) */
+static int sched_init_queues( queue *q ) {
+
+  int prio;
+
+  for ( prio = 0; prio < LUAPROC_SCHED_PRIORITY_LEVELS; prio++ ) {
+    if ( !queue_init( &q[prio] )) {
+      while ( --prio >= 0 ) {
+        queue_destroy( &q[prio] );
+      }
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* release a set of (empty) ready queues */
+static void sched_destroy_queues( queue *q ) {
+
+  int prio;
+
+  for ( prio = 0; prio < LUAPROC_SCHED_PRIORITY_LEVELS; prio++ ) {
+    queue_destroy( &q[prio] );
+  }
+}
+
+/* create a new worker thread, pinned as sched_pin_worker would. if it cannot
+   be pinned, it is created unpinned and LUAPROC_SCHED_AFFINITY_ERROR is
+   returned. caller MUST lock 'mutex_sched' before calling this function */
+static int sched_create_worker( void ) {
+
+  worker *w;
+  pthread_attr_t attr;
+  int ret = LUAPROC_SCHED_OK, created;
+#ifdef __linux__
+  cpu_set_t set;
+#endif
+
+  /* reuse a destroyed worker, if any */
+  for ( w = workers; w != NULL; w = w->next ) {
+    if ( !w->active ) {
+      break;
+    }
+  }
+
+  /* otherwise add a new one to the workers list */
+  if ( w == NULL ) {
+    w = (worker *)malloc( sizeof( worker ));
+    if ( w == NULL ) {
+      return LUAPROC_SCHED_PTHREAD_ERROR;
+    }
+    if ( !sched_init_queues( w->ready_lp_queue )) {
+      free( w );
+      return LUAPROC_SCHED_PTHREAD_ERROR;
+    }
+    if ( pthread_cond_init( &w->cond_wakeup, NULL ) != 0 ) {
+      sched_destroy_queues( w->ready_lp_queue );
+      free( w );
+      return LUAPROC_SCHED_PTHREAD_ERROR;
+    }
+    w->active = FALSE;
+    w->runnext = NULL;
+    w->next = workers;
+    __atomic_store_n( &workers, w, __ATOMIC_RELEASE );
+  }
+
+  w->ticks = 0;
+  w->handoffs = 0;
+  w->running = NULL;
+  w->spin = spintime;
+  w->parked = FALSE;
+  w->nextidle = NULL;
+  memset( w->aging, 0, sizeof( w->aging ));
+  w->cpu = -1;
+  w->node = -1;
+
+  /* new threads would inherit the creator's affinity, so the worker's own is
+     set as it is created (its cpu and node are set before it reads them) */
+  if ( pthread_attr_init( &attr ) != 0 ) {
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+#ifdef __linux__
+  w->cpu = sched_choose_cpu( w, &set );
+  w->node = ( w->cpu < 0 ) ? -1 : sched_cpu_node( w->cpu );
+  if ( pthread_attr_setaffinity_np( &attr, sizeof( cpu_set_t ),
+                                    &set ) != 0 ) {
+    w->cpu = -1;
+    w->node = -1;
+    ret = LUAPROC_SCHED_AFFINITY_ERROR;
+  }
+#endif
+  created = ( pthread_create( &w->thread, &attr, workermain, w ) == 0 );
+  pthread_attr_destroy( &attr );
+  if (( !created ) && ( ret == LUAPROC_SCHED_OK )) {
+    /* the affinity may be what failed: try again without it */
+    w->cpu = -1;
+    w->node = -1;
+    ret = LUAPROC_SCHED_AFFINITY_ERROR;
+    created = ( pthread_create( &w->thread, NULL, workermain, w ) == 0 );
+  }
+  if ( !created ) {
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+  w->active = TRUE;
+
+  workerscount++; /* increase active workers count */
+
+  return ret;
+}
+
+/* set number of active workers (workers that cannot be pinned are created
+   anyway, but LUAPROC_SCHED_AFFINITY_ERROR is returned). caller MUST lock
+   'mutex_sched' before calling this function */
+static int sched_resize( int numworkers ) {
+
+  int delta, cancel, created, ret = LUAPROC_SCHED_OK;
+
+  /* calculate delta between remaining workers and set number of workers */
+  delta = numworkers - ( workerscount - destroyworkers );
+
+  /* create additional workers (cancelling pending destructions first) */
+  if ( delta > 0 ) {
+    cancel = ( delta < destroyworkers ) ? delta : destroyworkers;
+    destroyworkers -= cancel;
+    delta -= cancel;
+    while ( delta-- > 0 ) {
+      if (( created = sched_create_worker( )) != LUAPROC_SCHED_OK ) {
+        ret = created;
+        if ( created == LUAPROC_SCHED_PTHREAD_ERROR ) {
+          break;
+        }
+      }
+    }
+  }
+  /* destroy existing workers */
+  else if ( delta < 0 ) {
+    destroyworkers = destroyworkers - delta;
+    sched_unpark_all();  /* wake idle workers */
+  }
+
+  return ret;
+}
+
+/* autoscaler thread main function: periodically samples the ready queues and
+   the idle workers, adding workers while processes keep waiting for busy
+   workers and removing them while workers keep idling */
+static void *sched_autoscaler( void *args ) {
+
+  struct timespec until, last;
+  int depths[LUAPROC_SCHED_PRIORITY_LEVELS];
+  int prio, depth, idle, numworkers, elapsed;
+  int busyfor = 0, idlefor = 0;
+
+  (void)args;
+
+  pthread_mutex_lock( &mutex_sched );
+  clock_gettime( CLOCK_MONOTONIC, &last );
+
+  while ( autoscalerstate > 0 ) {
+
+    /* wait until autoscaling is enabled or for the next sample */
+    if ( !autoscale ) {
+      pthread_cond_wait( &cond_autoscale, &mutex_sched );
+      busyfor = idlefor = 0;
+      clock_gettime( CLOCK_MONOTONIC, &last );
+      continue;
+    }
+    clock_gettime( CLOCK_REALTIME, &until );
+    until.tv_nsec += LUAPROC_SCHED_AUTOSCALE_PERIOD * 1000000L;
+    if ( until.tv_nsec >= 1000000000L ) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait( &cond_autoscale, &mutex_sched, &until );
+    if (( !autoscale ) || ( autoscalerstate <= 0 )) {
+      continue;
+    }
+    elapsed = sched_elapsed( &last ) / 1000;
+    clock_gettime( CLOCK_MONOTONIC, &last );
+
+    /* sample load */
+    sched_get_queue_depths( depths );
+    for ( depth = 0, prio = 0; prio < LUAPROC_SCHED_PRIORITY_LEVELS; prio++ ) {
+      depth += depths[prio];
+    }
+    idle = __atomic_load_n( &idleworkers, __ATOMIC_SEQ_CST ) +
+           __atomic_load_n( &spinningworkers, __ATOMIC_SEQ_CST );
+    numworkers = workerscount - destroyworkers;
+
+    /* resize only after the load has been stable for the hysteresis time */
+    if (( depth > 0 ) && ( idle == 0 )) {
+      busyfor += elapsed;
+      idlefor = 0;
+    } else if (( depth == 0 ) && ( idle > 0 )) {
+      idlefor += elapsed;
+      busyfor = 0;
+    } else {
+      busyfor = idlefor = 0;
+    }
+
+    /* grow by as many workers as there are waiting processes, at most
+       doubling the pool; shrink one worker at a time */
+    if (( busyfor >= autoscalehyst ) && ( numworkers < autoscalemax )) {
+      numworkers += ( depth < numworkers ) ? depth : numworkers;
+      sched_resize(( numworkers < autoscalemax ) ? numworkers : autoscalemax );
+      busyfor = 0;
+    } else if (( idlefor >= autoscalehyst ) &&
+               ( numworkers > autoscalemin )) {
+      sched_resize( numworkers - 1 );
+      idlefor = 0;
+    }
+  }
+
+  pthread_mutex_unlock( &mutex_sched );
+
+  return NULL;
+}
+
+/**********************
+ * exported functions *
+ **********************/
+
+/* increase active lua process count */
+void sched_inc_lpcount( void ) {
+  pthread_mutex_lock( &mutex_lp_count );
+  lpcount++;
+  pthread_mutex_unlock( &mutex_lp_count );
+}
+
+/* initialize the timer wheel and start the timer thread */
+static int sched_init_wheel( void ) {
+
+  pthread_condattr_t attr;
+  int level, i;
+
+  for ( level = 0; level < LUAPROC_SCHED_WHEEL_LEVELS; level++ ) {
+    for ( i = 0; i < LUAPROC_SCHED_WHEEL_SLOTS; i++ ) {
+      wheel[level][i].prev = wheel[level][i].next = &wheel[level][i];
+    }
+    wheelcount[level] = 0;
+  }
+  clock_gettime( CLOCK_MONOTONIC, &clockbase );
+  wheelnow = 0;
+
+  pthread_condattr_init( &attr );
+  pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+  pthread_cond_init( &cond_wheel, &attr );
+  pthread_condattr_destroy( &attr );
+
+  if ( pthread_create( &timerthread, NULL, sched_timer_main, NULL ) != 0 ) {
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+
+  return LUAPROC_SCHED_OK;
+}
+
+/* local scheduler initialization */
+int sched_init( void ) {
+
+  int i, ret = LUAPROC_SCHED_OK;
+
+  /* initialize global ready process queues */
+  if ( !sched_init_queues( ready_lp_queue )) {
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+
+#ifdef __linux__
+  /* save the cpus unpinned workers may run on */
+  if ( sched_getaffinity( 0, sizeof( cpu_set_t ), &defaultcpus ) != 0 ) {
+    for ( i = 0; i < CPU_SETSIZE; i++ ) {
+      CPU_SET( i, &defaultcpus );
+    }
+  }
+#endif
+
+  /* spinning only pays off if other threads can queue processes meanwhile */
+  if ( sysconf( _SC_NPROCESSORS_ONLN ) <= 1 ) {
+    spintime = 0;
+  }
+
+  /* initialize key used to find out the current worker */
+  if ( pthread_key_create( &key_worker, NULL ) != 0 ) {
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+
+  /* initialize timer wheel and start the timer thread */
+  if ( sched_init_wheel( ) != LUAPROC_SCHED_OK ) {
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+
+  /* initialize offload thread pool */
+  if ( pthread_key_create( &key_offload, NULL ) != 0 ) {
+    return LUAPROC_SCHED_PTHREAD_ERROR;
+  }
+  list_init( &offload_lp_list );
+
+  /* create default number of initial worker threads */
+  pthread_mutex_lock( &mutex_sched );
+  for ( i = 0; i < LUAPROC_SCHED_DEFAULT_WORKER_THREADS; i++ ) {
+    if (( ret = sched_create_worker( )) == LUAPROC_SCHED_PTHREAD_ERROR ) {
+      break;
+    }
+  }
+  pthread_mutex_unlock( &mutex_sched );
+
+  return ret;
+}
+
+/* set number of active workers (disables autoscaling) */
+int sched_set_numworkers( int numworkers ) {
+
+  int ret;
+
+  pthread_mutex_lock( &mutex_sched );
+  autoscale = FALSE;
+  ret = sched_resize( numworkers );
+  pthread_mutex_unlock( &mutex_sched );
+
+  return ret;
+}
+
+/* pin workers to a set of cpus (an empty set unpins them) */
+int sched_set_affinity( const int *cpus, int ncpus ) {
+
+  worker *w;
+  int ret = LUAPROC_SCHED_OK;
+#ifdef __linux__
+  int i;
+
+  for ( i = 0; i < ncpus; i++ ) {
+    if (( cpus[i] < 0 ) || ( cpus[i] >= CPU_SETSIZE ) ||
+        ( !CPU_ISSET( cpus[i], &defaultcpus ))) {
+      return LUAPROC_SCHED_AFFINITY_ERROR;
+    }
+  }
+#else
+  if ( ncpus > 0 ) {
+    return LUAPROC_SCHED_AFFINITY_ERROR;
+  }
+#endif
+
+  pthread_mutex_lock( &mutex_sched );
+
+  /* replace the affinity set */
+  free( affinity );
+  affinity = NULL;
+  affinitycount = 0;
+  if ( ncpus > 0 ) {
+    affinity = (int *)malloc( ncpus * sizeof( int ));
+    if ( affinity == NULL ) {
+      pthread_mutex_unlock( &mutex_sched );
+      return LUAPROC_SCHED_PTHREAD_ERROR;
+    }
+    memcpy( affinity, cpus, ncpus * sizeof( int ));
+    affinitycount = ncpus;
+  }
+
+  /* re-pin active workers, spreading them over the new set */
+  for ( w = workers; w != NULL; w = w->next ) {
+    w->cpu = -1;
+  }
+  for ( w = workers; w != NULL; w = w->next ) {
+    if (( w->active ) && ( sched_pin_worker( w ) != LUAPROC_SCHED_OK )) {
+      ret = LUAPROC_SCHED_AFFINITY_ERROR;
+    }
+  }
+
+  pthread_mutex_unlock( &mutex_sched );
+
+  return ret;
+}
+
+/* size the worker pool automatically, between a minimum and a maximum number
+   of workers. a minimum of zero disables autoscaling */
+int sched_set_autoscale( int min, int max, int hysteresis ) {
+
+  int numworkers, ret = LUAPROC_SCHED_OK;
+
+  pthread_mutex_lock( &mutex_sched );
+
+  if ( min <= 0 ) {
+    autoscale = FALSE;
+    pthread_mutex_unlock( &mutex_sched );
+    return ret;
+  }
+
+  autoscalemin = min;
+  autoscalemax = max;
+  autoscalehyst = hysteresis;
+
+  /* bring the number of workers within limits right away */
+  numworkers = workerscount - destroyworkers;
+  if ( numworkers < min ) {
+    ret = sched_resize( min );
+  } else if ( numworkers > max ) {
+    ret = sched_resize( max );
+  }
+
+  /* start the autoscaler thread the first time it is needed (workers that
+     could not be pinned do not stop it) */
+  if (( ret != LUAPROC_SCHED_PTHREAD_ERROR ) && ( autoscalerstate == 0 )) {
+    if ( pthread_create( &autoscaler, NULL, sched_autoscaler, NULL ) != 0 ) {
+      ret = LUAPROC_SCHED_PTHREAD_ERROR;
+    } else {
+      autoscalerstate = 1;
+    }
+  }
+  autoscale = ( ret != LUAPROC_SCHED_PTHREAD_ERROR );
+  pthread_cond_signal( &cond_autoscale );
+
+  pthread_mutex_unlock( &mutex_sched );
+
+  return ret;
+}
+
+/* set maximum number of offload threads (0 = blocking calls are made on the
+   workers themselves) */
+void sched_set_offload_threads( int n ) {
+  pthread_mutex_lock( &mutex_offload );
+  offloadmax = n;
+  pthread_cond_broadcast( &cond_offload );  /* let extra threads leave */
+  pthread_mutex_unlock( &mutex_offload );
+}
+
+/* return the current scheduler time (in milliseconds) */
+unsigned long sched_time( void ) {
+
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  return (unsigned long)(( now.tv_sec - clockbase.tv_sec ) * 1000L +
+                         ( now.tv_nsec - clockbase.tv_nsec ) / 1000000L );
+}
+
+/* arm a lua process' timer (its deadline must be set); the scheduler calls
+   luaproc_timeout when it expires */
+void sched_timer_add( luaproc *lp ) {
+
+  timer *t = luaproc_get_timer( lp );
+  int level, empty = TRUE;
+
+  pthread_mutex_lock( &mutex_wheel );
+
+  /* an empty wheel may be far behind; catch up without going tick by tick */
+  for ( level = 0; level < LUAPROC_SCHED_WHEEL_LEVELS; level++ ) {
+    if ( wheelcount[level] > 0 ) {
+      empty = FALSE;
+    }
+  }
+  if ( empty ) {
+    wheelnow = sched_time();
+  }
+
+  t->lp = lp;
+  sched_wheel_insert( t );
+
+  /* wake the timer thread up if the new timer is due first */
+  if (( !wheeltimed ) || ((long)( t->expires - wheelwake ) < 0 )) {
+    pthread_cond_signal( &cond_wheel );
+  }
+
+  pthread_mutex_unlock( &mutex_wheel );
+}
+
+/* disarm a lua process' timer, if armed */
+void sched_timer_cancel( luaproc *lp ) {
+
+  timer *t = luaproc_get_timer( lp );
+
+  pthread_mutex_lock( &mutex_wheel );
+  if ( t->level >= 0 ) {
+    sched_wheel_remove( t );
+  }
+  pthread_mutex_unlock( &mutex_wheel );
+}
+
+#ifdef __linux__
+/* time a lua process' file descriptor wait out, unregistering it from the
+   poller (called with the timer wheel locked, so it only tries to lock the
+   poller; returns FALSE if it must be retried later) */
+int sched_fd_expire( luaproc *lp ) {
+
+  if ( pthread_mutex_trylock( &mutex_poll ) != 0 ) {
+    return FALSE;
+  }
+  sched_fd_release( lp );
+  pthread_mutex_unlock( &mutex_poll );
+
+  return TRUE;
+}
+#endif
+
+/* check whether the calling thread is an offload thread */
+int sched_is_offload_thread( void ) {
+  return ( pthread_getspecific( key_offload ) != NULL );
+}
+
+/* set default quantum */
+void sched_set_quantum( int q ) {
+  __atomic_store_n( &quantum, q, __ATOMIC_RELAXED );
+}
+
+/* set default time slice */
+void sched_set_timeslice( int t ) {
+  __atomic_store_n( &timeslice, t, __ATOMIC_RELAXED );
+}
+
+/* set time idle workers spin before parking */
+void sched_set_spin( int spin ) {
+  __atomic_store_n( &spintime, spin, __ATOMIC_RELAXED );
+}
+
+/* return the number of active workers */
+int sched_get_numworkers( void ) {
+
+  int numworkers;
+
+  pthread_mutex_lock( &mutex_sched );
+  numworkers = workerscount;
+  pthread_mutex_unlock( &mutex_sched );
+
+  return numworkers;
+}
+
+/* insert lua process in ready queue. processes queued by a worker go to its
+   local queue; others go to the global queue */
+void sched_queue_proc( luaproc *lp ) {
+
+  worker *self = sched_current();
+  worker *last = (worker *)luaproc_get_worker( lp );
+
+  /* set process status ready */
+  luaproc_set_status( lp, LUAPROC_STATUS_READY );
+
+  /* processes last run by a pinned worker go back to it, since their memory
+     is likely to be close to it (and maybe still in its caches) */
+  if (( last != NULL ) && ( last != self ) && ( last->cpu >= 0 ) &&
+      ( last->active )) {
+    queue_insert( &last->ready_lp_queue[luaproc_get_priority( lp )], lp );
+    sched_wakeup_worker( last );
+    return;
+  }
+
+  if ( self != NULL ) {
+    /* add process to local queue */
+    queue_insert( &self->ready_lp_queue[luaproc_get_priority( lp )], lp );
+  } else {
+    /* add process to global queue */
+    queue_insert( &ready_lp_queue[luaproc_get_priority( lp )], lp );
+  }
+
+  sched_wakeup();  /* wake worker up */
+}
+
+/* run lua process next on the current worker, right after the running one
+   yields or blocks (eg, a receiver matched by the running process). if not
+   called from a worker, just queue the process */
+void sched_queue_proc_next( luaproc *lp ) {
+
+  worker *self = sched_current();
+  worker *last = (worker *)luaproc_get_worker( lp );
+  luaproc *prev;
+  int prio;
+
+  /* do not move a process to another numa node */
+  if (( self == NULL ) ||
+      (( last != NULL ) && ( last->node >= 0 ) && ( last->node != self->node ))) {
+    sched_queue_proc( lp );
+    return;
+  }
+
+  /* do not let a process overtake higher priority ready processes */
+  for ( prio = 0; prio < luaproc_get_priority( lp ); prio++ ) {
+    if (( queue_count( &self->ready_lp_queue[prio] ) > 0 ) ||
+        ( queue_count( &ready_lp_queue[prio] ) > 0 )) {
+      sched_queue_proc( lp );
+      return;
+    }
+  }
+
+  /* set process status ready */
+  luaproc_set_status( lp, LUAPROC_STATUS_READY );
+
+  /* a process previously handed off loses its turn and is queued */
+  prev = __atomic_exchange_n( &self->runnext, lp, __ATOMIC_ACQ_REL );
+  if ( prev != NULL ) {
+    queue_insert( &self->ready_lp_queue[luaproc_get_priority( prev )], prev );
+  }
+
+  /* the current process may keep running for a while, so an idle worker is
+     woken up (unless one is spinning) to steal the slot meanwhile */
+  sched_wakeup();
+}
+
+/* return the number of ready lua processes of each priority */
+void sched_get_queue_depths( int *depths ) {
+
+  worker *w;
+  luaproc *lp;
+  int prio;
+
+  for ( prio = 0; prio < LUAPROC_SCHED_PRIORITY_LEVELS; prio++ ) {
+    depths[prio] = queue_count( &ready_lp_queue[prio] );
+  }
+  for ( w = __atomic_load_n( &workers, __ATOMIC_ACQUIRE ); w != NULL;
+        w = w->next ) {
+    for ( prio = 0; prio < LUAPROC_SCHED_PRIORITY_LEVELS; prio++ ) {
+      depths[prio] += queue_count( &w->ready_lp_queue[prio] );
+    }
+    /* a handed off process might be run at any time; count it anyway */
+    if (( lp = __atomic_load_n( &w->runnext, __ATOMIC_ACQUIRE )) != NULL ) {
+      depths[luaproc_get_priority( lp )]++;
+    }
+  }
+}
+
+/* join worker threads (called when Lua exits). not joining workers causes a
+   race condition since lua_close unregisters dynamic libs with dlclose and
+   thus libpthreads can be unloaded while there are workers that are still 
+   alive. */
+void sched_join_workers( void ) {
+
+  worker *w;
+  pthread_t *threads;
+  int i, n = 0;
+
+  /* wait for all running lua processes to finish */
+  sched_wait();
+
+  /* stop the autoscaler, so it does not resize the pool while it is joined */
+  pthread_mutex_lock( &mutex_sched );
+  autoscale = FALSE;
+  if ( autoscalerstate > 0 ) {
+    autoscalerstate = -1;
+    pthread_cond_signal( &cond_autoscale );
+    pthread_mutex_unlock( &mutex_sched );
+    pthread_join( autoscaler, NULL );
+    pthread_mutex_lock( &mutex_sched );
+  }
+  autoscalerstate = 0;
+  pthread_mutex_unlock( &mutex_sched );
+
+  /* stop offload threads */
+  pthread_mutex_lock( &mutex_offload );
+  offloadstop = TRUE;
+  pthread_cond_broadcast( &cond_offload );
+  pthread_mutex_unlock( &mutex_offload );
+  for ( i = 0; i < offloadcount; i++ ) {
+    pthread_join( offloaders[i], NULL );
+  }
+  free( offloaders );
+  offloaders = NULL;
+  offloadcount = 0;
+  offloadstop = FALSE;
+
+  /* stop the timer thread */
+  pthread_mutex_lock( &mutex_wheel );
+  timerstop = TRUE;
+  pthread_cond_signal( &cond_wheel );
+  pthread_mutex_unlock( &mutex_wheel );
+  pthread_join( timerthread, NULL );
+  pthread_cond_destroy( &cond_wheel );
+  timerstop = FALSE;
+
+#ifdef __linux__
+  /* stop the poller thread */
+  if ( pollfd >= 0 ) {
+    eventfd_write( pollstopfd, 1 );
+    pthread_join( poller, NULL );
+    close( pollstopfd );
+    close( pollfd );
+    pollfd = pollstopfd = -1;
+  }
+  free( fdslots );
+  fdslots = NULL;
+  fdslotcount = 0;
+  fdslotfree = -1;
+#endif
+
+  pthread_mutex_lock( &mutex_sched );
+
+  /* determine remaining active worker threads and copy their ids */
+  threads = (pthread_t *)malloc( workerscount * sizeof( pthread_t ));
+  if ( threads != NULL ) {
+    for ( w = workers; w != NULL; w = w->next ) {
+      if ( w->active ) {
+        threads[n++] = w->thread;
+      }
+    }
+  }
+
+  /* set all workers to be destroyed */
+  joiningworkers = TRUE;
+  destroyworkers = workerscount;
+
+  /* wake workers up */
+  sched_unpark_all();
+  pthread_mutex_unlock( &mutex_sched );
+
+  /* without memory for their ids the workers cannot be joined: they are left
+     to exit on their own, so nothing they use can be released */
+  if ( threads == NULL ) {
+    return;
+  }
+
+  /* join with worker threads (read ids from local copy) */
+  for ( i = 0; i < n; i++ ) {
+    pthread_join( threads[i], NULL );
+  }
+  free( threads );
+
+  /* release workers list */
+  while (( w = workers ) != NULL ) {
+    workers = w->next;
+    sched_destroy_queues( w->ready_lp_queue );
+    pthread_cond_destroy( &w->cond_wakeup );
+    free( w );
+  }
+  sched_destroy_queues( ready_lp_queue );
+  free( affinity );
+  affinity = NULL;
+  affinitycount = 0;
+  joiningworkers = FALSE;
+  pthread_key_delete( key_worker );
+  pthread_key_delete( key_offload );
+}
+
+/* set whether the main thread runs lua processes while it waits */
+void sched_set_mainhelp( int enable ) {
+  __atomic_store_n( &mainhelps, enable, __ATOMIC_RELAXED );
+}
+
+/* start a wait of the main thread: any wakeup from now on satisfies it, and
+   wakeups from previous waits are forgotten */
+void sched_main_block( void ) {
+  pthread_mutex_lock( &mainslot.mutex );
+  mainslot.woken = FALSE;
+  mainslot.waitall = FALSE;
+  pthread_mutex_unlock( &mainslot.mutex );
+}
+
+/* satisfy the current wait of the main thread */
+void sched_main_wakeup( void ) {
+  pthread_mutex_lock( &mainslot.mutex );
+  mainslot.woken = TRUE;
+  pthread_cond_signal( &mainslot.cond );
+  pthread_mutex_unlock( &mainslot.mutex );
+}
+
+/* wait in the main thread's parking slot until its current wait is
+   satisfied or, if 'until' is not NULL, until that (real) time; return FALSE
+   if it timed out. if allowed to, the main thread runs ready lua processes
+   meanwhile, so a deadline may be overrun by the process running then */
+int sched_main_wait( const struct timespec *until ) {
+
+  luaproc *lp;
+  int woken;
+
+  pthread_mutex_lock( &mainslot.mutex );
+  while ( !mainslot.woken ) {
+    if (( until != NULL ) && ( sched_expired( until ))) {
+      break;
+    }
+    if ( __atomic_load_n( &mainhelps, __ATOMIC_RELAXED )) {
+      pthread_mutex_unlock( &mainslot.mutex );
+      if (( lp = sched_main_dequeue( )) != NULL ) {
+        sched_main_run( lp );
+      }
+      pthread_mutex_lock( &mainslot.mutex );
+      if ( lp != NULL ) {
+        continue;
+      }
+      /* announce the thread is idle before checking the queues again, so
+         processes queued concurrently are either seen here or signaled */
+      __atomic_store_n( &mainslot.idle, TRUE, __ATOMIC_SEQ_CST );
+      if (( !mainslot.woken ) && ( sched_has_work( ))) {
+        __atomic_store_n( &mainslot.idle, FALSE, __ATOMIC_SEQ_CST );
+        continue;
+      }
+    }
+    if ( mainslot.woken ) {
+      /* woken up while it looked for processes */
+    } else if ( until == NULL ) {
+      pthread_cond_wait( &mainslot.cond, &mainslot.mutex );
+    } else {
+      pthread_cond_timedwait( &mainslot.cond, &mainslot.mutex, until );
+    }
+    __atomic_store_n( &mainslot.idle, FALSE, __ATOMIC_SEQ_CST );
+  }
+  woken = mainslot.woken;
+  pthread_mutex_unlock( &mainslot.mutex );
+
+  return woken;
+}
+
+/* wait in the main thread's parking slot until there are no more active lua
+   processes, running ready ones meanwhile if allowed to */
+void sched_main_wait_all( void ) {
+
+  int done;
+
+  pthread_mutex_lock( &mainslot.mutex );
+  mainslot.woken = FALSE;
+  mainslot.waitall = TRUE;
+  pthread_mutex_unlock( &mainslot.mutex );
+
+  pthread_mutex_lock( &mutex_lp_count );
+  done = ( lpcount == 0 );
+  pthread_mutex_unlock( &mutex_lp_count );
+  if ( !done ) {
+    sched_main_wait( NULL );
   }
-  lua_pop( L, 1 );
 
-  lua_close( workerls );
-  lua_close( L );
+  pthread_mutex_lock( &mainslot.mutex );
+  mainslot.waitall = FALSE;
+  pthread_mutex_unlock( &mainslot.mutex );
 }
 
 /* wait until there are no more active lua processes and active workers. */
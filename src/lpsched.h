@@ -6,6 +6,8 @@
 #ifndef _LUA_LUAPROC_SCHED_H_
 #define _LUA_LUAPROC_SCHED_H_
 
+#include <time.h>
+
 #include "luaproc.h"
 
 /****************************************
@@ -15,6 +17,7 @@
 /* scheduler function return constants */
 #define	LUAPROC_SCHED_OK                 0
 #define LUAPROC_SCHED_PTHREAD_ERROR     -1
+#define LUAPROC_SCHED_AFFINITY_ERROR    -2
 
 /*************************************
  * default number of initial workers *
@@ -23,6 +26,48 @@
 /* scheduler default number of worker threads */
 #define LUAPROC_SCHED_DEFAULT_WORKER_THREADS 1
 
+/**************************
+ * lua process priorities *
+ *************************/
+
+#define LUAPROC_SCHED_PRIORITY_HIGH    0
+#define LUAPROC_SCHED_PRIORITY_NORMAL  1
+#define LUAPROC_SCHED_PRIORITY_LOW     2
+/* number of priority levels (each has its own ready queues) */
+#define LUAPROC_SCHED_PRIORITY_LEVELS  3
+
+/***********************
+ * preemption settings *
+ **********************/
+
+/* lua process uses the scheduler default quantum (or time slice) */
+#define LUAPROC_SCHED_QUANTUM_DEFAULT -1
+/* instructions between time slice checks */
+#define LUAPROC_SCHED_TIMESLICE_CHECK 1000
+
+/*****************
+ * idle settings *
+ ****************/
+
+/* default time (in microseconds) idle workers spin before parking (on
+   machines with more than one processor) */
+#define LUAPROC_SCHED_SPIN_DEFAULT 50
+
+/************************
+ * autoscaling settings *
+ ***********************/
+
+/* default time (in milliseconds) the load must stay high (or low) before the
+   autoscaler adds (or removes) workers */
+#define LUAPROC_SCHED_AUTOSCALE_HYSTERESIS 100
+
+/*******************
+ * offload threads *
+ ******************/
+
+/* default maximum number of threads making blocking calls for lua processes */
+#define LUAPROC_SCHED_OFFLOAD_THREADS 4
+
 /***********************
  * function prototypes *
  **********************/
@@ -35,11 +80,51 @@ void sched_join_workers( void );
 void sched_wait( void );
 /* move process to ready queue (ie, schedule process) */
 void sched_queue_proc( luaproc *lp );
+/* schedule process to run next on the current worker */
+void sched_queue_proc_next( luaproc *lp );
+/* return the number of ready processes of each priority */
+void sched_get_queue_depths( int *depths );
 /* increase active luaproc count */
 void sched_inc_lpcount( void );
 /* set number of active workers (creates and destroys accordingly) */
 int sched_set_numworkers( int numworkers );
+/* pin workers to a set of cpus (an empty set unpins them) */
+int sched_set_affinity( const int *cpus, int ncpus );
+/* size the worker pool automatically (min = 0 disables autoscaling) */
+int sched_set_autoscale( int min, int max, int hysteresis );
 /* return the number of active workers */
 int sched_get_numworkers( void );
+/* set maximum number of offload threads (0 = none) */
+void sched_set_offload_threads( int n );
+/* return the current scheduler time (in milliseconds) */
+unsigned long sched_time( void );
+/* arm a lua process' timer (luaproc_timeout is called when it expires) */
+void sched_timer_add( luaproc *lp );
+/* disarm a lua process' timer, if armed */
+void sched_timer_cancel( luaproc *lp );
+#ifdef __linux__
+/* time a lua process' file descriptor wait out (called with the timer wheel
+   locked; returns FALSE if it must be retried later) */
+int sched_fd_expire( luaproc *lp );
+#endif
+/* check whether the calling thread is an offload thread */
+int sched_is_offload_thread( void );
+/* set default quantum (instructions executed before preemption, 0 = none) */
+void sched_set_quantum( int quantum );
+/* set default time slice (milliseconds run before preemption, 0 = none) */
+void sched_set_timeslice( int timeslice );
+/* set time idle workers spin before parking (microseconds, 0 = none) */
+void sched_set_spin( int spin );
+/* set whether the main thread runs lua processes while it waits */
+void sched_set_mainhelp( int enable );
+/* start a wait of the main thread (before it can be woken up) */
+void sched_main_block( void );
+/* satisfy the current wait of the main thread */
+void sched_main_wakeup( void );
+/* wait until the main thread is woken up or, if 'until' is not NULL, until
+   that (real) time; returns FALSE if it timed out */
+int sched_main_wait( const struct timespec *until );
+/* wait in the main thread until there are no more active lua processes */
+void sched_main_wait_all( void );
 
 #endif
@@ -4,7 +4,15 @@
 */
 
 #include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
@@ -14,12 +22,50 @@
 
 #define FALSE 0
 #define TRUE  !FALSE
-#define LUAPROC_CHANNELS_TABLE "channeltb"
+/* the channel table is split into 2^BITS shards, each with its own lock */
+#define LUAPROC_CHANNEL_SHARD_BITS 6
+#define LUAPROC_CHANNEL_SHARDS     ( 1 << LUAPROC_CHANNEL_SHARD_BITS )
+/* the shared store is split into 2^BITS shards, each with its own lock */
+#define LUAPROC_STORE_SHARD_BITS 6
+#define LUAPROC_STORE_SHARDS     ( 1 << LUAPROC_STORE_SHARD_BITS )
+#define LUAPROC_CHANNEL_HANDLE "LUAPROC_CHANNEL_MT"
+#define LUAPROC_PROCESS_HANDLE "LUAPROC_PROCESS_MT"
+#define LUAPROC_BUFFER_HANDLE "LUAPROC_BUFFER_MT"
+#define LUAPROC_ARRAY_HANDLE "LUAPROC_ARRAY_MT"
+#define LUAPROC_FROZEN_HANDLE "LUAPROC_FROZEN_MT"
 #define LUAPROC_RECYCLE_MAX 0
 
+/* types of serialized message values */
+#define LUAPROC_MSG_NIL      0
+#define LUAPROC_MSG_BOOLEAN  1
+#define LUAPROC_MSG_NUMBER   2
+#define LUAPROC_MSG_INTEGER  3
+#define LUAPROC_MSG_STRING   4
+#define LUAPROC_MSG_TABLE    5
+#define LUAPROC_MSG_TABLEREF 6
+#define LUAPROC_MSG_BUFFER   7
+#define LUAPROC_MSG_ARRAY    8
+#define LUAPROC_MSG_FROZEN   9
+#define LUAPROC_MSG_USERDATA 10
+/* maximum nesting of tables in a message */
+#define LUAPROC_MSG_MAXDEPTH 64
+/* initial room for the values of a message being serialized */
+#define LUAPROC_MSG_MINSIZE  64
+
+/* element types of shared arrays */
+#define LUAPROC_ARRAY_F64 0
+#define LUAPROC_ARRAY_F32 1
+#define LUAPROC_ARRAY_I64 2
+#define LUAPROC_ARRAY_I32 3
+
+/* states of a select */
+#define LUAPROC_SELECT_WAITING 0
+#define LUAPROC_SELECT_DONE    1
+
 #if (LUA_VERSION_NUM == 501)
 
 #define lua_pushglobaltable( L )    lua_pushvalue( L, LUA_GLOBALSINDEX )
+#define lua_rawlen( L, i )          lua_objlen( L, i )
 #define luaL_newlib( L, funcs )     { lua_newtable( L ); \
   luaL_register( L, NULL, funcs ); }
 #define isequal( L, a, b )          lua_equal( L, a, b )
@@ -58,6 +104,7 @@
 #endif
 
 #if (LUA_VERSION_NUM >= 503)
+#define isinteger( L, i )                  lua_isinteger( L, i )
 #define dump( L, writer, data, strip )     lua_dump( L, writer, data, strip )
 #define copynumber( Lto, Lfrom, i ) {\
   if ( lua_isinteger( Lfrom, i )) {\
@@ -67,6 +114,7 @@
   }\
 }
 #else
+#define isinteger( L, i )                  FALSE
 #define dump( L, writer, data, strip )     lua_dump( L, writer, data )
 #define copynumber( Lto, Lfrom, i ) \
   lua_pushnumber( Lto, lua_tonumber( Lfrom, i ))
@@ -76,9 +124,6 @@
  * global variables *
  *******************/
 
-/* channel list mutex */
-static pthread_mutex_t mutex_channel_list = PTHREAD_MUTEX_INITIALIZER;
-
 /* recycle list mutex */
 static pthread_mutex_t mutex_recycle_list = PTHREAD_MUTEX_INITIALIZER;
 
@@ -88,19 +133,11 @@ static list recycle_list;
 /* maximum lua processes to recycle */
 static int recyclemax = LUAPROC_RECYCLE_MAX;
 
-/* lua_State used to store channel hash table */
-static lua_State *chanls = NULL;
-
 /* lua process used to wrap main state. allows main state to be queued in 
-   channels when sending and receiving messages */
+   channels when sending and receiving messages (it waits in the scheduler's
+   parking slot for the main thread) */
 static luaproc mainlp;
 
-/* main state matched a send/recv operation conditional variable */
-pthread_cond_t cond_mainls_sendrecv = PTHREAD_COND_INITIALIZER;
-
-/* main state communication mutex */
-static pthread_mutex_t mutex_mainls = PTHREAD_MUTEX_INITIALIZER;
-
 /***********************
  * register prototypes *
  ***********************/
@@ -114,7 +151,34 @@ static int luaproc_create_channel( lua_State *L );
 static int luaproc_destroy_channel( lua_State *L );
 static int luaproc_set_numworkers( lua_State *L );
 static int luaproc_get_numworkers( lua_State *L );
+static int luaproc_set_autoscale( lua_State *L );
 static int luaproc_recycle_set( lua_State *L );
+static int luaproc_set_quantum( lua_State *L );
+static int luaproc_set_timeslice( lua_State *L );
+static int luaproc_set_spin( lua_State *L );
+static int luaproc_set_mainworker( lua_State *L );
+static int luaproc_set_blocking_threads( lua_State *L );
+static int luaproc_offload( lua_State *L );
+static int luaproc_offload_return( lua_State *L );
+static int luaproc_get_queue_depths( lua_State *L );
+static int luaproc_sleep( lua_State *L );
+static int luaproc_waitfd( lua_State *L );
+static int luaproc_get_channel_handle( lua_State *L );
+static int luaproc_select( lua_State *L );
+static int luaproc_send_batch( lua_State *L );
+static int luaproc_receive_batch( lua_State *L );
+static int luaproc_create_broadcast( lua_State *L );
+static int luaproc_subscribe( lua_State *L );
+static int luaproc_unsubscribe( lua_State *L );
+static int luaproc_create_buffer( lua_State *L );
+static int luaproc_create_array( lua_State *L );
+static int luaproc_store_get( lua_State *L );
+static int luaproc_store_set( lua_State *L );
+static int luaproc_store_cas( lua_State *L );
+static int luaproc_store_incr( lua_State *L );
+static int luaproc_store_keys( lua_State *L );
+static int luaproc_freeze( lua_State *L );
+static int luaproc_pairs( lua_State *L );
 LUALIB_API int luaopen_luaproc( lua_State *L );
 static int luaproc_loadlib( lua_State *L ); 
 
@@ -122,23 +186,335 @@ static int luaproc_loadlib( lua_State *L );
  * structs *
  ***********/
 
+typedef struct stselection selection;
+
+typedef struct stselcase selcase;
+
+typedef struct stpublish publish;
+
+typedef struct stpubwait pubwait;
+
+typedef struct stjoinable joinable;
+
 /* lua process */
 struct stluaproc {
   lua_State *lstate;
   int status;
   int args;
+  int quantum;
+  int timeslice;
+  int priority;
+  void *worker;
+  timer timer;
+  int timed;  /* is the lua process' timer armed for a receive or select? */
+  fdwait fdwait;
   channel *chan;
+  selection *sel;  /* select the lua process is blocked at */
+  publish *pub;    /* publish the lua process is blocked at */
+  joinable *result;   /* where its results go (NULL if not joinable) */
+  joinable *joining;  /* results of the lua process it waits for */
+  char *code;         /* binary chunk it runs, loaded when it first runs
+                         (NULL once it is) */
+  size_t codelen;
+  struct stmessage *upvalues;  /* upvalues of its chunk, set as it is loaded
+                                  (NULL if none) */
+  int fresh;          /* has its lua state yet to open its libraries? */
   luaproc *next;
 };
 
-/* communication channel */
+/* buffered message: a tuple of values serialized into a single block, which
+   follows the struct in memory */
+typedef struct stmessage {
+  int nvalues;
+  size_t size;
+  int refs;       /* buffers (of subscriptions) sharing the message */
+  int depth;      /* deepest nesting of its tables (0 if none) */
+  int tablerefs;  /* references to tables it already has (cycles or shared
+                     tables) */
+  int shared;     /* shared buffers, arrays and frozen tables it holds a
+                     reference to, and userdata objects moving in it */
+} message;
+
+/* message being serialized */
+typedef struct stencoder {
+  lua_State *L;
+  message *msg;       /* grows as values are serialized */
+  size_t cap;         /* room for values allocated after the header */
+  int seen;           /* stack position of the tables serialized so far,
+                         mapped to their order (0 if none yet) */
+  int ntables;
+  int move;           /* may userdata move in the message (which is only
+                         received once)? */
+  const char *error;  /* what went wrong (NULL if nothing did) */
+  const char *tname;  /* type name the error refers to, if any */
+} encoder;
+
+/* message being deserialized */
+typedef struct stdecoder {
+  lua_State *L;
+  char *data;  /* next value */
+  int refs;    /* stack position of the tables pushed so far, by order (0 if
+                  the message refers to none of them again) */
+  int ntables;
+} decoder;
+
+/* communication channel (its name follows the struct in memory) */
 struct stchannel {
   list send;
   list recv;
+  selcase *selects;     /* select cases waiting on the channel (fifo) */
+  selcase *lastselect;
+  pthread_mutex_t mutex;
+  message **buffer;  /* ring buffer of messages (NULL if unbuffered) */
+  int capacity;
+  int first;         /* position of the oldest buffered message */
+  int count;
+  int refs;          /* references from the channel table, handles and
+                        operations in progress */
+  int destroyed;
+  int broadcast;     /* is it a broadcast channel? */
+  channel **subs;    /* subscriptions of a broadcast channel */
+  int nsubs;
+  int maxsubs;
+  int subscription;  /* is it a subscription to a broadcast channel? */
+  channel *owner;    /* broadcast channel of a subscription (NULL if
+                        unsubscribed) */
+  int dropoldest;    /* does a full subscription drop its oldest message? */
+  pubwait *pubs;     /* publishes waiting for room in a subscription (fifo) */
+  pubwait *lastpub;
+  char *name;
+  size_t namelen;
+  unsigned int hash;   /* hash of the name */
+  channel *nextinshard;
+};
+
+/* select case, registered on its channel while the select waits */
+struct stselcase {
+  selection *sel;
+  channel *chan;
+  int index;  /* position of the case in the select's case table */
+  int send;   /* is it a send (rather than a receive) case? */
+  int nvalues;  /* number of values sent by a send case */
+  selcase *next;
+};
+
+/* select waiting on several channels: the first operation that claims it
+   completes it, while its other cases are left registered on their channels
+   until found there. it is released along with the last of its cases */
+struct stselection {
+  luaproc *lp;
+  int state;
+  int refs;         /* registered cases plus the selecting lua process */
+  int ncases;
+  selcase *cases;
+  int nchans;
+  channel **chans;  /* distinct channels of the cases, in lock order */
+};
+
+/* publish waiting for room in full subscriptions of a broadcast channel */
+struct stpublish {
+  luaproc *lp;
+  message *msg;
+  int pending;  /* deliveries still waiting, plus the publisher's own */
+};
+
+/* delivery of a publish waiting for room in a subscription */
+struct stpubwait {
+  publish *pub;
+  pubwait *next;
+};
+
+/* results of a lua process created to be joined, shared by the lua process
+   (until it finishes) and its handles */
+struct stjoinable {
   pthread_mutex_t mutex;
-  pthread_cond_t can_be_used;
+  int refs;
+  int done;         /* has the lua process finished (or failed)? */
+  message *result;  /* its results, or nil and an error message (NULL if
+                       out of memory) */
+  list waiting;     /* lua processes waiting for it to finish */
 };
 
+/* immutable byte buffer shared by lua processes, which hold references to it
+   through userdata views and messages (its bytes follow the struct in
+   memory) */
+typedef struct stsharedbuf {
+  int refs;
+  size_t len;
+} sharedbuf;
+
+/* numeric array shared by lua processes, which hold references to it through
+   userdata views of ranges of its elements and messages (its elements follow
+   the struct in memory, at LUAPROC_ARRAY_HEADER) */
+typedef struct stsharedarr {
+  int refs;
+  int type;
+  size_t n;
+} sharedarr;
+
+/* elements start as aligned as allocated memory is (for vector
+   instructions) */
+#define LUAPROC_ARRAY_HEADER (( sizeof( sharedarr ) + 15 ) & ~(size_t)15 )
+
+/* view of a range of a shared array's elements */
+typedef struct starrview {
+  sharedarr *arr;
+  size_t first;  /* offset of its first element in the array */
+  size_t len;
+} arrview;
+
+/* a single element of any shared array type */
+typedef union starrvalue {
+  double f64;
+  float f32;
+  int64_t i64;
+  int32_t i32;
+} arrvalue;
+
+/* channel table shard: a chained hash table with its own lock */
+typedef struct stchanshard {
+  pthread_mutex_t mutex;
+  channel **buckets;
+  int size;   /* number of buckets (a power of two, or 0) */
+  int count;
+} chanshard;
+
+/* immutable tables frozen into a single block, shared by lua processes,
+   which hold references to it through userdata views of its tables and
+   messages */
+typedef struct stfrozen {
+  int refs;
+  size_t size;
+  char *data;  /* the tables' nodes and strings */
+} frozen;
+
+/* value (or key) in a frozen table */
+typedef struct stfrozenval {
+  int type;    /* LUAPROC_MSG_* type */
+  size_t len;  /* length of a string */
+  union {
+    lua_Number n;
+    lua_Integer i;  /* integer, or boolean */
+    size_t off;     /* offset of a string's bytes or a table's node */
+  } u;
+} frozenval;
+
+/* key-value pair in the hash part of a frozen table */
+typedef struct stfrozenentry {
+  frozenval key;
+  frozenval value;
+  size_t next;  /* next entry (plus one) in the same bucket, 0 if none */
+} frozenentry;
+
+/* frozen table node. it is followed by the values of its array part, the
+   entries of its hash part and then its buckets, which hold the first entry
+   (plus one) in them, 0 if none */
+typedef struct stfrozennode {
+  size_t narr;      /* array part size (keys 1 to narr) */
+  size_t nhash;     /* hash part entries */
+  size_t nbuckets;  /* number of buckets (a power of two, or 0) */
+} frozennode;
+
+/* view of a table of a frozen block */
+typedef struct stfrozenview {
+  frozen *block;
+  size_t node;  /* offset of the table's node */
+} frozenview;
+
+/* table being frozen */
+typedef struct stfreezer {
+  lua_State *L;
+  char *data;         /* grows as tables are frozen */
+  size_t size;
+  size_t cap;
+  int seen;           /* stack position of the tables frozen so far, mapped
+                         to their nodes' offsets plus one */
+  const char *error;  /* what went wrong (NULL if nothing did) */
+  const char *tname;  /* type name the error refers to, if any */
+} freezer;
+
+/* shared store entry: a key (which follows the struct in memory) and its
+   serialized value */
+typedef struct stkventry {
+  message *value;
+  size_t keylen;
+  unsigned int hash;  /* hash of the key */
+  struct stkventry *next;
+} kventry;
+
+/* shared store shard: a chained hash table with its own lock */
+typedef struct stkvshard {
+  pthread_mutex_t mutex;
+  kventry **buckets;
+  int size;   /* number of buckets (a power of two, or 0) */
+  int count;
+} kvshard;
+
+/* shared store shards */
+static kvshard store[LUAPROC_STORE_SHARDS];
+
+/* shared array element type names and sizes (by type) */
+static const char *const luaproc_array_types[] = { "f64", "f32", "i64", "i32",
+                                                   NULL };
+static const size_t luaproc_array_sizes[] = { sizeof( double ),
+                                              sizeof( float ),
+                                              sizeof( int64_t ),
+                                              sizeof( int32_t ) };
+
+/* channel (hash) table shards */
+static chanshard channels[LUAPROC_CHANNEL_SHARDS];
+
+/* lua process priority names (indexed by priority) */
+static const char *const luaproc_priorities[] = {
+  "high", "normal", "low", NULL
+};
+
+/* luaproc.blocking is written in lua on top of two functions: the first one
+   moves the calling lua process to an offload thread (returning true) or does
+   nothing (returning false), the second one moves it back to the workers */
+static const char luaproc_blocking_code[] =
+  "local offload, back = ...\n"
+  "local function finish( offloaded, ok, ... )\n"
+  "  if offloaded then back() end\n"
+  "  if not ok then error( ( ... ), 0 ) end\n"
+  "  return ...\n"
+  "end\n"
+  "return function( f, ... )\n"
+  "  return finish( offload() == true, pcall( f, ... ))\n"
+  "end\n";
+
+/* luaproc.joinall is written in lua on top of the join method of lua process
+   handles, which it is given */
+static const char luaproc_joinall_code[] =
+  "local join = ...\n"
+  "local function pack( ... )\n"
+  "  return { n = select( '#', ... ), ... }\n"
+  "end\n"
+  "return function( handles )\n"
+  "  local results = {}\n"
+  "  for i = 1, #handles do\n"
+  "    results[i] = pack( join( handles[i] ))\n"
+  "  end\n"
+  "  return results\n"
+  "end\n";
+
+/* luaproc.shared.pairs is written in lua on top of luaproc.shared.keys and
+   luaproc.shared.get, which it is given */
+static const char luaproc_store_pairs_code[] =
+  "local keys, get = ...\n"
+  "return function()\n"
+  "  local snapshot, i = keys(), 0\n"
+  "  return function()\n"
+  "    while true do\n"
+  "      i = i + 1\n"
+  "      local key = snapshot[i]\n"
+  "      if key == nil then return nil end\n"
+  "      local value = get( key )\n"
+  "      if value ~= nil then return key, value end\n"
+  "    end\n"
+  "  end\n"
+  "end\n";
+
 /* luaproc function registration array */
 static const struct luaL_Reg luaproc_funcs[] = {
   { "newproc", luaproc_create_newproc },
@@ -149,7 +525,37 @@ static const struct luaL_Reg luaproc_funcs[] = {
   { "delchannel", luaproc_destroy_channel },
   { "setnumworkers", luaproc_set_numworkers },
   { "getnumworkers", luaproc_get_numworkers },
+  { "setautoscale", luaproc_set_autoscale },
   { "recycle", luaproc_recycle_set },
+  { "setquantum", luaproc_set_quantum },
+  { "settimeslice", luaproc_set_timeslice },
+  { "setspin", luaproc_set_spin },
+  { "setmainworker", luaproc_set_mainworker },
+  { "setblockingthreads", luaproc_set_blocking_threads },
+  { "getqueuedepths", luaproc_get_queue_depths },
+  { "sleep", luaproc_sleep },
+  { "waitfd", luaproc_waitfd },
+  { "channel", luaproc_get_channel_handle },
+  { "select", luaproc_select },
+  { "sendbatch", luaproc_send_batch },
+  { "receivebatch", luaproc_receive_batch },
+  { "newbroadcast", luaproc_create_broadcast },
+  { "subscribe", luaproc_subscribe },
+  { "unsubscribe", luaproc_unsubscribe },
+  { "buffer", luaproc_create_buffer },
+  { "array", luaproc_create_array },
+  { "freeze", luaproc_freeze },
+  { "pairs", luaproc_pairs },
+  { NULL, NULL }
+};
+
+/* luaproc.shared function registration array */
+static const struct luaL_Reg luaproc_store_funcs[] = {
+  { "get", luaproc_store_get },
+  { "set", luaproc_store_set },
+  { "cas", luaproc_store_cas },
+  { "incr", luaproc_store_incr },
+  { "keys", luaproc_store_keys },
   { NULL, NULL }
 };
 
@@ -181,6 +587,29 @@ luaproc *list_remove( list *l ) {
   }
 }
 
+/* remove a given lua process from a (fifo) list */
+int list_unlink( list *l, luaproc *lp ) {
+
+  luaproc *prev = NULL, *node;
+
+  for ( node = l->head; node != NULL; prev = node, node = node->next ) {
+    if ( node == lp ) {
+      if ( prev == NULL ) {
+        l->head = lp->next;
+      } else {
+        prev->next = lp->next;
+      }
+      if ( l->tail == lp ) {
+        l->tail = prev;
+      }
+      l->nodes--;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
 /* return a list's node count */
 int list_count( list *l ) {
   return l->nodes;
@@ -193,97 +622,603 @@ void list_init( list *l ) {
   l->nodes = 0;
 }
 
+/*******************
+ * queue functions *
+ *******************/
+
+/*
+   queues are intrusive multi-producer queues (see Dmitry Vyukov's MPSC node
+   based queue): insertions only exchange the queue head, so producers never
+   block each other. removals advance the tail and must be serialized by the
+   consumer lock, because removed lua processes may be freed right away and
+   thus cannot be left behind as sentinel nodes for other consumers.
+ */
+
+/* initialize an empty queue */
+int queue_init( queue *q ) {
+  q->stub = (luaproc *)malloc( sizeof( struct stluaproc ));
+  if ( q->stub == NULL ) {
+    return FALSE;
+  }
+  q->stub->next = NULL;
+  q->head = q->stub;
+  q->tail = q->stub;
+  q->nodes = 0;
+  q->consumer = FALSE;
+  return TRUE;
+}
+
+/* release resources used by an empty queue */
+void queue_destroy( queue *q ) {
+  free( q->stub );
+  q->stub = NULL;
+}
+
+/* link a node at the head of a queue */
+static void queue_push( queue *q, luaproc *lp ) {
+  luaproc *prev;
+  __atomic_store_n( &lp->next, NULL, __ATOMIC_RELAXED );
+  prev = __atomic_exchange_n( &q->head, lp, __ATOMIC_ACQ_REL );
+  /* between the exchange and this store the queue is briefly inconsistent;
+     consumers that find it so wait for the store instead of giving up */
+  __atomic_store_n( &prev->next, lp, __ATOMIC_RELEASE );
+}
+
+/* insert a lua process in a queue */
+void queue_insert( queue *q, luaproc *lp ) {
+  __atomic_add_fetch( &q->nodes, 1, __ATOMIC_RELAXED );
+  queue_push( q, lp );
+}
+
+/*
+   remove and return the first lua process in a queue (if queue is empty,
+   return NULL). caller MUST hold the queue's consumer lock.
+ */
+luaproc *queue_remove( queue *q ) {
+
+  luaproc *tail = q->tail;
+  luaproc *next = __atomic_load_n( &tail->next, __ATOMIC_ACQUIRE );
+
+  /* skip the stub node */
+  if ( tail == q->stub ) {
+    if ( next == NULL ) {
+      /* truly empty unless a producer is still linking its node */
+      if ( __atomic_load_n( &q->head, __ATOMIC_ACQUIRE ) == tail ) {
+        return NULL;
+      }
+      while (( next = __atomic_load_n( &tail->next,
+                                       __ATOMIC_ACQUIRE )) == NULL ) {
+        sched_yield();
+      }
+    }
+    q->tail = next;
+    tail = next;
+    next = __atomic_load_n( &tail->next, __ATOMIC_ACQUIRE );
+  }
+
+  /* last node: put the stub back behind it, so it can be unlinked */
+  if ( next == NULL ) {
+    if ( __atomic_load_n( &q->head, __ATOMIC_ACQUIRE ) == tail ) {
+      queue_push( q, q->stub );
+    }
+    while (( next = __atomic_load_n( &tail->next,
+                                     __ATOMIC_ACQUIRE )) == NULL ) {
+      sched_yield();
+    }
+  }
+
+  q->tail = next;
+  __atomic_sub_fetch( &q->nodes, 1, __ATOMIC_RELAXED );
+  return tail;
+}
+
+/* try to acquire a queue's consumer lock */
+int queue_trylock( queue *q ) {
+  return ( !__atomic_load_n( &q->consumer, __ATOMIC_RELAXED ) &&
+           !__atomic_exchange_n( &q->consumer, TRUE, __ATOMIC_ACQUIRE ));
+}
+
+/* acquire a queue's consumer lock */
+void queue_lock( queue *q ) {
+  while ( !queue_trylock( q )) {
+    sched_yield();
+  }
+}
+
+/* release a queue's consumer lock */
+void queue_unlock( queue *q ) {
+  __atomic_store_n( &q->consumer, FALSE, __ATOMIC_RELEASE );
+}
+
+/* return a queue's node count (approximate while being modified) */
+int queue_count( queue *q ) {
+  return __atomic_load_n( &q->nodes, __ATOMIC_SEQ_CST );
+}
+
 /*********************
  * channel functions *
  *********************/
 
-/* create a new channel and insert it into channels table */
-static channel *channel_create( const char *cname ) {
+/* drop a reference to a select */
+static void select_unref( selection *sel ) {
+  if ( __atomic_sub_fetch( &sel->refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+    free( sel );
+  }
+}
 
-  channel *chan;
+/* claim a waiting select for an operation or a timeout (return FALSE if it
+   was claimed already) */
+static int select_claim( selection *sel ) {
+
+  int waiting = LUAPROC_SELECT_WAITING;
+
+  return __atomic_compare_exchange_n( &sel->state, &waiting,
+                                      LUAPROC_SELECT_DONE, FALSE,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE );
+}
+
+/* unregister the select case following prev (or the first one, if prev is
+   NULL) from a channel. caller MUST lock the channel */
+static void channel_select_unlink( channel *chan, selcase *prev ) {
+
+  selcase *c = ( prev == NULL ) ? chan->selects : prev->next;
+
+  if ( prev == NULL ) {
+    chan->selects = c->next;
+  } else {
+    prev->next = c->next;
+  }
+  if ( chan->lastselect == c ) {
+    chan->lastselect = prev;
+  }
+  select_unref( c->sel );
+}
+
+/* drop a reference to a shared buffer, releasing it along with the last one */
+static void sharedbuf_unref( sharedbuf *b ) {
+  if ( __atomic_sub_fetch( &b->refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+    free( b );
+  }
+}
+
+/* drop a reference to a shared array, releasing it along with the last one */
+static void sharedarr_unref( sharedarr *a ) {
+  if ( __atomic_sub_fetch( &a->refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+    free( a );
+  }
+}
+
+/* drop a reference to a frozen block, releasing it along with the last one */
+static void frozen_unref( frozen *f ) {
+  if ( __atomic_sub_fetch( &f->refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+    free( f->data );
+    free( f );
+  }
+}
+
+/* add (or drop) a reference to each shared buffer, array and frozen table in
+   a serialized value and return where the next value starts. userdata
+   objects move into the message as references are added, and are released
+   as they are dropped unless they were received */
+static char *message_refshared( char *data, int add ) {
+
+  sharedbuf *b;
+  arrview view;
+  frozenview fview;
+  const luaproc_transfer *hook;
+  void *object;
+  size_t len;
+  int i, count;
+
+  switch ( *data++ ) {
+    case LUAPROC_MSG_BOOLEAN:
+      return data + 1;
+    case LUAPROC_MSG_INTEGER:
+      return data + sizeof( lua_Integer );
+    case LUAPROC_MSG_NUMBER:
+      return data + sizeof( lua_Number );
+    case LUAPROC_MSG_STRING:
+      memcpy( &len, data, sizeof( size_t ));
+      return data + sizeof( size_t ) + len;
+    case LUAPROC_MSG_TABLE:
+      memcpy( &count, data + sizeof( int ), sizeof( int ));
+      data += 2 * sizeof( int );
+      for ( i = 0; i < 2 * count; i++ ) {
+        data = message_refshared( data, add );
+      }
+      return data;
+    case LUAPROC_MSG_TABLEREF:
+      return data + sizeof( int );
+    case LUAPROC_MSG_BUFFER:
+      memcpy( &b, data, sizeof( sharedbuf * ));
+      if ( add ) {
+        __atomic_add_fetch( &b->refs, 1, __ATOMIC_RELAXED );
+      } else {
+        sharedbuf_unref( b );
+      }
+      return data + sizeof( sharedbuf * );
+    case LUAPROC_MSG_ARRAY:
+      memcpy( &view, data, sizeof( arrview ));
+      if ( add ) {
+        __atomic_add_fetch( &view.arr->refs, 1, __ATOMIC_RELAXED );
+      } else {
+        sharedarr_unref( view.arr );
+      }
+      return data + sizeof( arrview );
+    case LUAPROC_MSG_FROZEN:
+      memcpy( &fview, data, sizeof( frozenview ));
+      if ( add ) {
+        __atomic_add_fetch( &fview.block->refs, 1, __ATOMIC_RELAXED );
+      } else {
+        frozen_unref( fview.block );
+      }
+      return data + sizeof( frozenview );
+    case LUAPROC_MSG_USERDATA:
+      memcpy( &hook, data, sizeof( luaproc_transfer * ));
+      memcpy( &object, data + sizeof( luaproc_transfer * ), sizeof( void * ));
+      if ( add ) {
+        /* the sender's userdata (which its stack keeps alive until now)
+           gives its object up */
+        object = hook->detach( object );
+        memcpy( data + sizeof( luaproc_transfer * ), &object,
+                sizeof( void * ));
+      } else if (( !data[sizeof( luaproc_transfer * ) + sizeof( void * )] ) &&
+                 ( object != NULL )) {
+        hook->release( object );
+      }
+      return data + sizeof( luaproc_transfer * ) + sizeof( void * ) + 1;
+    default:  /* nil */
+      return data;
+  }
+}
+
+/* add (or drop) a reference to each shared buffer, array and frozen table in
+   a message, moving userdata objects in (or releasing them) */
+static void message_shared( message *msg, int add ) {
+
+  char *data = (char *)( msg + 1 );
+  char *end = data + msg->size;
+
+  while ( data < end ) {
+    data = message_refshared( data, add );
+  }
+}
+
+/* drop a reference to a message */
+static void message_unref( message *msg ) {
+  if ( __atomic_sub_fetch( &msg->refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+    if ( msg->shared > 0 ) {
+      message_shared( msg, FALSE );
+    }
+    free( msg );
+  }
+}
+
+/* drop a reference to the results of a lua process, releasing them if it was
+   the last one */
+static void joinable_unref( joinable *j ) {
+  if ( __atomic_sub_fetch( &j->refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+    if ( j->result != NULL ) {
+      message_unref( j->result );
+    }
+    pthread_mutex_destroy( &j->mutex );
+    free( j );
+  }
+}
+
+/* discard the messages buffered in a channel and release its buffer, along
+   with the select cases still registered on it */
+static void channel_discard( channel *chan ) {
+  while ( chan->selects != NULL ) {
+    channel_select_unlink( chan, NULL );
+  }
+  while ( chan->count > 0 ) {
+    message_unref( chan->buffer[chan->first] );
+    chan->first = ( chan->first + 1 ) % chan->capacity;
+    chan->count--;
+  }
+  free( chan->buffer );
+  chan->buffer = NULL;
+}
+
+/* add a reference to a channel */
+static void channel_ref( channel *chan ) {
+  __atomic_add_fetch( &chan->refs, 1, __ATOMIC_RELAXED );
+}
+
+/* drop a reference to a channel, releasing it if it was the last one */
+static void channel_unref( channel *chan ) {
+  if ( __atomic_sub_fetch( &chan->refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+    channel_discard( chan );
+    pthread_mutex_destroy( &chan->mutex );
+    free( chan );
+  }
+}
+
+/* return the hash of a channel name (or of a shared store key) */
+static unsigned int channel_hash( const char *chname, size_t len ) {
+
+  unsigned int hash = 2166136261U;  /* 32 bit fnv-1a */
+  size_t i;
+
+  for ( i = 0; i < len; i++ ) {
+    hash = ( hash ^ (unsigned char)chname[i] ) * 16777619U;
+  }
 
-  /* get exclusive access to channels list */
-  pthread_mutex_lock( &mutex_channel_list );
+  return hash;
+}
+
+/* return the channel table shard of a channel name hash */
+static chanshard *channel_shard( unsigned int hash ) {
+  return &channels[hash & ( LUAPROC_CHANNEL_SHARDS - 1 )];
+}
+
+/* return the bucket of a channel name hash in a shard (which MUST have
+   buckets) */
+static channel **channel_bucket( chanshard *sh, unsigned int hash ) {
+  return &sh->buckets[( hash >> LUAPROC_CHANNEL_SHARD_BITS ) &
+                      ( sh->size - 1 )];
+}
+
+/* create a new channel, not yet in the channel table (return NULL if out of
+   memory) */
+static channel *channel_create( const char *cname, size_t len,
+                                unsigned int hash, int capacity ) {
+
+  channel *chan = (channel *)malloc( sizeof( channel ) + len + 1 );
+
+  if ( chan == NULL ) {
+    return NULL;
+  }
 
-  /* create new channel and register its name */
-  lua_getglobal( chanls, LUAPROC_CHANNELS_TABLE );
-  chan = (channel *)lua_newuserdata( chanls, sizeof( channel ));
-  lua_setfield( chanls, -2, cname );
-  lua_pop( chanls, 1 );  /* remove channel table from stack */
+  /* allocate the message buffer of a buffered channel */
+  chan->buffer = NULL;
+  if ( capacity > 0 ) {
+    chan->buffer = (message **)malloc( capacity * sizeof( message * ));
+    if ( chan->buffer == NULL ) {
+      free( chan );
+      return NULL;
+    }
+  }
 
   /* initialize channel struct */
   list_init( &chan->send );
   list_init( &chan->recv );
+  chan->selects = NULL;
+  chan->lastselect = NULL;
+  chan->broadcast = FALSE;
+  chan->subs = NULL;
+  chan->nsubs = 0;
+  chan->maxsubs = 0;
+  chan->subscription = FALSE;
+  chan->owner = NULL;
+  chan->dropoldest = FALSE;
+  chan->pubs = NULL;
+  chan->lastpub = NULL;
   pthread_mutex_init( &chan->mutex, NULL );
-  pthread_cond_init( &chan->can_be_used, NULL );
-
-  /* release exclusive access to channels list */
-  pthread_mutex_unlock( &mutex_channel_list );
+  chan->capacity = capacity;
+  chan->first = 0;
+  chan->count = 0;
+  chan->refs = 1;  /* the channel table's */
+  chan->destroyed = FALSE;
+  chan->name = (char *)( chan + 1 );
+  memcpy( chan->name, cname, len + 1 );
+  chan->namelen = len;
+  chan->hash = hash;
+  chan->nextinshard = NULL;
 
   return chan;
 }
 
 /*
    return a channel (if not found, return null).
-   caller function MUST lock 'mutex_channel_list' before calling this function.
+   caller function MUST lock the shard before calling this function.
  */
-static channel *channel_unlocked_get( const char *chname ) {
+static channel *channel_unlocked_get( chanshard *sh, const char *chname,
+                                      size_t len, unsigned int hash ) {
 
   channel *chan;
 
-  lua_getglobal( chanls, LUAPROC_CHANNELS_TABLE );
-  lua_getfield( chanls, -1, chname );
-  chan = (channel *)lua_touserdata( chanls, -1 );
-  lua_pop( chanls, 2 );  /* pop userdata and channel */
+  if ( sh->size == 0 ) {
+    return NULL;
+  }
+  for ( chan = *channel_bucket( sh, hash ); chan != NULL;
+        chan = chan->nextinshard ) {
+    if (( chan->hash == hash ) && ( chan->namelen == len ) &&
+        ( memcmp( chan->name, chname, len ) == 0 )) {
+      return chan;
+    }
+  }
+
+  return NULL;
+}
 
-  return chan;
+/*
+   insert a channel in its shard, growing the shard's buckets as needed
+   (return FALSE if out of memory).
+   caller function MUST lock the shard before calling this function.
+ */
+static int channel_insert( chanshard *sh, channel *chan ) {
+
+  channel **buckets, **bucket, *c, *next;
+  int i, size;
+
+  /* keep at most one channel per bucket on average */
+  if ( sh->count >= sh->size ) {
+    size = ( sh->size == 0 ) ? 8 : sh->size * 2;
+    buckets = (channel **)calloc( size, sizeof( channel * ));
+    if ( buckets == NULL ) {
+      return FALSE;
+    }
+    for ( i = 0; i < sh->size; i++ ) {
+      for ( c = sh->buckets[i]; c != NULL; c = next ) {
+        next = c->nextinshard;
+        bucket = &buckets[( c->hash >> LUAPROC_CHANNEL_SHARD_BITS ) &
+                          ( size - 1 )];
+        c->nextinshard = *bucket;
+        *bucket = c;
+      }
+    }
+    free( sh->buckets );
+    sh->buckets = buckets;
+    sh->size = size;
+  }
+
+  bucket = channel_bucket( sh, chan->hash );
+  chan->nextinshard = *bucket;
+  *bucket = chan;
+  sh->count++;
+
+  return TRUE;
 }
 
 /*
-   return a channel (if not found, return null) with its (mutex) lock set.
-   caller function should unlock channel's (mutex) lock after calling this
-   function.
+   remove a channel from its shard.
+   caller function MUST lock the shard before calling this function.
  */
-static channel *channel_locked_get( const char *chname ) {
+static void channel_remove( chanshard *sh, channel *chan ) {
 
-  channel *chan;
+  channel **link = channel_bucket( sh, chan->hash );
 
-  /* get exclusive access to channels list */
-  pthread_mutex_lock( &mutex_channel_list );
+  while ( *link != chan ) {
+    link = &(*link)->nextinshard;
+  }
+  *link = chan->nextinshard;
+  sh->count--;
+}
 
-  /*
-     try to get channel and lock it; if lock fails, release external
-     lock ('mutex_channel_list') to try again when signaled -- this avoids
-     keeping the external lock busy for too long. during the release,
-     the channel may be destroyed, so it must try to get it again.
-  */
-  while ((( chan = channel_unlocked_get( chname )) != NULL ) &&
-        ( pthread_mutex_trylock( &chan->mutex ) != 0 )) {
-    pthread_cond_wait( &chan->can_be_used, &mutex_channel_list );
+/* return the shared store shard of a key hash */
+static kvshard *store_shard( unsigned int hash ) {
+  return &store[hash & ( LUAPROC_STORE_SHARDS - 1 )];
+}
+
+/* return the bucket of a key hash in a shard (which MUST have buckets) */
+static kventry **store_bucket( kvshard *sh, unsigned int hash ) {
+  return &sh->buckets[( hash >> LUAPROC_STORE_SHARD_BITS ) &
+                      ( sh->size - 1 )];
+}
+
+/*
+   return a shared store entry (if not found, return null).
+   caller function MUST lock the shard before calling this function.
+ */
+static kventry *store_unlocked_get( kvshard *sh, const char *key, size_t len,
+                                    unsigned int hash ) {
+
+  kventry *e;
+
+  if ( sh->size == 0 ) {
+    return NULL;
+  }
+  for ( e = *store_bucket( sh, hash ); e != NULL; e = e->next ) {
+    if (( e->hash == hash ) && ( e->keylen == len ) &&
+        ( memcmp( e + 1, key, len ) == 0 )) {
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+   insert an entry in its shared store shard, growing the shard's buckets as
+   needed (return FALSE if out of memory).
+   caller function MUST lock the shard before calling this function.
+ */
+static int store_insert( kvshard *sh, kventry *entry ) {
+
+  kventry **buckets, **bucket, *e, *next;
+  int i, size;
+
+  /* keep at most one entry per bucket on average */
+  if ( sh->count >= sh->size ) {
+    size = ( sh->size == 0 ) ? 8 : sh->size * 2;
+    buckets = (kventry **)calloc( size, sizeof( kventry * ));
+    if ( buckets == NULL ) {
+      return FALSE;
+    }
+    for ( i = 0; i < sh->size; i++ ) {
+      for ( e = sh->buckets[i]; e != NULL; e = next ) {
+        next = e->next;
+        bucket = &buckets[( e->hash >> LUAPROC_STORE_SHARD_BITS ) &
+                          ( size - 1 )];
+        e->next = *bucket;
+        *bucket = e;
+      }
+    }
+    free( sh->buckets );
+    sh->buckets = buckets;
+    sh->size = size;
+  }
+
+  bucket = store_bucket( sh, entry->hash );
+  entry->next = *bucket;
+  *bucket = entry;
+  sh->count++;
+
+  return TRUE;
+}
+
+/*
+   remove an entry from its shared store shard.
+   caller function MUST lock the shard before calling this function.
+ */
+static void store_remove( kvshard *sh, kventry *entry ) {
+
+  kventry **link = store_bucket( sh, entry->hash );
+
+  while ( *link != entry ) {
+    link = &(*link)->next;
   }
+  *link = entry->next;
+  sh->count--;
+}
+
+/*
+   return a referenced channel (if not found, return null); the reference
+   keeps it from being released until dropped.
+ */
+static channel *channel_get( const char *chname ) {
+
+  size_t len = strlen( chname );
+  unsigned int hash = channel_hash( chname, len );
+  chanshard *sh = channel_shard( hash );
+  channel *chan;
 
-  /* release exclusive access to channels list */
-  pthread_mutex_unlock( &mutex_channel_list );
+  pthread_mutex_lock( &sh->mutex );
+  chan = channel_unlocked_get( sh, chname, len, hash );
+  if ( chan != NULL ) {
+    channel_ref( chan );
+  }
+  pthread_mutex_unlock( &sh->mutex );
 
   return chan;
 }
 
+/*
+   lock a channel the caller holds a reference to; the reference is dropped
+   when the channel is unlocked with luaproc_unlock_channel. if the channel
+   was destroyed, drop the reference and return FALSE.
+ */
+static int channel_lock( channel *chan ) {
+
+  pthread_mutex_lock( &chan->mutex );
+  if ( chan->destroyed ) {
+    luaproc_unlock_channel( chan );
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
 /********************************
  * exported auxiliary functions *
  ********************************/
 
-/* unlock access to a channel and signal it can be used */
+/* unlock access to a channel and drop the reference taken to lock it */
 void luaproc_unlock_channel( channel *chan ) {
-
-  /* get exclusive access to channels list */
-  pthread_mutex_lock( &mutex_channel_list );
-  /* release exclusive access to operate on a particular channel */
   pthread_mutex_unlock( &chan->mutex );
-  /* signal that a particular channel can be used */
-  pthread_cond_signal( &chan->can_be_used );
-  /* release exclusive access to channels list */
-  pthread_mutex_unlock( &mutex_channel_list );
-
+  channel_unref( chan );
 }
 
 /* insert lua process in recycle list */
@@ -313,543 +1248,4541 @@ void luaproc_queue_sender( luaproc *lp ) {
 /* queue a lua process that tried to receive a message */
 void luaproc_queue_receiver( luaproc *lp ) {
   list_insert( &lp->chan->recv, lp );
+  /* arm its timer while the channel is still locked, so a sender that
+     unblocks it can always disarm it */
+  if ( lp->timed ) {
+    sched_timer_add( lp );
+  }
 }
 
-/********************************
- * internal auxiliary functions *
- ********************************/
-static void luaproc_loadbuffer( lua_State *parent, luaproc *lp,
-                                const char *code, size_t len ) {
+/* let a lua process that blocked on a select wait on its channels, which it
+   locked to register its cases */
+void luaproc_queue_selector( luaproc *lp ) {
 
-  /* load lua process' lua code */
-  int ret = luaL_loadbuffer( lp->lstate, code, len, code );
+  selection *sel = lp->sel;
+  int i;
 
-  /* in case of errors, close lua_State and push error to parent */
-  if ( ret != 0 ) {
-    lua_pushstring( parent, lua_tostring( lp->lstate, -1 ));
-    lua_close( lp->lstate );
-    luaL_error( parent, lua_tostring( parent, -1 ));
+  if ( lp->timed ) {
+    sched_timer_add( lp );
+  }
+  /* once a channel is unlocked the lua process may be resumed, so only the
+     select is used from now on */
+  for ( i = 0; i < sel->nchans; i++ ) {
+    pthread_mutex_unlock( &sel->chans[i]->mutex );
   }
+  for ( i = 0; i < sel->ncases; i++ ) {
+    channel_unref( sel->cases[i].chan );
+  }
+  select_unref( sel );
 }
 
-/* copies values between lua states' stacks */
-static int luaproc_copyvalues( lua_State *Lfrom, lua_State *Lto ) {
-
-  int i;
-  int n = lua_gettop( Lfrom );
-  const char *str;
-  size_t len;
+/* wake up a lua process whose timer expired: a sleeping process simply
+   resumes, while a receiving one leaves the channel and gets an error */
+int luaproc_timeout( luaproc *lp ) {
 
-  /* ensure there is space in the receiver's stack */
-  if ( lua_checkstack( Lto, n ) == 0 ) {
-    lua_pushnil( Lto );
-    lua_pushstring( Lto, "not enough space in the stack" );
-    lua_pushnil( Lfrom );
-    lua_pushstring( Lfrom, "not enough space in the receiver's stack" );
-    return FALSE;
-  }
+  channel *chan = lp->chan;
 
-  /* test each value's type and, if it's supported, copy value */
-  for ( i = 2; i <= n; i++ ) {
-    switch ( lua_type( Lfrom, i )) {
-      case LUA_TBOOLEAN:
-        lua_pushboolean( Lto, lua_toboolean( Lfrom, i ));
-        break;
-      case LUA_TNUMBER:
-        copynumber( Lto, Lfrom, i );
-        break;
-      case LUA_TSTRING: {
-        str = lua_tolstring( Lfrom, i, &len );
-        lua_pushlstring( Lto, str, len );
-        break;
-      }
-      case LUA_TNIL:
-        lua_pushnil( Lto );
-        break;
-      default: /* value type not supported: table, function, userdata, etc. */
-        lua_settop( Lto, 1 );
-        lua_pushnil( Lto );
-        lua_pushfstring( Lto, "failed to receive value of unsupported type "
-                                "'%s'", luaL_typename( Lfrom, i ));
-        lua_pushnil( Lfrom );
-        lua_pushfstring( Lfrom, "failed to send value of unsupported type "
-                                "'%s'", luaL_typename( Lfrom, i ));
-        return FALSE;
+  if ( lp->status == LUAPROC_STATUS_BLOCKED_SELECT ) {
+    /* a channel operation may have completed the select already; its cases
+       are dropped from their channels as they are found there */
+    if ( !select_claim( lp->sel )) {
+      return TRUE;
+    }
+    lp->timed = FALSE;
+    lua_pushnil( lp->lstate );
+    lua_pushliteral( lp->lstate, "timed out waiting for channels" );
+    lp->args = 2;
+  } else if ( lp->status == LUAPROC_STATUS_BLOCKED_RECV ) {
+    /* the scheduler's timer lock is held, so only try to lock the channel
+       (lock order is channel, then timers) */
+    if ( pthread_mutex_trylock( &chan->mutex ) != 0 ) {
+      return FALSE;
+    }
+    list_unlink( &chan->recv, lp );
+    lp->timed = FALSE;
+    lua_pushnil( lp->lstate );
+    lua_pushfstring( lp->lstate, "timed out waiting for sender on channel "
+                     "'%s'", chan->name );
+    lp->args = 2;
+    pthread_mutex_unlock( &chan->mutex );
+#ifdef __linux__
+  } else if ( lp->status == LUAPROC_STATUS_WAITFD ) {
+    /* same for the scheduler's poller */
+    if ( !sched_fd_expire( lp )) {
+      return FALSE;
     }
+    lua_pushnil( lp->lstate );
+    lua_pushfstring( lp->lstate, "timed out waiting for file descriptor %d",
+                     lp->fdwait.fd );
+    lp->args = 2;
+#endif
+  } else {
+    lp->args = 0;
   }
+  sched_queue_proc( lp );
+
   return TRUE;
 }
 
-/* return the lua process associated with a given lua state */
-static luaproc *luaproc_getself( lua_State *L ) {
-
-  luaproc *lp;
+/* push the result of a lua process' file descriptor wait: true if the file
+   descriptor is ready, or nil and an error message */
+void luaproc_set_fdresult( luaproc *lp, const char *error ) {
+  if ( error == NULL ) {
+    lua_pushboolean( lp->lstate, TRUE );
+    lp->args = 1;
+  } else {
+    lua_pushnil( lp->lstate );
+    lua_pushstring( lp->lstate, error );
+    lp->args = 2;
+  }
+}
 
-  lua_getfield( L, LUA_REGISTRYINDEX, "LUAPROC_LP_UDATA" );
-  lp = (luaproc *)lua_touserdata( L, -1 );
-  lua_pop( L, 1 );
+/* disarm the timer of a lua process unblocked on a channel, if armed.
+   caller MUST lock the channel */
+static void luaproc_untime( luaproc *lp ) {
+  if ( lp->timed ) {
+    sched_timer_cancel( lp );
+    lp->timed = FALSE;
+  }
+}
 
-  return lp;
+/* unblock the main lua state. caller MUST lock the channel it waits on */
+static void luaproc_main_wakeup( void ) {
+  mainlp.status = LUAPROC_STATUS_READY;
+  sched_main_wakeup();
 }
 
-/* create new lua process */
-static luaproc *luaproc_new( lua_State *L ) {
+/* complete one of the deliveries a blocked publish waits for (or the
+   blocking of the publisher itself); the last one unblocks the publisher */
+static void luaproc_publish_done( publish *pub ) {
 
-  luaproc *lp;
-  lua_State *lpst = luaL_newstate();  /* create new lua state */
+  luaproc *lp = pub->lp;
 
-  /* store the lua process in its own lua state */
-  lp = (luaproc *)lua_newuserdata( lpst, sizeof( struct stluaproc ));
-  lua_setfield( lpst, LUA_REGISTRYINDEX, "LUAPROC_LP_UDATA" );
-  luaproc_openlualibs( lpst );  /* load standard libraries and luaproc */
-  /* register luaproc's own functions */
-  requiref( lpst, "luaproc", luaproc_loadlib, TRUE );
-  lp->lstate = lpst;  /* insert created lua state into lua process struct */
+  if ( __atomic_sub_fetch( &pub->pending, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+    message_unref( pub->msg );
+    free( pub );
+    lua_pushboolean( lp->lstate, TRUE );
+    lp->args = 1;
+    if ( lp == &mainlp ) {
+      luaproc_main_wakeup();
+    } else {
+      sched_queue_proc( lp );
+    }
+  }
+}
 
-  return lp;
+/* let a lua process that blocked on a publish wait for room in the
+   subscriptions it is yet to be delivered to */
+void luaproc_queue_publisher( luaproc *lp ) {
+  luaproc_publish_done( lp->pub );
 }
 
-/* join schedule workers (called before exiting Lua) */
-static int luaproc_join_workers( lua_State *L ) {
-  sched_join_workers();
-  lua_close( chanls );
-  return 0;
+/* set the (real time) deadline of a wait of timeout milliseconds */
+static void luaproc_deadline( struct timespec *until, lua_Integer timeout ) {
+  clock_gettime( CLOCK_REALTIME, until );
+  until->tv_sec += timeout / 1000;
+  until->tv_nsec += ( timeout % 1000 ) * 1000000L;
+  if ( until->tv_nsec >= 1000000000L ) {
+    until->tv_sec++;
+    until->tv_nsec -= 1000000000L;
+  }
 }
 
-/* writer function for lua_dump */
-static int luaproc_buff_writer( lua_State *L, const void *buff, size_t size, 
-                                void *ud ) {
-  (void)L;
-  luaL_addlstring((luaL_Buffer *)ud, (const char *)buff, size );
-  return 0;
+/* block the main lua state, queued on a locked channel, until it is
+   unblocked or, if timeout is not negative, until timeout milliseconds
+   elapse; returns FALSE if it timed out. the channel is unlocked */
+static int luaproc_main_wait( channel *chan, list *l, lua_Integer timeout ) {
+
+  struct timespec until;
+  int ready;
+
+  if ( timeout >= 0 ) {
+    luaproc_deadline( &until, timeout );
+  }
+
+  /* start the wait before unlocking the channel, so the wakeup cannot be
+     missed; the reference to the channel is kept while waiting */
+  sched_main_block();
+  pthread_mutex_unlock( &chan->mutex );
+  ready = sched_main_wait(( timeout < 0 ) ? NULL : &until );
+
+  /* timed out: leave the channel, unless a sender or the channel's
+     destruction unblocked the main lua state in the meantime (they do so
+     with the channel locked) */
+  if ( !ready ) {
+    pthread_mutex_lock( &chan->mutex );
+    ready = ( mainlp.status == LUAPROC_STATUS_READY );
+    if ( !ready ) {
+      list_unlink( l, &mainlp );
+    }
+    pthread_mutex_unlock( &chan->mutex );
+  }
+  channel_unref( chan );
+
+  return ready;
+}
+
+/********************************
+ * internal auxiliary functions *
+ ********************************/
+/* return a non negative integer field from an options table (if the field is
+   not set, return a default value) */
+static int luaproc_getopt_int( lua_State *L, int idx, const char *name,
+                               int def ) {
+
+  lua_Integer n = def;
+
+  lua_getfield( L, idx, name );
+  if ( !lua_isnil( L, -1 )) {
+    if ( !lua_isnumber( L, -1 )) {
+      luaL_error( L, "option '%s' must be a number", name );
+    }
+    n = lua_tointeger( L, -1 );
+    if ( n < 0 ) {
+      luaL_error( L, "option '%s' must not be negative", name );
+    }
+  }
+  lua_pop( L, 1 );
+
+  return (int)n;
 }
 
-/* copies upvalues between lua states' stacks */
-static int luaproc_copyupvalues( lua_State *Lfrom, lua_State *Lto, 
-                                 int funcindex ) {
+/* return an option field from an options table that must be one of a list of
+   names (if the field is not set, return a default value) */
+static int luaproc_getopt_option( lua_State *L, int idx, const char *name,
+                                  const char *const names[], int def ) {
 
-  int i = 1;
+  int i;
   const char *str;
-  size_t len;
 
-  /* test the type of each upvalue and, if it's supported, copy it */
-  while ( lua_getupvalue( Lfrom, funcindex, i ) != NULL ) {
-    switch ( lua_type( Lfrom, -1 )) {
-      case LUA_TBOOLEAN:
-        lua_pushboolean( Lto, lua_toboolean( Lfrom, -1 ));
-        break;
-      case LUA_TNUMBER:
-        copynumber( Lto, Lfrom, -1 );
-        break;
-      case LUA_TSTRING: {
-        str = lua_tolstring( Lfrom, -1, &len );
-        lua_pushlstring( Lto, str, len );
-        break;
+  lua_getfield( L, idx, name );
+  if ( !lua_isnil( L, -1 )) {
+    str = lua_tostring( L, -1 );
+    for ( i = 0; ( str != NULL ) && ( names[i] != NULL ); i++ ) {
+      if ( strcmp( names[i], str ) == 0 ) {
+        lua_pop( L, 1 );
+        return i;
       }
-      case LUA_TNIL:
-        lua_pushnil( Lto );
-        break;
-      /* if upvalue is a table, check whether it is the global environment
-         (_ENV) from the source state Lfrom. in case so, push in the stack of
-         the destination state Lto its own global environment to be set as the
-         corresponding upvalue; otherwise, treat it as a regular non-supported
-         upvalue type. */
-      case LUA_TTABLE:
-        lua_pushglobaltable( Lfrom );
-        if ( isequal( Lfrom, -1, -2 )) {
-          lua_pop( Lfrom, 1 );
-          lua_pushglobaltable( Lto );
-          break;
-        }
-        lua_pop( Lfrom, 1 );
-        /* FALLTHROUGH */
-      default: /* value type not supported: table, function, userdata, etc. */
-        lua_pushnil( Lfrom );
-        lua_pushfstring( Lfrom, "failed to copy upvalue of unsupported type "
-                                "'%s'", luaL_typename( Lfrom, -2 ));
-        return FALSE;
-    }
-    lua_pop( Lfrom, 1 );
-    if ( lua_setupvalue( Lto, 1, i ) == NULL ) {
-      lua_pushnil( Lfrom );
-      lua_pushstring( Lfrom, "failed to set upvalue" );
-      return FALSE;
     }
-    i++;
+    luaL_error( L, "invalid value for option '%s'", name );
   }
-  return TRUE;
+  lua_pop( L, 1 );
+
+  return def;
 }
 
+/* return the shared buffer viewed by the value at stack position idx (NULL
+   if it is not a buffer view) */
+static sharedbuf *luaproc_tobuffer( lua_State *L, int idx ) {
 
-/*********************
- * library functions *
- *********************/
+  sharedbuf **view = (sharedbuf **)lua_touserdata( L, idx );
 
-/* set maximum number of lua processes in the recycle list */
-static int luaproc_recycle_set( lua_State *L ) {
+  if (( view == NULL ) || ( lua_getmetatable( L, idx ) == 0 )) {
+    return NULL;
+  }
+  luaL_getmetatable( L, LUAPROC_BUFFER_HANDLE );
+  if ( !lua_rawequal( L, -1, -2 )) {
+    view = NULL;
+  }
+  lua_pop( L, 2 );
 
-  luaproc *lp;
+  return ( view != NULL ) ? *view : NULL;
+}
 
-  /* validate parameter is a non negative number */
-  lua_Integer max = luaL_checkinteger( L, 1 );
-  luaL_argcheck( L, max >= 0, 1, "recycle limit must be positive" );
+/* push a new view of a shared buffer, adding a reference to it. the stack
+   MUST have room for two values */
+static void luaproc_pushbuffer( lua_State *L, sharedbuf *b ) {
 
-  /* get exclusive access to recycled lua processes list */
-  pthread_mutex_lock( &mutex_recycle_list );
+  sharedbuf **view = (sharedbuf **)lua_newuserdata( L, sizeof( sharedbuf * ));
 
-  recyclemax = max;  /* set maximum number */
+  __atomic_add_fetch( &b->refs, 1, __ATOMIC_RELAXED );
+  *view = b;
+  luaL_getmetatable( L, LUAPROC_BUFFER_HANDLE );
+  lua_setmetatable( L, -2 );
+}
 
-  /* remove extra nodes and destroy each lua processes */
-  while ( list_count( &recycle_list ) > recyclemax ) {
-    lp = list_remove( &recycle_list );
-    lua_close( lp->lstate );
+/* return the view of a shared array at stack position idx (NULL if it is not
+   an array view) */
+static arrview *luaproc_toarray( lua_State *L, int idx ) {
+
+  arrview *view = (arrview *)lua_touserdata( L, idx );
+
+  if (( view == NULL ) || ( lua_getmetatable( L, idx ) == 0 )) {
+    return NULL;
   }
-  /* release exclusive access to recycled lua processes list */
-  pthread_mutex_unlock( &mutex_recycle_list );
+  luaL_getmetatable( L, LUAPROC_ARRAY_HANDLE );
+  if ( !lua_rawequal( L, -1, -2 )) {
+    view = NULL;
+  }
+  lua_pop( L, 2 );
 
-  return 0;
+  return view;
 }
 
-/* wait until there are no more active lua processes */
-static int luaproc_wait( lua_State *L ) {
-  sched_wait();
-  return 0;
+/* push a new view of a range of a shared array, adding a reference to it.
+   the stack MUST have room for two values */
+static void luaproc_pusharray( lua_State *L, sharedarr *a, size_t first,
+                               size_t len ) {
+
+  arrview *view = (arrview *)lua_newuserdata( L, sizeof( arrview ));
+
+  __atomic_add_fetch( &a->refs, 1, __ATOMIC_RELAXED );
+  view->arr = a;
+  view->first = first;
+  view->len = len;
+  luaL_getmetatable( L, LUAPROC_ARRAY_HANDLE );
+  lua_setmetatable( L, -2 );
 }
 
-/* set number of workers (creates or destroys accordingly) */
-static int luaproc_set_numworkers( lua_State *L ) {
+/* return the view of a frozen table at stack position idx (NULL if it is not
+   a frozen table view) */
+static frozenview *luaproc_tofrozen( lua_State *L, int idx ) {
 
-  /* validate parameter is a positive number */
-  lua_Integer numworkers = luaL_checkinteger( L, -1 );
-  luaL_argcheck( L, numworkers > 0, 1, "number of workers must be positive" );
+  frozenview *view = (frozenview *)lua_touserdata( L, idx );
 
-  /* set number of threads; signal error on failure */
-  if ( sched_set_numworkers( numworkers ) == LUAPROC_SCHED_PTHREAD_ERROR ) {
-      luaL_error( L, "failed to create worker" );
-  } 
+  if (( view == NULL ) || ( lua_getmetatable( L, idx ) == 0 )) {
+    return NULL;
+  }
+  luaL_getmetatable( L, LUAPROC_FROZEN_HANDLE );
+  if ( !lua_rawequal( L, -1, -2 )) {
+    view = NULL;
+  }
+  lua_pop( L, 2 );
 
-  return 0;
+  return view;
 }
 
-/* return the number of active workers */
-static int luaproc_get_numworkers( lua_State *L ) {
-  lua_pushnumber( L, sched_get_numworkers( ));
-  return 1;
+/* push a new view of a table of a frozen block, adding a reference to it.
+   the stack MUST have room for two values */
+static void luaproc_pushfrozen( lua_State *L, frozen *block, size_t node ) {
+
+  frozenview *view = (frozenview *)lua_newuserdata( L, sizeof( frozenview ));
+
+  __atomic_add_fetch( &block->refs, 1, __ATOMIC_RELAXED );
+  view->block = block;
+  view->node = node;
+  luaL_getmetatable( L, LUAPROC_FROZEN_HANDLE );
+  lua_setmetatable( L, -2 );
 }
 
-/* create and schedule a new lua process */
-static int luaproc_create_newproc( lua_State *L ) {
+/* push a new view of the shared buffer, array or frozen table viewed by the
+   value at stack position idx of another lua state (returns FALSE if it is
+   none of them) */
+static int luaproc_copyshared( lua_State *Lfrom, int idx, lua_State *Lto ) {
 
-  size_t len;
-  luaproc *lp;
-  luaL_Buffer buff;
-  const char *code;
-  int d;
-  int lt = lua_type( L, 1 );
+  sharedbuf *b;
+  arrview *view;
+  frozenview *fview;
 
-  /* check function argument type - must be function or string; in case it is
-     a function, dump it into a binary string */
-  if ( lt == LUA_TFUNCTION ) {
-    lua_settop( L, 1 );
-    luaL_buffinit( L, &buff );
-    d = dump( L, luaproc_buff_writer, &buff, FALSE );
-    if ( d != 0 ) {
-      lua_pushnil( L );
-      lua_pushfstring( L, "error %d dumping function to binary string", d );
-      return 2;
+  if (( b = luaproc_tobuffer( Lfrom, idx )) != NULL ) {
+    luaproc_pushbuffer( Lto, b );
+    return TRUE;
+  }
+  if (( view = luaproc_toarray( Lfrom, idx )) != NULL ) {
+    luaproc_pusharray( Lto, view->arr, view->first, view->len );
+    return TRUE;
+  }
+  if (( fview = luaproc_tofrozen( Lfrom, idx )) != NULL ) {
+    luaproc_pushfrozen( Lto, fview->block, fview->node );
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* return how the userdata at stack position idx moves between lua states
+   (NULL if its metatable has no transfer hook) */
+static const luaproc_transfer *luaproc_tomoving( lua_State *L, int idx ) {
+
+  const luaproc_transfer *hook = NULL;
+
+  if (( lua_type( L, idx ) != LUA_TUSERDATA ) ||
+      ( lua_checkstack( L, 2 ) == 0 ) || ( lua_getmetatable( L, idx ) == 0 )) {
+    return NULL;
+  }
+  lua_pushliteral( L, LUAPROC_TRANSFER_FIELD );
+  lua_rawget( L, -2 );
+  if ( lua_type( L, -1 ) == LUA_TLIGHTUSERDATA ) {
+    hook = (const luaproc_transfer *)lua_touserdata( L, -1 );
+  }
+  lua_pop( L, 2 );
+
+  return hook;
+}
+
+/* make room for n more bytes at the end of a message being serialized and
+   return where they start (NULL if out of memory) */
+static char *luaproc_encode_reserve( encoder *e, size_t n ) {
+
+  message *msg;
+  size_t cap;
+
+  if ( e->msg->size + n > e->cap ) {
+    cap = ( e->cap * 2 > e->msg->size + n ) ? e->cap * 2 : e->msg->size + n;
+    msg = (message *)realloc( e->msg, sizeof( message ) + cap );
+    if ( msg == NULL ) {
+      e->error = "not enough memory";
+      return NULL;
     }
-    luaL_pushresult( &buff );
-    lua_insert( L, 1 );
-  } else if ( lt != LUA_TSTRING ) {
-    lua_pushnil( L );
-    lua_pushfstring( L, "cannot use '%s' to create a new process",
-                     luaL_typename( L, 1 ));
-    return 2;
+    e->msg = msg;
+    e->cap = cap;
   }
+  e->msg->size += n;
 
-  /* get pointer to code string */
-  code = lua_tolstring( L, 1, &len );
+  return (char *)( e->msg + 1 ) + e->msg->size - n;
+}
 
-  /* get exclusive access to recycled lua processes list */
-  pthread_mutex_lock( &mutex_recycle_list );
+static int luaproc_encode_value( encoder *e, int idx, int depth );
+
+/* serialize a table (at absolute stack position idx) as its array size hint,
+   its number of pairs and then its pairs. a table serialized before in the
+   same message (a cycle or a shared table) is referred to by its order
+   instead */
+static int luaproc_encode_table( encoder *e, int idx, int depth ) {
+
+  lua_State *L = e->L;
+  char *data;
+  size_t at;
+  int narr, count = 0, order;
+
+  if ( depth > LUAPROC_MSG_MAXDEPTH ) {
+    e->error = "tables nested too deeply";
+    return FALSE;
+  }
+  if ( lua_checkstack( L, 4 ) == 0 ) {
+    e->error = "not enough space in the stack";
+    return FALSE;
+  }
+
+  /* the tables already serialized are kept in a table on the stack, which is
+     only created if the message has tables at all */
+  if ( e->seen == 0 ) {
+    lua_newtable( L );
+    e->seen = lua_gettop( L );
+  }
+  lua_pushvalue( L, idx );
+  lua_rawget( L, e->seen );
+  order = (int)lua_tointeger( L, -1 );
+  lua_pop( L, 1 );
+  if ( order > 0 ) {
+    if (( data = luaproc_encode_reserve( e, 1 + sizeof( int ))) == NULL ) {
+      return FALSE;
+    }
+    *data = LUAPROC_MSG_TABLEREF;
+    memcpy( data + 1, &order, sizeof( int ));
+    e->msg->tablerefs++;
+    return TRUE;
+  }
+  lua_pushvalue( L, idx );
+  lua_pushinteger( L, ++e->ntables );
+  lua_rawset( L, e->seen );
+  if ( depth > e->msg->depth ) {
+    e->msg->depth = depth;
+  }
+
+  /* the number of pairs is only known once they are serialized */
+  narr = (int)lua_rawlen( L, idx );
+  if (( data = luaproc_encode_reserve( e, 1 + 2 * sizeof( int ))) == NULL ) {
+    return FALSE;
+  }
+  *data = LUAPROC_MSG_TABLE;
+  memcpy( data + 1, &narr, sizeof( int ));
+  at = e->msg->size - sizeof( int );
+
+  lua_pushnil( L );
+  while ( lua_next( L, idx ) != 0 ) {
+    if (( !luaproc_encode_value( e, lua_gettop( L ) - 1, depth )) ||
+        ( !luaproc_encode_value( e, lua_gettop( L ), depth ))) {
+      return FALSE;
+    }
+    lua_pop( L, 1 );
+    count++;
+  }
+  memcpy( (char *)( e->msg + 1 ) + at, &count, sizeof( int ));
+
+  return TRUE;
+}
+
+/* serialize a userdata that moves, as its transfer hook and its block. it
+   may only move once, to a single receiver */
+static int luaproc_encode_moving( encoder *e, int idx,
+                                  const luaproc_transfer *hook ) {
+
+  lua_State *L = e->L;
+  char *data;
+  void *udata = lua_touserdata( L, idx );
+
+  if ( !e->move ) {
+    e->error = "failed to share userdata that can only move to a single "
+               "receiver";
+    return FALSE;
+  }
+  if ( lua_checkstack( L, 3 ) == 0 ) {
+    e->error = "not enough space in the stack";
+    return FALSE;
+  }
+  if ( e->seen == 0 ) {
+    lua_newtable( L );
+    e->seen = lua_gettop( L );
+  }
+  lua_pushvalue( L, idx );
+  lua_rawget( L, e->seen );
+  if ( !lua_isnil( L, -1 )) {
+    lua_pop( L, 1 );
+    e->error = "failed to move the same userdata more than once";
+    return FALSE;
+  }
+  lua_pop( L, 1 );
+  lua_pushvalue( L, idx );
+  lua_pushboolean( L, TRUE );
+  lua_rawset( L, e->seen );
+
+  data = luaproc_encode_reserve( e, 1 + sizeof( luaproc_transfer * ) +
+                                    sizeof( void * ) + 1 );
+  if ( data == NULL ) {
+    return FALSE;
+  }
+  *data++ = LUAPROC_MSG_USERDATA;
+  memcpy( data, &hook, sizeof( luaproc_transfer * ));
+  memcpy( data + sizeof( luaproc_transfer * ), &udata, sizeof( void * ));
+  data[sizeof( luaproc_transfer * ) + sizeof( void * )] = FALSE;
+  e->msg->shared++;
+
+  return TRUE;
+}
+
+/* serialize the value at absolute stack position idx, nested in 'depth'
+   tables */
+static int luaproc_encode_value( encoder *e, int idx, int depth ) {
+
+  lua_State *L = e->L;
+  char *data;
+  const char *str;
+  lua_Number num;
+  lua_Integer integer;
+  size_t len;
+  sharedbuf *b;
+  arrview *view;
+  frozenview *fview;
+  const luaproc_transfer *hook;
+
+  switch ( lua_type( L, idx )) {
+    case LUA_TNIL:
+      if (( data = luaproc_encode_reserve( e, 1 )) == NULL ) {
+        return FALSE;
+      }
+      *data = LUAPROC_MSG_NIL;
+      break;
+    case LUA_TBOOLEAN:
+      if (( data = luaproc_encode_reserve( e, 2 )) == NULL ) {
+        return FALSE;
+      }
+      *data++ = LUAPROC_MSG_BOOLEAN;
+      *data = (char)lua_toboolean( L, idx );
+      break;
+    case LUA_TNUMBER:
+      if ( isinteger( L, idx )) {
+        data = luaproc_encode_reserve( e, 1 + sizeof( lua_Integer ));
+        if ( data == NULL ) {
+          return FALSE;
+        }
+        *data++ = LUAPROC_MSG_INTEGER;
+        integer = lua_tointeger( L, idx );
+        memcpy( data, &integer, sizeof( lua_Integer ));
+      } else {
+        data = luaproc_encode_reserve( e, 1 + sizeof( lua_Number ));
+        if ( data == NULL ) {
+          return FALSE;
+        }
+        *data++ = LUAPROC_MSG_NUMBER;
+        num = lua_tonumber( L, idx );
+        memcpy( data, &num, sizeof( lua_Number ));
+      }
+      break;
+    case LUA_TSTRING:
+      str = lua_tolstring( L, idx, &len );
+      if (( data = luaproc_encode_reserve( e, 1 + sizeof( size_t ) +
+                                              len )) == NULL ) {
+        return FALSE;
+      }
+      *data++ = LUAPROC_MSG_STRING;
+      memcpy( data, &len, sizeof( size_t ));
+      memcpy( data + sizeof( size_t ), str, len );
+      break;
+    case LUA_TTABLE:
+      return luaproc_encode_table( e, idx, depth + 1 );
+    case LUA_TUSERDATA:
+      /* shared buffers, arrays and frozen tables are passed by reference,
+         which is only added once the whole message is serialized */
+      if (( b = luaproc_tobuffer( L, idx )) != NULL ) {
+        data = luaproc_encode_reserve( e, 1 + sizeof( sharedbuf * ));
+        if ( data == NULL ) {
+          return FALSE;
+        }
+        *data++ = LUAPROC_MSG_BUFFER;
+        memcpy( data, &b, sizeof( sharedbuf * ));
+        e->msg->shared++;
+        break;
+      }
+      if (( view = luaproc_toarray( L, idx )) != NULL ) {
+        if (( data = luaproc_encode_reserve( e, 1 + sizeof( arrview ))) ==
+            NULL ) {
+          return FALSE;
+        }
+        *data++ = LUAPROC_MSG_ARRAY;
+        memcpy( data, view, sizeof( arrview ));
+        e->msg->shared++;
+        break;
+      }
+      if (( fview = luaproc_tofrozen( L, idx )) != NULL ) {
+        if (( data = luaproc_encode_reserve( e, 1 + sizeof( frozenview ))) ==
+            NULL ) {
+          return FALSE;
+        }
+        *data++ = LUAPROC_MSG_FROZEN;
+        memcpy( data, fview, sizeof( frozenview ));
+        e->msg->shared++;
+        break;
+      }
+      /* userdata with a transfer hook move, which (like references) only
+         happens once the whole message is serialized, so the userdata is
+         written for now */
+      if (( hook = luaproc_tomoving( L, idx )) != NULL ) {
+        return luaproc_encode_moving( e, idx, hook );
+      }
+      /* fall through */
+    default: /* value type not supported: function, userdata, etc. */
+      e->error = "failed to send value of unsupported type '%s'";
+      e->tname = luaL_typename( L, idx );
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* serialize the values of a message (stack positions 'first' and up) into a
+   new block, in which userdata may move if it is only received once; on
+   failure, push nil and an error message and return NULL */
+static message *luaproc_encode( lua_State *L, int first, int move ) {
+
+  encoder e;
+  int i, n = lua_gettop( L );
+
+  e.L = L;
+  e.cap = LUAPROC_MSG_MINSIZE;
+  e.seen = 0;
+  e.ntables = 0;
+  e.move = move;
+  e.error = NULL;
+  e.tname = NULL;
+  e.msg = (message *)malloc( sizeof( message ) + e.cap );
+  if ( e.msg == NULL ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough memory" );
+    return NULL;
+  }
+  e.msg->nvalues = n - first + 1;
+  e.msg->size = 0;
+  e.msg->refs = 1;
+  e.msg->depth = 0;
+  e.msg->tablerefs = 0;
+  e.msg->shared = 0;
+
+  for ( i = first; ( i <= n ) && ( e.error == NULL ); i++ ) {
+    luaproc_encode_value( &e, i, 0 );
+  }
+  lua_settop( L, n );
+
+  if ( e.error != NULL ) {
+    free( e.msg );
+    lua_pushnil( L );
+    lua_pushfstring( L, e.error, e.tname );
+    return NULL;
+  }
+
+  /* give back the room left over after growing */
+  if ( e.cap - e.msg->size > LUAPROC_MSG_MINSIZE ) {
+    e.msg = (message *)realloc( e.msg, sizeof( message ) + e.msg->size );
+  }
+  /* the sender's views keep what they share alive until now (and userdata
+     only gives its object up now, when the message can no longer fail) */
+  if ( e.msg->shared > 0 ) {
+    message_shared( e.msg, TRUE );
+  }
+
+  return e.msg;
+}
+
+/* write a number as the single value of a message of the right size */
+static void message_setnumber( message *msg, int isint, lua_Integer i,
+                               lua_Number n ) {
+
+  char *data = (char *)( msg + 1 );
+
+  if ( isint ) {
+    *data++ = LUAPROC_MSG_INTEGER;
+    memcpy( data, &i, sizeof( lua_Integer ));
+  } else {
+    *data++ = LUAPROC_MSG_NUMBER;
+    memcpy( data, &n, sizeof( lua_Number ));
+  }
+}
+
+/* create a message of a single number (return NULL if out of memory) */
+static message *message_number( int isint, lua_Integer i, lua_Number n ) {
+
+  size_t size = 1 + ( isint ? sizeof( lua_Integer ) : sizeof( lua_Number ));
+  message *msg = (message *)malloc( sizeof( message ) + size );
+
+  if ( msg == NULL ) {
+    return NULL;
+  }
+  msg->nvalues = 1;
+  msg->size = size;
+  msg->refs = 1;
+  msg->depth = 0;
+  msg->tablerefs = 0;
+  msg->shared = 0;
+  message_setnumber( msg, isint, i, n );
+
+  return msg;
+}
+
+/* push a serialized value, advancing past it */
+static void luaproc_decode_value( decoder *d ) {
+
+  lua_State *L = d->L;
+  lua_Number num;
+  lua_Integer integer;
+  size_t len;
+  int i, narr, count, order;
+  sharedbuf *b;
+  arrview view;
+  frozenview fview;
+  const luaproc_transfer *hook;
+  void *object;
+
+  switch ( *d->data++ ) {
+    case LUAPROC_MSG_NIL:
+      lua_pushnil( L );
+      break;
+    case LUAPROC_MSG_BOOLEAN:
+      lua_pushboolean( L, *d->data++ );
+      break;
+    case LUAPROC_MSG_INTEGER:
+      memcpy( &integer, d->data, sizeof( lua_Integer ));
+      lua_pushinteger( L, integer );
+      d->data += sizeof( lua_Integer );
+      break;
+    case LUAPROC_MSG_NUMBER:
+      memcpy( &num, d->data, sizeof( lua_Number ));
+      lua_pushnumber( L, num );
+      d->data += sizeof( lua_Number );
+      break;
+    case LUAPROC_MSG_STRING:
+      memcpy( &len, d->data, sizeof( size_t ));
+      lua_pushlstring( L, d->data + sizeof( size_t ), len );
+      d->data += sizeof( size_t ) + len;
+      break;
+    case LUAPROC_MSG_TABLE:
+      memcpy( &narr, d->data, sizeof( int ));
+      memcpy( &count, d->data + sizeof( int ), sizeof( int ));
+      d->data += 2 * sizeof( int );
+      /* size both parts up front, so filling the table never rehashes it */
+      lua_createtable( L, narr, ( count > narr ) ? count - narr : 0 );
+      d->ntables++;
+      if ( d->refs != 0 ) {
+        lua_pushvalue( L, -1 );
+        lua_rawseti( L, d->refs, d->ntables );
+      }
+      for ( i = 0; i < count; i++ ) {
+        luaproc_decode_value( d );
+        luaproc_decode_value( d );
+        lua_rawset( L, -3 );
+      }
+      break;
+    case LUAPROC_MSG_TABLEREF:
+      memcpy( &order, d->data, sizeof( int ));
+      lua_rawgeti( L, d->refs, order );
+      d->data += sizeof( int );
+      break;
+    case LUAPROC_MSG_BUFFER:
+      memcpy( &b, d->data, sizeof( sharedbuf * ));
+      luaproc_pushbuffer( L, b );
+      d->data += sizeof( sharedbuf * );
+      break;
+    case LUAPROC_MSG_ARRAY:
+      memcpy( &view, d->data, sizeof( arrview ));
+      luaproc_pusharray( L, view.arr, view.first, view.len );
+      d->data += sizeof( arrview );
+      break;
+    case LUAPROC_MSG_FROZEN:
+      memcpy( &fview, d->data, sizeof( frozenview ));
+      luaproc_pushfrozen( L, fview.block, fview.node );
+      d->data += sizeof( frozenview );
+      break;
+    case LUAPROC_MSG_USERDATA:
+      memcpy( &hook, d->data, sizeof( luaproc_transfer * ));
+      memcpy( &object, d->data + sizeof( luaproc_transfer * ),
+              sizeof( void * ));
+      d->data += sizeof( luaproc_transfer * ) + sizeof( void * );
+      *d->data++ = TRUE;  /* the new userdata owns the object now */
+      hook->attach( L, object );
+      break;
+  }
+}
+
+/* check whether a lua state's stack has room to decode a message */
+static int luaproc_checkmessage( lua_State *L, message *msg ) {
+  /* each level of nested tables holds a table, a key and a value, besides
+     the table of tables referred to again and a view's (or userdata's)
+     metatable */
+  return lua_checkstack( L, msg->nvalues + 3 * msg->depth + 2 );
+}
+
+/* push the values of a serialized message and drop a reference to it. the
+   stack MUST have room for them (see luaproc_checkmessage) */
+static void luaproc_decode( lua_State *L, message *msg ) {
+
+  decoder d;
+  char *end = (char *)( msg + 1 ) + msg->size;
+
+  d.L = L;
+  d.data = (char *)( msg + 1 );
+  d.refs = 0;
+  d.ntables = 0;
+
+  /* tables referred to more than once are looked up by order */
+  if ( msg->tablerefs > 0 ) {
+    lua_newtable( L );
+    d.refs = lua_gettop( L );
+  }
+  while ( d.data < end ) {
+    luaproc_decode_value( &d );
+  }
+  if ( d.refs != 0 ) {
+    lua_remove( L, d.refs );
+  }
+
+  message_unref( msg );
+}
+
+/* copy a message with tables (or userdata that moves) between lua states'
+   stacks (from stack position 'first' and up of the source) through its
+   serialization */
+static int luaproc_copymessage( lua_State *Lfrom, lua_State *Lto,
+                                int first ) {
+
+  message *msg = luaproc_encode( Lfrom, first, TRUE );
+
+  if ( msg == NULL ) {
+    lua_settop( Lto, 1 );
+    lua_pushnil( Lto );
+    lua_pushstring( Lto, lua_tostring( Lfrom, -1 ));
+    return FALSE;
+  }
+  if ( !luaproc_checkmessage( Lto, msg )) {
+    message_unref( msg );
+    lua_pushnil( Lto );
+    lua_pushstring( Lto, "not enough space in the stack" );
+    lua_pushnil( Lfrom );
+    lua_pushstring( Lfrom, "not enough space in the receiver's stack" );
+    return FALSE;
+  }
+  luaproc_decode( Lto, msg );
+
+  return TRUE;
+}
+
+/* copies values between lua states' stacks (from stack position 'first' and
+   up of the source). values are copied directly, unless there are tables */
+static int luaproc_copyvalues( lua_State *Lfrom, lua_State *Lto,
+                               int first ) {
+
+  int i;
+  int n = lua_gettop( Lfrom );
+  int top = lua_gettop( Lto );
+  const char *str;
+  size_t len;
+
+  /* ensure there is space in the receiver's stack (and for a view's
+     metatable) */
+  if ( lua_checkstack( Lto, n + 1 ) == 0 ) {
+    lua_pushnil( Lto );
+    lua_pushstring( Lto, "not enough space in the stack" );
+    lua_pushnil( Lfrom );
+    lua_pushstring( Lfrom, "not enough space in the receiver's stack" );
+    return FALSE;
+  }
+
+  /* test each value's type and, if it's supported, copy value */
+  for ( i = first; i <= n; i++ ) {
+    switch ( lua_type( Lfrom, i )) {
+      case LUA_TBOOLEAN:
+        lua_pushboolean( Lto, lua_toboolean( Lfrom, i ));
+        break;
+      case LUA_TNUMBER:
+        copynumber( Lto, Lfrom, i );
+        break;
+      case LUA_TSTRING: {
+        str = lua_tolstring( Lfrom, i, &len );
+        lua_pushlstring( Lto, str, len );
+        break;
+      }
+      case LUA_TNIL:
+        lua_pushnil( Lto );
+        break;
+      case LUA_TTABLE:
+        /* start over, serializing the whole message (tables it has more
+           than once are copied only once) */
+        lua_settop( Lto, top );
+        return luaproc_copymessage( Lfrom, Lto, first );
+      case LUA_TUSERDATA:
+        if ( luaproc_copyshared( Lfrom, i, Lto )) {
+          break;
+        }
+        /* userdata that moves does so only if the whole message can be
+           copied, so it starts over too */
+        if ( luaproc_tomoving( Lfrom, i ) != NULL ) {
+          lua_settop( Lto, top );
+          return luaproc_copymessage( Lfrom, Lto, first );
+        }
+        /* fall through */
+      default: /* value type not supported: function, userdata, etc. */
+        lua_settop( Lto, 1 );
+        lua_pushnil( Lto );
+        lua_pushfstring( Lto, "failed to receive value of unsupported type "
+                                "'%s'", luaL_typename( Lfrom, i ));
+        lua_pushnil( Lfrom );
+        lua_pushfstring( Lfrom, "failed to send value of unsupported type "
+                                "'%s'", luaL_typename( Lfrom, i ));
+        return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/* store a message in a channel's buffer, which MUST have room for it; on
+   failure, push nil and an error message and return FALSE. caller MUST lock
+   the channel */
+static int luaproc_buffer_push( channel *chan, lua_State *L, int first ) {
+
+  message *msg = luaproc_encode( L, first, TRUE );
+
+  if ( msg == NULL ) {
+    return FALSE;
+  }
+  chan->buffer[( chan->first + chan->count ) % chan->capacity] = msg;
+  chan->count++;
+
+  return TRUE;
+}
+
+/* store a reference to a (shared) message in a channel's buffer, which MUST
+   have room for it. caller MUST lock the channel */
+static void luaproc_buffer_share( channel *chan, message *msg ) {
+  __atomic_add_fetch( &msg->refs, 1, __ATOMIC_RELAXED );
+  chan->buffer[( chan->first + chan->count ) % chan->capacity] = msg;
+  chan->count++;
+}
+
+/* push the values of the oldest message in a channel's buffer and remove it
+   from the buffer; if there is not enough space in the stack, push nil and
+   an error message instead and return FALSE. caller MUST lock the channel */
+static int luaproc_buffer_pop( channel *chan, lua_State *L ) {
+
+  message *msg = chan->buffer[chan->first];
+
+  if ( !luaproc_checkmessage( L, msg )) {
+    lua_pushnil( L );
+    lua_pushstring( L, "not enough space in the stack" );
+    return FALSE;
+  }
+  chan->first = ( chan->first + 1 ) % chan->capacity;
+  chan->count--;
+  luaproc_decode( L, msg );
+
+  return TRUE;
+}
+
+/* return the lua process associated with a given lua state */
+static luaproc *luaproc_getself( lua_State *L ) {
+
+  luaproc *lp;
+
+  lua_getfield( L, LUA_REGISTRYINDEX, "LUAPROC_LP_UDATA" );
+  lp = (luaproc *)lua_touserdata( L, -1 );
+  lua_pop( L, 1 );
+
+  return lp;
+}
+
+/* claim the oldest select with a send (or receive) case waiting on a
+   channel, dropping the cases of selects completed meanwhile; return its lua
+   process and the case index (or NULL if none). if nvalues is not negative,
+   only a send case of that many values is claimed. caller MUST lock the
+   channel */
+static luaproc *channel_select_claim( channel *chan, int send, int nvalues,
+                                      int *index ) {
+
+  selcase *c, *prev = NULL;
+  luaproc *lp;
+
+  while (( c = ( prev == NULL ) ? chan->selects : prev->next ) != NULL ) {
+    if (( c->send == send ) && (( nvalues < 0 ) || ( c->nvalues == nvalues ))
+        && ( select_claim( c->sel ))) {
+      lp = c->sel->lp;
+      *index = c->index;
+      channel_select_unlink( chan, prev );
+      luaproc_untime( lp );
+      return lp;
+    }
+    if ( __atomic_load_n( &c->sel->state, __ATOMIC_ACQUIRE ) !=
+         LUAPROC_SELECT_WAITING ) {
+      channel_select_unlink( chan, prev );
+    } else {
+      prev = c;
+    }
+  }
+
+  return NULL;
+}
+
+/* push the values of a select's send case (positions 3 and up of the case
+   table, which is kept at stack position 1) and return the position of the
+   first one */
+static int luaproc_select_values( lua_State *L, int index ) {
+
+  int i, n, first = lua_gettop( L ) + 1;
+
+  lua_rawgeti( L, 1, index );
+  n = (int)lua_rawlen( L, first );
+  lua_checkstack( L, n );
+  for ( i = 3; i <= n; i++ ) {
+    lua_rawgeti( L, first, i );
+  }
+  lua_remove( L, first );
+
+  return first;
+}
+
+/* unblock a lua process whose channel operation was completed: schedule it
+   to run next on this worker or, if it is the main lua state, wake it up.
+   caller MUST lock the channel */
+static void luaproc_wakeup( luaproc *lp ) {
+  if ( lp == &mainlp ) {
+    luaproc_main_wakeup();
+  } else {
+    sched_queue_proc_next( lp );
+  }
+}
+
+/* remove the oldest lua process waiting to send on a channel, either a
+   blocked send or a select's send case, and return it (or NULL if none)
+   along with the stack position of its values and its select case index (0
+   if not a select). if nvalues is not negative, only a sender of that many
+   values is taken. caller MUST lock the channel */
+static luaproc *channel_take_sender( channel *chan, int nvalues, int *first,
+                                     int *index ) {
+
+  luaproc *lp = chan->send.head;
+
+  *index = 0;
+  if ( lp != NULL ) {
+    if (( nvalues >= 0 ) && ( lua_gettop( lp->lstate ) - 1 != nvalues )) {
+      return NULL;
+    }
+    list_remove( &chan->send );
+    *first = 2;  /* channel name is on the stack */
+  } else if (( lp = channel_select_claim( chan, TRUE, nvalues,
+                                          index )) != NULL ) {
+    *first = luaproc_select_values( lp->lstate, *index );
+  }
+
+  return lp;
+}
+
+/* unblock a sender whose values were taken, returning true to it (preceded
+   by its select case index, if any) or, if sent is FALSE, the nil and error
+   message already in its stack. caller MUST lock the channel */
+static void luaproc_release_sender( luaproc *lp, int index, int sent ) {
+  if ( sent ) {
+    if ( index > 0 ) {
+      lua_settop( lp->lstate, 1 );
+      lua_pushinteger( lp->lstate, index );
+    }
+    lua_pushboolean( lp->lstate, TRUE );
+  }
+  lp->args = ( sent && index == 0 ) ? 1 : 2;
+  luaproc_wakeup( lp );
+}
+
+/* remove the oldest lua process waiting to receive on a channel, either a
+   blocked receive or a select's receive case (whose index is pushed to it),
+   and return it (or NULL if none). either way the values it receives go
+   above stack position 1. caller MUST lock the channel */
+static luaproc *channel_take_receiver( channel *chan ) {
+
+  luaproc *lp = list_remove( &chan->recv );
+  int index;
+
+  if ( lp != NULL ) {
+    luaproc_untime( lp );
+  } else if (( lp = channel_select_claim( chan, FALSE, -1,
+                                          &index )) != NULL ) {
+    lua_pushinteger( lp->lstate, index );
+  }
+
+  return lp;
+}
+
+/* move the messages of blocked senders (or publishes) into the room left in
+   a channel's buffer and unblock them. caller MUST lock the channel */
+static void luaproc_buffer_refill( channel *chan ) {
+
+  luaproc *srclp;
+  pubwait *w;
+  int first, index;
+
+  while (( chan->count < chan->capacity ) &&
+         (( srclp = channel_take_sender( chan, -1, &first,
+                                         &index )) != NULL )) {
+    luaproc_release_sender( srclp, index,
+                            luaproc_buffer_push( chan, srclp->lstate,
+                                                 first ));
+  }
+  while (( chan->count < chan->capacity ) && (( w = chan->pubs ) != NULL )) {
+    chan->pubs = w->next;
+    if ( chan->pubs == NULL ) {
+      chan->lastpub = NULL;
+    }
+    luaproc_buffer_share( chan, w->pub->msg );
+    luaproc_publish_done( w->pub );
+  }
+}
+
+/* hand a (shared) message to a lua process taken from a channel's
+   receivers and unblock it. caller MUST lock the channel */
+static void luaproc_deliver( luaproc *lp, message *msg ) {
+  if ( !luaproc_checkmessage( lp->lstate, msg )) {
+    lua_settop( lp->lstate, 1 );
+    lua_pushnil( lp->lstate );
+    lua_pushstring( lp->lstate, "not enough space in the stack" );
+  } else {
+    __atomic_add_fetch( &msg->refs, 1, __ATOMIC_RELAXED );
+    luaproc_decode( lp->lstate, msg );
+  }
+  lp->args = lua_gettop( lp->lstate ) - 1;
+  luaproc_wakeup( lp );
+}
+
+/* push the results of a finished lua process (kept by a joinable) and
+   return how many they are */
+static int luaproc_join_results( lua_State *L, message *result ) {
+  if ( result == NULL ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough memory" );
+    return 2;
+  }
+  if ( !luaproc_checkmessage( L, result )) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough space in the stack" );
+    return 2;
+  }
+  __atomic_add_fetch( &result->refs, 1, __ATOMIC_RELAXED );
+  luaproc_decode( L, result );
+  return result->nvalues;
+}
+
+/* store the results of a lua process that has finished (or failed, in which
+   case they are nil and its error message) for the lua processes joining it,
+   which are unblocked; the stack of a finished lua process is emptied, so it
+   can be recycled */
+void luaproc_finish( luaproc *lp, int ok ) {
+
+  joinable *j = lp->result;
+  lua_State *L = lp->lstate;
+  message *result;
+  luaproc *waiting;
+
+  if ( j != NULL ) {
+    lp->result = NULL;
+    if ( ok ) {
+      result = luaproc_encode( L, 1, FALSE );
+    } else {
+      lua_pushnil( L );
+      lua_pushvalue( L, -2 );
+      result = luaproc_encode( L, lua_gettop( L ) - 1, FALSE );
+    }
+    /* results of unsupported types are replaced by the error pushed */
+    if ( result == NULL ) {
+      result = luaproc_encode( L, lua_gettop( L ) - 1, FALSE );
+    }
+
+    pthread_mutex_lock( &j->mutex );
+    j->result = result;
+    j->done = TRUE;
+    while (( waiting = list_remove( &j->waiting )) != NULL ) {
+      waiting->args = luaproc_join_results( waiting->lstate, result );
+      luaproc_wakeup( waiting );
+    }
+    pthread_mutex_unlock( &j->mutex );
+    joinable_unref( j );
+  }
+
+  if ( ok ) {
+    lua_settop( L, 0 );
+  }
+}
+
+/* let a lua process that blocked joining another one wait for it to finish.
+   the joinable was locked to check whether it had */
+void luaproc_queue_joiner( luaproc *lp ) {
+  list_insert( &lp->joining->waiting, lp );
+  pthread_mutex_unlock( &lp->joining->mutex );
+}
+
+/* publish a message to every subscription of a locked broadcast channel: it
+   is encoded once and then either handed to a waiting receiver or shared by
+   the subscriptions' buffers. a full subscription drops its oldest message
+   or, by default, makes the publisher wait for room in it (publishers on
+   offload threads cannot wait, so they skip it). the broadcast channel is
+   unlocked */
+static int luaproc_publish( lua_State *L, channel *chan ) {
+
+  message *msg = luaproc_encode( L, 2, FALSE );
+  publish *pub = NULL;
+  pubwait *w = NULL;
+  channel *sub;
+  luaproc *lp;
+  int i, ret = TRUE;
+  int wait = !sched_is_offload_thread( );
+
+  if ( msg == NULL ) {  /* nil and error msg already in stack */
+    luaproc_unlock_channel( chan );
+    return 2;
+  }
+
+  for ( i = 0; i < chan->nsubs; i++ ) {
+    sub = chan->subs[i];
+    pthread_mutex_lock( &sub->mutex );
+    /* publishes already waiting on the subscription go first */
+    if (( sub->pubs == NULL ) &&
+        (( lp = channel_take_receiver( sub )) != NULL )) {
+      luaproc_deliver( lp, msg );
+    } else if (( sub->pubs == NULL ) && ( sub->count < sub->capacity )) {
+      luaproc_buffer_share( sub, msg );
+    } else if ( sub->dropoldest ) {
+      message_unref( sub->buffer[sub->first] );
+      sub->first = ( sub->first + 1 ) % sub->capacity;
+      sub->count--;
+      luaproc_buffer_share( sub, msg );
+    } else {
+      if (( pub == NULL ) && ( wait )) {
+        pub = (publish *)malloc( sizeof( publish ) +
+                                 ( chan->nsubs - i ) * sizeof( pubwait ));
+        if ( pub != NULL ) {
+          pub->lp = ( L == mainlp.lstate ) ? &mainlp : luaproc_getself( L );
+          pub->msg = msg;
+          __atomic_add_fetch( &msg->refs, 1, __ATOMIC_RELAXED );
+          pub->pending = 1;  /* the publisher's own, until it blocks */
+          w = (pubwait *)( pub + 1 );
+        }
+      }
+      if ( pub == NULL ) {  /* the subscription misses the message */
+        ret = FALSE;
+      } else {
+        __atomic_add_fetch( &pub->pending, 1, __ATOMIC_RELAXED );
+        w->pub = pub;
+        w->next = NULL;
+        if ( sub->lastpub == NULL ) {
+          sub->pubs = w;
+        } else {
+          sub->lastpub->next = w;
+        }
+        sub->lastpub = w;
+        w++;
+      }
+    }
+    pthread_mutex_unlock( &sub->mutex );
+  }
+
+  luaproc_unlock_channel( chan );
+  message_unref( msg );
+
+  if ( pub == NULL ) {
+    if ( ret != TRUE ) {
+      lua_pushnil( L );
+      if ( wait ) {
+        lua_pushliteral( L, "not enough memory" );
+      } else {
+        lua_pushliteral( L, "cannot wait on channels outside a lua process' "
+                            "main coroutine" );
+      }
+      return 2;
+    }
+    lua_pushboolean( L, TRUE );
+    return 1;
+  }
+
+  /* wait for room in the full subscriptions; true is returned once the
+     message is in all of them */
+  pub->lp->status = LUAPROC_STATUS_BLOCKED_PUBLISH;
+  pub->lp->pub = pub;
+  if ( L != mainlp.lstate ) {
+    /* the scheduler lets the publish complete once the process yielded */
+    return lua_yield( L, 0 );
+  }
+  sched_main_block();
+  luaproc_publish_done( pub );
+  sched_main_wait( NULL );
+
+  return mainlp.args;
+}
+
+/*
+   destroy a locked channel: unblock the lua processes waiting on it with an
+   error and discard its buffered messages. the subscriptions of a broadcast
+   channel are destroyed too
+ */
+static void channel_destroy( lua_State *L, channel *chan ) {
+
+  list *blockedlp;
+  luaproc *lp;
+  selcase *c;
+  pubwait *w;
+  channel *sub;
+  int i;
+
+  /* operations waiting to lock the channel will find it destroyed */
+  chan->destroyed = TRUE;
+
+  /*
+     dequeue lua processes waiting on the channel, return an error message
+     to each of them indicating channel was destroyed and schedule them
+     for execution (unblock them).
+   */
+  if ( chan->send.head != NULL ) {
+    lua_pushfstring( L, "channel '%s' destroyed while waiting for receiver", 
+                     chan->name );
+    blockedlp = &chan->send;
+  } else {
+    lua_pushfstring( L, "channel '%s' destroyed while waiting for sender", 
+                     chan->name );
+    blockedlp = &chan->recv;
+  }
+  while (( lp = list_remove( blockedlp )) != NULL ) {
+    luaproc_untime( lp );
+    /* return an error to each process */
+    lua_pushnil( lp->lstate );
+    lua_pushstring( lp->lstate, lua_tostring( L, -1 ));
+    lp->args = 2;
+    if ( lp == &mainlp ) {
+      luaproc_main_wakeup();  /* unblock the main lua state */
+    } else {
+      sched_queue_proc( lp ); /* schedule process for execution */
+    }
+  }
+  lua_pop( L, 1 );
+
+  /* same for selects waiting on the channel */
+  while (( c = chan->selects ) != NULL ) {
+    if ( select_claim( c->sel )) {
+      lp = c->sel->lp;
+      luaproc_untime( lp );
+      lua_pushnil( lp->lstate );
+      lua_pushfstring( lp->lstate, "channel '%s' destroyed while waiting "
+                       "for %s", chan->name, c->send ? "receiver" : "sender" );
+      lp->args = 2;
+      if ( lp == &mainlp ) {
+        luaproc_main_wakeup();
+      } else {
+        sched_queue_proc( lp );
+      }
+    }
+    channel_select_unlink( chan, NULL );
+  }
+
+  /* publishes waiting for room are completed without this subscription */
+  while (( w = chan->pubs ) != NULL ) {
+    chan->pubs = w->next;
+    luaproc_publish_done( w->pub );
+  }
+  chan->lastpub = NULL;
+
+  /* discard buffered messages */
+  channel_discard( chan );
+
+  /* destroy the subscriptions of a broadcast channel */
+  for ( i = 0; i < chan->nsubs; i++ ) {
+    sub = chan->subs[i];
+    pthread_mutex_lock( &sub->mutex );
+    sub->owner = NULL;
+    channel_unref( chan );  /* still referenced by the caller */
+    channel_destroy( L, sub );
+    pthread_mutex_unlock( &sub->mutex );
+    channel_unref( sub );
+  }
+  free( chan->subs );
+  chan->subs = NULL;
+  chan->nsubs = 0;
+}
+
+/* cancel a subscription to a broadcast channel, destroying it (return FALSE
+   if it is not subscribed). caller MUST hold a reference to it */
+static int channel_unsubscribe( lua_State *L, channel *sub ) {
+
+  channel *owner;
+  int i, ret;
+
+  pthread_mutex_lock( &sub->mutex );
+  owner = sub->owner;
+  if ( owner == NULL ) {
+    pthread_mutex_unlock( &sub->mutex );
+    return FALSE;
+  }
+  channel_ref( owner );
+  pthread_mutex_unlock( &sub->mutex );
+
+  /* lock order is broadcast channel, then subscription */
+  pthread_mutex_lock( &owner->mutex );
+  pthread_mutex_lock( &sub->mutex );
+  ret = ( sub->owner == owner );
+  if ( ret ) {
+    for ( i = 0; owner->subs[i] != sub; i++ );
+    owner->subs[i] = owner->subs[--owner->nsubs];
+    sub->owner = NULL;
+    channel_unref( owner );
+    channel_destroy( L, sub );
+  }
+  pthread_mutex_unlock( &sub->mutex );
+  pthread_mutex_unlock( &owner->mutex );
+  if ( ret ) {
+    channel_unref( sub );  /* the broadcast channel's */
+  }
+  channel_unref( owner );
+
+  return ret;
+}
+
+
+/* try to complete a select case (whose channel MUST be locked) right away;
+   return the number of results pushed (the case index followed by the
+   values received or true, or nil and an error message) or 0 if the case
+   cannot be completed yet */
+static int luaproc_select_try( lua_State *L, selcase *c ) {
+
+  channel *chan = c->chan;
+  luaproc *lp;
+  int ret, first, index;
+
+  if ( !c->send ) {
+    lua_pushinteger( L, c->index );
+    if ( chan->count > 0 ) {  /* buffered message? */
+      ret = luaproc_buffer_pop( chan, L );
+      luaproc_buffer_refill( chan );
+    } else if (( lp = channel_take_sender( chan, -1, &first,
+                                           &index )) != NULL ) {
+      ret = luaproc_copyvalues( lp->lstate, L, first );
+      luaproc_release_sender( lp, index, ret );
+    } else {
+      lua_pop( L, 1 );
+      return 0;
+    }
+    /* the case table is kept below the results */
+    return ( ret == TRUE ) ? lua_gettop( L ) - 1 : 2;
+  }
+
+  first = luaproc_select_values( L, c->index );
+  if (( lp = channel_take_receiver( chan )) != NULL ) {
+    ret = luaproc_copyvalues( L, lp->lstate, first );
+    lp->args = lua_gettop( lp->lstate ) - 1;
+    luaproc_wakeup( lp );
+  } else if ( chan->count < chan->capacity ) {  /* room in the buffer? */
+    ret = luaproc_buffer_push( chan, L, first );
+  } else {
+    lua_settop( L, first - 1 );
+    return 0;
+  }
+  if ( ret != TRUE ) {  /* nil and error msg already in stack */
+    return 2;
+  }
+  lua_settop( L, 1 );
+  lua_pushinteger( L, c->index );
+  lua_pushboolean( L, TRUE );
+
+  return 2;
+}
+
+/* create new lua process (its libraries are only opened when it first
+   runs, see luaproc_start) */
+static luaproc *luaproc_new( lua_State *L ) {
+
+  luaproc *lp;
+  lua_State *lpst = luaL_newstate();  /* create new lua state */
+
+  /* store the lua process in its own lua state */
+  lp = (luaproc *)lua_newuserdata( lpst, sizeof( struct stluaproc ));
+  lua_setfield( lpst, LUA_REGISTRYINDEX, "LUAPROC_LP_UDATA" );
+  lp->lstate = lpst;  /* insert created lua state into lua process struct */
+  lp->worker = NULL;
+  lp->timer.level = -1;
+  lp->timed = FALSE;
+  lp->fdwait.slot = -1;
+  lp->code = NULL;
+  lp->upvalues = NULL;
+  lp->fresh = TRUE;
+
+  return lp;
+}
+
+/* set a lua process that has not run yet up: open its libraries (unless its
+   lua state was recycled), load its code and set its upvalues. the worker
+   that first runs it does so, so what is allocated for it lies on that
+   worker's numa node. on failure, push an error message and return a lua
+   error status (0 if successful) */
+int luaproc_start( luaproc *lp ) {
+
+  lua_State *L = lp->lstate;
+  message *msg = lp->upvalues;
+  int i, n, ret;
+
+  if ( lp->code == NULL ) {
+    return 0;
+  }
+  if ( lp->fresh ) {
+    luaproc_openlualibs( L );  /* load standard libraries and luaproc */
+    /* register luaproc's own functions */
+    requiref( L, "luaproc", luaproc_loadlib, TRUE );
+    lp->fresh = FALSE;
+  }
+
+  ret = luaL_loadbuffer( L, lp->code, lp->codelen, "=newproc" );
+  free( lp->code );
+  lp->code = NULL;
+  lp->upvalues = NULL;
+  if ( ret != 0 ) {
+    if ( msg != NULL ) {
+      message_unref( msg );
+    }
+    return ret;
+  }
+
+  /* the upvalues are their number, their values and which of them are the
+     global table */
+  if ( msg != NULL ) {
+    if ( !luaproc_checkmessage( L, msg )) {
+      message_unref( msg );
+      lua_pushliteral( L, "not enough space in the stack" );
+      return LUA_ERRMEM;
+    }
+    luaproc_decode( L, msg );
+    n = (int)lua_tointeger( L, 2 );
+    for ( i = 1; i <= n; i++ ) {
+      lua_rawgeti( L, 4, i );
+      if ( lua_toboolean( L, -1 )) {
+        lua_pop( L, 1 );
+        lua_pushglobaltable( L );
+      } else {
+        lua_pop( L, 1 );
+        lua_rawgeti( L, 3, i );
+      }
+      lua_setupvalue( L, 1, i );
+    }
+    lua_settop( L, 1 );
+  }
+
+  return 0;
+}
+
+/* join schedule workers (called before exiting Lua) */
+static int luaproc_join_workers( lua_State *L ) {
+
+  channel *chan;
+  kventry *e;
+  int i, b;
+
+  sched_join_workers();
+  /* drop the channel table's references */
+  for ( i = 0; i < LUAPROC_CHANNEL_SHARDS; i++ ) {
+    for ( b = 0; b < channels[i].size; b++ ) {
+      while (( chan = channels[i].buckets[b] ) != NULL ) {
+        channels[i].buckets[b] = chan->nextinshard;
+        /* break the references between broadcast channels and their
+           subscriptions */
+        if ( chan->broadcast ) {
+          pthread_mutex_lock( &chan->mutex );
+          channel_destroy( L, chan );
+          pthread_mutex_unlock( &chan->mutex );
+        }
+        channel_unref( chan );
+      }
+    }
+    free( channels[i].buckets );
+    pthread_mutex_destroy( &channels[i].mutex );
+  }
+  /* release the shared store */
+  for ( i = 0; i < LUAPROC_STORE_SHARDS; i++ ) {
+    for ( b = 0; b < store[i].size; b++ ) {
+      while (( e = store[i].buckets[b] ) != NULL ) {
+        store[i].buckets[b] = e->next;
+        message_unref( e->value );
+        free( e );
+      }
+    }
+    free( store[i].buckets );
+    pthread_mutex_destroy( &store[i].mutex );
+  }
+  return 0;
+}
+
+/* writer function for lua_dump */
+static int luaproc_buff_writer( lua_State *L, const void *buff, size_t size, 
+                                void *ud ) {
+  (void)L;
+  luaL_addlstring((luaL_Buffer *)ud, (const char *)buff, size );
+  return 0;
+}
+
+/* serialize the upvalues of the function at stack position funcindex for a
+   new lua process: their number, a table of their values and a table of
+   which of them are the global table (those become the new lua process' own
+   global table). on failure, push nil and an error message and return
+   FALSE */
+static int luaproc_saveupvalues( lua_State *L, int funcindex,
+                                 message **msg ) {
+
+  int i, ok = TRUE, top = lua_gettop( L );
+
+  *msg = NULL;
+  if ( lua_getupvalue( L, funcindex, 1 ) == NULL ) {
+    return TRUE;
+  }
+  lua_pop( L, 1 );
+  if ( lua_checkstack( L, 6 ) == 0 ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough space in the stack" );
+    return FALSE;
+  }
+  lua_pushglobaltable( L );
+  lua_newtable( L );
+  lua_newtable( L );
+
+  /* test the type of each upvalue and, if it's supported, save it */
+  for ( i = 1; ( ok ) && ( lua_getupvalue( L, funcindex, i ) != NULL );
+        i++ ) {
+    if ( lua_rawequal( L, -1, top + 1 )) {
+      lua_pop( L, 1 );
+      lua_pushboolean( L, TRUE );
+      lua_rawseti( L, top + 3, i );
+      continue;
+    }
+    switch ( lua_type( L, -1 )) {
+      case LUA_TBOOLEAN:
+      case LUA_TNUMBER:
+      case LUA_TSTRING:
+      case LUA_TNIL:
+      case LUA_TTABLE:
+        lua_rawseti( L, top + 2, i );
+        break;
+      case LUA_TUSERDATA:
+        if (( luaproc_tobuffer( L, -1 ) != NULL ) ||
+            ( luaproc_toarray( L, -1 ) != NULL ) ||
+            ( luaproc_tofrozen( L, -1 ) != NULL )) {
+          lua_rawseti( L, top + 2, i );
+          break;
+        }
+        /* fall through */
+      default: /* value type not supported: function, userdata, etc. */
+        lua_pushnil( L );
+        lua_pushfstring( L, "failed to copy upvalue of unsupported type "
+                            "'%s'", luaL_typename( L, -2 ));
+        ok = FALSE;
+        break;
+    }
+  }
+
+  if ( ok ) {
+    lua_pushinteger( L, i - 1 );
+    lua_replace( L, top + 1 );
+    ok = (( *msg = luaproc_encode( L, top + 1, FALSE )) != NULL );
+  }
+  if ( !ok ) {  /* keep only nil and the error message */
+    lua_replace( L, top + 2 );
+    lua_replace( L, top + 1 );
+    lua_settop( L, top + 2 );
+    return FALSE;
+  }
+  lua_settop( L, top );
+
+  return TRUE;
+}
+
+
+/*********************
+ * library functions *
+ *********************/
+
+/* set maximum number of lua processes in the recycle list */
+static int luaproc_recycle_set( lua_State *L ) {
+
+  luaproc *lp;
+
+  /* validate parameter is a non negative number */
+  lua_Integer max = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, max >= 0, 1, "recycle limit must be positive" );
+
+  /* get exclusive access to recycled lua processes list */
+  pthread_mutex_lock( &mutex_recycle_list );
+
+  recyclemax = max;  /* set maximum number */
+
+  /* remove extra nodes and destroy each lua processes */
+  while ( list_count( &recycle_list ) > recyclemax ) {
+    lp = list_remove( &recycle_list );
+    lua_close( lp->lstate );
+  }
+  /* release exclusive access to recycled lua processes list */
+  pthread_mutex_unlock( &mutex_recycle_list );
+
+  return 0;
+}
+
+/* set default number of instructions lua processes may execute before being
+   preempted */
+static int luaproc_set_quantum( lua_State *L ) {
+  lua_Integer n = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, n >= 0, 1, "quantum must not be negative" );
+  sched_set_quantum( n );
+  return 0;
+}
+
+/* set default time (in milliseconds) lua processes may execute before being
+   preempted */
+static int luaproc_set_timeslice( lua_State *L ) {
+  lua_Integer n = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, n >= 0, 1, "time slice must not be negative" );
+  sched_set_timeslice( n );
+  return 0;
+}
+
+/* set maximum number of threads making blocking calls for lua processes */
+static int luaproc_set_blocking_threads( lua_State *L ) {
+  lua_Integer n = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, n >= 0, 1, "number of threads must not be negative" );
+  sched_set_offload_threads( n );
+  return 0;
+}
+
+/* move the calling lua process to an offload thread, where it is resumed with
+   true as the result of this function. the main lua state, coroutines and
+   processes already on an offload thread stay where they are */
+static int luaproc_offload( lua_State *L ) {
+
+  luaproc *self = luaproc_getself( L );
+
+  if (( L == mainlp.lstate ) || ( self == NULL ) || ( L != self->lstate ) ||
+      ( sched_is_offload_thread( ))) {
+    lua_pushboolean( L, FALSE );
+    return 1;
+  }
+  self->status = LUAPROC_STATUS_OFFLOAD;
+
+  return lua_yield( L, 0 );
+}
+
+/* move the calling lua process from an offload thread back to the workers */
+static int luaproc_offload_return( lua_State *L ) {
+
+  luaproc *self = luaproc_getself( L );
+
+  if (( self == NULL ) || ( L != self->lstate ) ||
+      ( !sched_is_offload_thread( ))) {
+    return 0;
+  }
+  /* whatever the blocking call left in its status, the lua process is only
+     to be queued back */
+  self->status = LUAPROC_STATUS_READY;
+
+  return lua_yield( L, 0 );
+}
+
+/* return the channel handle at a stack position (NULL if not a handle) */
+static channel **luaproc_tohandle( lua_State *L, int idx ) {
+
+  channel **handle = (channel **)lua_touserdata( L, idx );
+
+  if (( handle == NULL ) || ( !lua_getmetatable( L, idx ))) {
+    return NULL;
+  }
+  luaL_getmetatable( L, LUAPROC_CHANNEL_HANDLE );
+  if ( !lua_rawequal( L, -1, -2 )) {
+    handle = NULL;
+  }
+  lua_pop( L, 2 );
+
+  return handle;
+}
+
+/* reference the channel given by a handle or a name at a stack position and
+   return it, along with its name (return NULL if it does not exist) */
+static channel *luaproc_refchannel( lua_State *L, int idx,
+                                    const char **chname ) {
+
+  channel **handle = luaproc_tohandle( L, idx );
+
+  /* a handle already references its channel, so no lookup is needed */
+  if ( handle != NULL ) {
+    *chname = (*handle)->name;
+    channel_ref( *handle );
+    return *handle;
+  }
+
+  *chname = luaL_checkstring( L, idx );
+
+  return channel_get( *chname );
+}
+
+/* lock the channel given by a handle or a name at a stack position and
+   return it, along with its name (return NULL if it does not exist); the
+   channel must be unlocked with luaproc_unlock_channel */
+static channel *luaproc_checkchannel( lua_State *L, int idx,
+                                      const char **chname ) {
+
+  channel *chan = luaproc_refchannel( L, idx, chname );
+
+  return (( chan != NULL ) && ( channel_lock( chan ))) ? chan : NULL;
+}
+
+/* push a new handle to a channel, passing it a reference to the channel */
+static void luaproc_pushhandle( lua_State *L, channel *chan ) {
+
+  channel **handle = (channel **)lua_newuserdata( L, sizeof( channel * ));
+
+  *handle = chan;
+  luaL_getmetatable( L, LUAPROC_CHANNEL_HANDLE );
+  lua_setmetatable( L, -2 );
+}
+
+/* drop the reference of a collected channel handle */
+static int luaproc_handle_gc( lua_State *L ) {
+
+  channel **handle = (channel **)lua_touserdata( L, 1 );
+
+  if ( *handle != NULL ) {
+    /* a subscription is only reachable through its handle */
+    if ( (*handle)->subscription ) {
+      channel_unsubscribe( L, *handle );
+    }
+    channel_unref( *handle );
+    *handle = NULL;
+  }
+
+  return 0;
+}
+
+/* return a channel handle's string representation */
+static int luaproc_handle_tostring( lua_State *L ) {
+
+  channel **handle = (channel **)lua_touserdata( L, 1 );
+
+  lua_pushfstring( L, "channel '%s'", (*handle)->name );
+
+  return 1;
+}
+
+/* wait for the lua process of a handle to finish and return its results */
+static int luaproc_join( lua_State *L ) {
+
+  joinable **handle = (joinable **)luaL_checkudata( L, 1,
+                                                    LUAPROC_PROCESS_HANDLE );
+  joinable *j = *handle;
+  luaproc *self;
+
+  lua_settop( L, 1 );
+  pthread_mutex_lock( &j->mutex );
+
+  /* results are kept, so a lua process can be joined any number of times */
+  if ( j->done ) {
+    pthread_mutex_unlock( &j->mutex );
+    return luaproc_join_results( L, j->result );
+  }
+
+  if ( L == mainlp.lstate ) {
+    /* start the wait before unlocking, so the wakeup cannot be missed */
+    mainlp.status = LUAPROC_STATUS_BLOCKED_JOIN;
+    sched_main_block();
+    list_insert( &j->waiting, &mainlp );
+    pthread_mutex_unlock( &j->mutex );
+    sched_main_wait( NULL );
+    return mainlp.args;
+  }
+
+  self = luaproc_getself( L );
+  if (( self == NULL ) || ( L != self->lstate ) ||
+      ( sched_is_offload_thread( ))) {
+    pthread_mutex_unlock( &j->mutex );
+    lua_pushnil( L );
+    lua_pushliteral( L, "cannot join a lua process outside a lua process' "
+                        "main coroutine" );
+    return 2;
+  }
+
+  /* yield. the scheduler queues the lua process and unlocks the joinable */
+  self->status = LUAPROC_STATUS_BLOCKED_JOIN;
+  self->joining = j;
+  return lua_yield( L, 0 );
+}
+
+/* drop the reference of a collected lua process handle */
+static int luaproc_process_gc( lua_State *L ) {
+
+  joinable **handle = (joinable **)lua_touserdata( L, 1 );
+
+  if ( *handle != NULL ) {
+    joinable_unref( *handle );
+    *handle = NULL;
+  }
+
+  return 0;
+}
+
+/* return a lua process handle's string representation */
+static int luaproc_process_tostring( lua_State *L ) {
+  lua_pushfstring( L, "lua process (%p)", lua_touserdata( L, 1 ));
+  return 1;
+}
+
+/* return the shared buffer of a buffer view argument */
+static sharedbuf *luaproc_checkbuffer( lua_State *L, int idx ) {
+  return *(sharedbuf **)luaL_checkudata( L, idx, LUAPROC_BUFFER_HANDLE );
+}
+
+/* convert a (possibly negative) position in a buffer or array to an offset
+   from its start, as string functions do */
+static size_t luaproc_relpos( lua_State *L, int idx, lua_Integer def,
+                              size_t len ) {
+
+  lua_Integer pos = luaL_optinteger( L, idx, def );
+
+  if ( pos < 0 ) {
+    pos = ( 0 - (size_t)pos > len ) ? 0 : (lua_Integer)len + pos + 1;
+  }
+
+  return (size_t)pos;
+}
+
+/* create a shared buffer with a copy of a string and return a view of it */
+static int luaproc_create_buffer( lua_State *L ) {
+
+  size_t len;
+  const char *str = luaL_checklstring( L, 1, &len );
+  sharedbuf *b = (sharedbuf *)malloc( sizeof( sharedbuf ) + len );
+
+  if ( b == NULL ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough memory" );
+    return 2;
+  }
+  b->refs = 0;
+  b->len = len;
+  memcpy( b + 1, str, len );
+  luaproc_pushbuffer( L, b );
+
+  return 1;
+}
+
+/* return the length of a shared buffer */
+static int luaproc_sharedbuf_len( lua_State *L ) {
+  lua_pushinteger( L, (lua_Integer)luaproc_checkbuffer( L, 1 )->len );
+  return 1;
+}
+
+/* return a substring of a shared buffer (as string.sub does) */
+static int luaproc_sharedbuf_sub( lua_State *L ) {
+
+  sharedbuf *b = luaproc_checkbuffer( L, 1 );
+  size_t i = luaproc_relpos( L, 2, 1, b->len );
+  size_t j = luaproc_relpos( L, 3, -1, b->len );
+
+  if ( i < 1 ) {
+    i = 1;
+  }
+  if ( j > b->len ) {
+    j = b->len;
+  }
+  if ( i <= j ) {
+    lua_pushlstring( L, (char *)( b + 1 ) + i - 1, j - i + 1 );
+  } else {
+    lua_pushliteral( L, "" );
+  }
+
+  return 1;
+}
+
+/* return the byte values of a range of a shared buffer (as string.byte
+   does) */
+static int luaproc_sharedbuf_byte( lua_State *L ) {
+
+  sharedbuf *b = luaproc_checkbuffer( L, 1 );
+  size_t i = luaproc_relpos( L, 2, 1, b->len );
+  size_t j = luaproc_relpos( L, 3, (lua_Integer)i, b->len );
+  unsigned char *bytes = (unsigned char *)( b + 1 );
+  int n;
+
+  if ( i < 1 ) {
+    i = 1;
+  }
+  if ( j > b->len ) {
+    j = b->len;
+  }
+  if ( i > j ) {
+    return 0;
+  }
+  if (( j - i >= INT_MAX ) || ( !lua_checkstack( L, (int)( j - i + 1 )))) {
+    return luaL_error( L, "buffer slice too long" );
+  }
+  for ( n = 0; i <= j; i++, n++ ) {
+    lua_pushinteger( L, bytes[i - 1] );
+  }
+
+  return n;
+}
+
+/* return the contents of a shared buffer as a string */
+static int luaproc_sharedbuf_tostring( lua_State *L ) {
+
+  sharedbuf *b = luaproc_checkbuffer( L, 1 );
+
+  lua_pushlstring( L, (char *)( b + 1 ), b->len );
+
+  return 1;
+}
+
+/* are two views of the same shared buffer? */
+static int luaproc_sharedbuf_eq( lua_State *L ) {
+  lua_pushboolean( L, luaproc_tobuffer( L, 1 ) == luaproc_tobuffer( L, 2 ));
+  return 1;
+}
+
+/* drop the reference of a collected buffer view */
+static int luaproc_sharedbuf_gc( lua_State *L ) {
+
+  sharedbuf **view = (sharedbuf **)lua_touserdata( L, 1 );
+
+  if ( *view != NULL ) {
+    sharedbuf_unref( *view );
+    *view = NULL;
+  }
+
+  return 0;
+}
+
+/* return a buffer view's string representation (views of the same buffer
+   share it) */
+static int luaproc_sharedbuf_name( lua_State *L ) {
+  lua_pushfstring( L, "buffer (%p)", (void *)luaproc_checkbuffer( L, 1 ));
+  return 1;
+}
+
+/* create the buffer view metatable (views have len, sub, byte and tostring
+   methods) */
+static void luaproc_setbuffers( lua_State *L ) {
+  luaL_newmetatable( L, LUAPROC_BUFFER_HANDLE );
+  lua_pushcfunction( L, luaproc_sharedbuf_gc );
+  lua_setfield( L, -2, "__gc" );
+  lua_pushcfunction( L, luaproc_sharedbuf_name );
+  lua_setfield( L, -2, "__tostring" );
+  lua_pushcfunction( L, luaproc_sharedbuf_len );
+  lua_setfield( L, -2, "__len" );
+  lua_pushcfunction( L, luaproc_sharedbuf_eq );
+  lua_setfield( L, -2, "__eq" );
+  lua_createtable( L, 0, 4 );
+  lua_pushcfunction( L, luaproc_sharedbuf_len );
+  lua_setfield( L, -2, "len" );
+  lua_pushcfunction( L, luaproc_sharedbuf_sub );
+  lua_setfield( L, -2, "sub" );
+  lua_pushcfunction( L, luaproc_sharedbuf_byte );
+  lua_setfield( L, -2, "byte" );
+  lua_pushcfunction( L, luaproc_sharedbuf_tostring );
+  lua_setfield( L, -2, "tostring" );
+  lua_setfield( L, -2, "__index" );
+  lua_pop( L, 1 );
+}
+
+/* bulk kernels of shared arrays, for each element type T (summed as S and
+   scaled as W). they run over contiguous elements, and reductions keep
+   independent accumulators, so the compiler can vectorize them */
+#define LUAPROC_ARRAY_KERNELS( suffix, T, S, W ) \
+static void array_fill_##suffix( T *x, size_t n, T v ) { \
+  size_t i; \
+  for ( i = 0; i < n; i++ ) { \
+    x[i] = v; \
+  } \
+} \
+static S array_sum_##suffix( const T *x, size_t n ) { \
+  S s0 = 0, s1 = 0, s2 = 0, s3 = 0; \
+  size_t i; \
+  for ( i = 0; i + 4 <= n; i += 4 ) { \
+    s0 += (S)x[i]; \
+    s1 += (S)x[i + 1]; \
+    s2 += (S)x[i + 2]; \
+    s3 += (S)x[i + 3]; \
+  } \
+  for ( ; i < n; i++ ) { \
+    s0 += (S)x[i]; \
+  } \
+  return ( s0 + s1 ) + ( s2 + s3 ); \
+} \
+static void array_minmax_##suffix( const T *x, size_t n, T *min, T *max ) { \
+  T lo = x[0], hi = x[0]; \
+  size_t i; \
+  for ( i = 1; i < n; i++ ) { \
+    lo = ( x[i] < lo ) ? x[i] : lo; \
+    hi = ( x[i] > hi ) ? x[i] : hi; \
+  } \
+  *min = lo; \
+  *max = hi; \
+} \
+static void array_axpy_##suffix( T *y, const T *x, size_t n, T a ) { \
+  size_t i; \
+  for ( i = 0; i < n; i++ ) { \
+    y[i] = (T)( (W)y[i] + (W)a * (W)x[i] ); \
+  } \
+}
+
+/* integer elements wrap around (in unsigned arithmetic) rather than overflow */
+LUAPROC_ARRAY_KERNELS( f64, double, double, double )
+LUAPROC_ARRAY_KERNELS( f32, float, double, float )
+LUAPROC_ARRAY_KERNELS( i64, int64_t, uint64_t, uint64_t )
+LUAPROC_ARRAY_KERNELS( i32, int32_t, uint64_t, uint32_t )
+
+/* return the view of a shared array argument */
+static arrview *luaproc_checkarray( lua_State *L, int idx ) {
+  return (arrview *)luaL_checkudata( L, idx, LUAPROC_ARRAY_HANDLE );
+}
+
+/* return the address of an element of a view (from 0) */
+static void *arrview_at( arrview *view, size_t i ) {
+  return (char *)view->arr + LUAPROC_ARRAY_HEADER +
+         ( view->first + i ) * luaproc_array_sizes[view->arr->type];
+}
+
+/* push an element of a given shared array type */
+static void luaproc_array_push( lua_State *L, int type, const void *p ) {
+  switch ( type ) {
+    case LUAPROC_ARRAY_F64:
+      lua_pushnumber( L, (lua_Number)*(const double *)p );
+      break;
+    case LUAPROC_ARRAY_F32:
+      lua_pushnumber( L, (lua_Number)*(const float *)p );
+      break;
+    case LUAPROC_ARRAY_I64:
+      lua_pushinteger( L, (lua_Integer)*(const int64_t *)p );
+      break;
+    default:
+      lua_pushinteger( L, (lua_Integer)*(const int32_t *)p );
+      break;
+  }
+}
+
+/* convert the number at stack position idx to an element of a given shared
+   array type */
+static void luaproc_array_store( lua_State *L, int idx, int type, void *p ) {
+
+  lua_Integer integer;
+
+  switch ( type ) {
+    case LUAPROC_ARRAY_F64:
+      *(double *)p = (double)lua_tonumber( L, idx );
+      break;
+    case LUAPROC_ARRAY_F32:
+      *(float *)p = (float)lua_tonumber( L, idx );
+      break;
+    default:
+      integer = isinteger( L, idx ) ? lua_tointeger( L, idx ) :
+                                      (lua_Integer)lua_tonumber( L, idx );
+      if ( type == LUAPROC_ARRAY_I64 ) {
+        *(int64_t *)p = (int64_t)integer;
+      } else {
+        *(int32_t *)p = (int32_t)integer;
+      }
+      break;
+  }
+}
+
+/* return the offset (from 0) of an element position argument of a view */
+static size_t luaproc_array_checkindex( lua_State *L, arrview *view,
+                                        int idx ) {
+
+  lua_Integer i = luaL_checkinteger( L, idx );
+
+  luaL_argcheck( L, ( i >= 1 ) && ( (size_t)i <= view->len ), idx,
+                 "index out of range" );
+
+  return (size_t)i - 1;
+}
+
+/* create a shared array of a number of zeros (or with the numbers of an
+   array) and return a view of it */
+static int luaproc_create_array( lua_State *L ) {
+
+  int type = luaL_checkoption( L, 1, NULL, luaproc_array_types );
+  size_t size = luaproc_array_sizes[type];
+  size_t n, i;
+  lua_Integer count;
+  sharedarr *a = NULL;
+  arrview *view;
+
+  if ( lua_type( L, 2 ) == LUA_TTABLE ) {
+    n = (size_t)lua_rawlen( L, 2 );
+  } else {
+    count = luaL_checkinteger( L, 2 );
+    luaL_argcheck( L, count >= 0, 2, "size must not be negative" );
+    n = (size_t)count;
+  }
+
+  if ( n <= ( SIZE_MAX - LUAPROC_ARRAY_HEADER ) / size ) {
+    a = (sharedarr *)calloc( 1, LUAPROC_ARRAY_HEADER + n * size );
+  }
+  if ( a == NULL ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough memory" );
+    return 2;
+  }
+  a->refs = 0;
+  a->type = type;
+  a->n = n;
+  luaproc_pusharray( L, a, 0, n );
+
+  if ( lua_type( L, 2 ) == LUA_TTABLE ) {
+    view = (arrview *)lua_touserdata( L, -1 );
+    for ( i = 0; i < n; i++ ) {
+      lua_rawgeti( L, 2, (int)i + 1 );
+      if ( !lua_isnumber( L, -1 )) {
+        return luaL_error( L, "array element %d is not a number", (int)i + 1 );
+      }
+      luaproc_array_store( L, -1, type, arrview_at( view, i ));
+      lua_pop( L, 1 );
+    }
+  }
+
+  return 1;
+}
+
+/* return an element of a shared array */
+static int luaproc_array_get( lua_State *L ) {
+
+  arrview *view = luaproc_checkarray( L, 1 );
+  size_t i = luaproc_array_checkindex( L, view, 2 );
+
+  luaproc_array_push( L, view->arr->type, arrview_at( view, i ));
+
+  return 1;
+}
+
+/* set an element of a shared array */
+static int luaproc_array_set( lua_State *L ) {
+
+  arrview *view = luaproc_checkarray( L, 1 );
+  size_t i = luaproc_array_checkindex( L, view, 2 );
+
+  luaL_checknumber( L, 3 );
+  luaproc_array_store( L, 3, view->arr->type, arrview_at( view, i ));
+
+  return 0;
+}
+
+/* index a shared array view: numbers are element positions, anything else
+   looks up the methods table (its upvalue) */
+static int luaproc_array_index( lua_State *L ) {
+  if ( lua_type( L, 2 ) == LUA_TNUMBER ) {
+    return luaproc_array_get( L );
+  }
+  lua_pushvalue( L, 2 );
+  lua_rawget( L, lua_upvalueindex( 1 ));
+  return 1;
+}
+
+/* return the number of elements of a shared array view */
+static int luaproc_array_len( lua_State *L ) {
+  lua_pushinteger( L, (lua_Integer)luaproc_checkarray( L, 1 )->len );
+  return 1;
+}
+
+/* return the element type of a shared array */
+static int luaproc_array_type( lua_State *L ) {
+  lua_pushstring( L,
+                  luaproc_array_types[luaproc_checkarray( L, 1 )->arr->type] );
+  return 1;
+}
+
+/* return a view of a range of a shared array view's elements (positions as in
+   string.sub), without copying them */
+static int luaproc_array_slice( lua_State *L ) {
+
+  arrview *view = luaproc_checkarray( L, 1 );
+  size_t i = luaproc_relpos( L, 2, 1, view->len );
+  size_t j = luaproc_relpos( L, 3, -1, view->len );
+
+  if ( i < 1 ) {
+    i = 1;
+  }
+  if ( j > view->len ) {
+    j = view->len;
+  }
+  if ( i <= j ) {
+    luaproc_pusharray( L, view->arr, view->first + i - 1, j - i + 1 );
+  } else {
+    luaproc_pusharray( L, view->arr, view->first, 0 );
+  }
+
+  return 1;
+}
+
+/* set all elements of a shared array view to a number */
+static int luaproc_array_fill( lua_State *L ) {
+
+  arrview *view = luaproc_checkarray( L, 1 );
+  void *x = arrview_at( view, 0 );
+  arrvalue v;
+
+  luaL_checknumber( L, 2 );
+  luaproc_array_store( L, 2, view->arr->type, &v );
+  switch ( view->arr->type ) {
+    case LUAPROC_ARRAY_F64:
+      array_fill_f64( (double *)x, view->len, v.f64 );
+      break;
+    case LUAPROC_ARRAY_F32:
+      array_fill_f32( (float *)x, view->len, v.f32 );
+      break;
+    case LUAPROC_ARRAY_I64:
+      array_fill_i64( (int64_t *)x, view->len, v.i64 );
+      break;
+    default:
+      array_fill_i32( (int32_t *)x, view->len, v.i32 );
+      break;
+  }
+  lua_settop( L, 1 );
+
+  return 1;
+}
+
+/* return the sum of the elements of a shared array view */
+static int luaproc_array_sum( lua_State *L ) {
+
+  arrview *view = luaproc_checkarray( L, 1 );
+  void *x = arrview_at( view, 0 );
+
+  switch ( view->arr->type ) {
+    case LUAPROC_ARRAY_F64:
+      lua_pushnumber( L, array_sum_f64( (double *)x, view->len ));
+      break;
+    case LUAPROC_ARRAY_F32:
+      lua_pushnumber( L, array_sum_f32( (float *)x, view->len ));
+      break;
+    case LUAPROC_ARRAY_I64:
+      lua_pushinteger( L, (lua_Integer)(int64_t)array_sum_i64( (int64_t *)x,
+                                                               view->len ));
+      break;
+    default:
+      lua_pushinteger( L, (lua_Integer)(int64_t)array_sum_i32( (int32_t *)x,
+                                                               view->len ));
+      break;
+  }
+
+  return 1;
+}
+
+/* push the smallest (or largest) element of a shared array view (nil if it
+   is empty) */
+static int luaproc_array_minmax( lua_State *L, int max ) {
+
+  arrview *view = luaproc_checkarray( L, 1 );
+  void *x = arrview_at( view, 0 );
+  arrvalue lo, hi;
+
+  if ( view->len == 0 ) {
+    lua_pushnil( L );
+    return 1;
+  }
+  switch ( view->arr->type ) {
+    case LUAPROC_ARRAY_F64:
+      array_minmax_f64( (double *)x, view->len, &lo.f64, &hi.f64 );
+      break;
+    case LUAPROC_ARRAY_F32:
+      array_minmax_f32( (float *)x, view->len, &lo.f32, &hi.f32 );
+      break;
+    case LUAPROC_ARRAY_I64:
+      array_minmax_i64( (int64_t *)x, view->len, &lo.i64, &hi.i64 );
+      break;
+    default:
+      array_minmax_i32( (int32_t *)x, view->len, &lo.i32, &hi.i32 );
+      break;
+  }
+  luaproc_array_push( L, view->arr->type, max ? &hi : &lo );
+
+  return 1;
+}
+
+/* return the smallest element of a shared array view */
+static int luaproc_array_min( lua_State *L ) {
+  return luaproc_array_minmax( L, FALSE );
+}
+
+/* return the largest element of a shared array view */
+static int luaproc_array_max( lua_State *L ) {
+  return luaproc_array_minmax( L, TRUE );
+}
+
+/* add the elements of another view (of the same type and length), scaled by
+   a number, to the elements of a shared array view (y = a * x + y) */
+static int luaproc_array_axpy( lua_State *L ) {
+
+  arrview *y = luaproc_checkarray( L, 1 );
+  arrview *x = luaproc_checkarray( L, 3 );
+  void *py = arrview_at( y, 0 );
+  void *px = arrview_at( x, 0 );
+  arrvalue a;
+
+  luaL_checknumber( L, 2 );
+  luaL_argcheck( L, x->arr->type == y->arr->type, 3, "array types differ" );
+  luaL_argcheck( L, x->len == y->len, 3, "array lengths differ" );
+  luaproc_array_store( L, 2, y->arr->type, &a );
+  switch ( y->arr->type ) {
+    case LUAPROC_ARRAY_F64:
+      array_axpy_f64( (double *)py, (double *)px, y->len, a.f64 );
+      break;
+    case LUAPROC_ARRAY_F32:
+      array_axpy_f32( (float *)py, (float *)px, y->len, a.f32 );
+      break;
+    case LUAPROC_ARRAY_I64:
+      array_axpy_i64( (int64_t *)py, (int64_t *)px, y->len, a.i64 );
+      break;
+    default:
+      array_axpy_i32( (int32_t *)py, (int32_t *)px, y->len, a.i32 );
+      break;
+  }
+  lua_settop( L, 1 );
+
+  return 1;
+}
+
+/* are two views of the same range of the same shared array? */
+static int luaproc_array_eq( lua_State *L ) {
+
+  arrview *a = luaproc_toarray( L, 1 );
+  arrview *b = luaproc_toarray( L, 2 );
+
+  lua_pushboolean( L, ( a != NULL ) && ( b != NULL ) &&
+                      ( a->arr == b->arr ) && ( a->first == b->first ) &&
+                      ( a->len == b->len ));
+
+  return 1;
+}
+
+/* drop the reference of a collected shared array view */
+static int luaproc_array_gc( lua_State *L ) {
+
+  arrview *view = (arrview *)lua_touserdata( L, 1 );
+
+  if ( view->arr != NULL ) {
+    sharedarr_unref( view->arr );
+    view->arr = NULL;
+  }
+
+  return 0;
+}
+
+/* return a shared array view's string representation */
+static int luaproc_array_tostring( lua_State *L ) {
+
+  arrview *view = luaproc_checkarray( L, 1 );
+  char len[32];
+
+  /* lua_pushfstring has no format for size_t */
+  snprintf( len, sizeof( len ), "%zu", view->len );
+  lua_pushfstring( L, "array %s[%s] (%p)",
+                   luaproc_array_types[view->arr->type], len,
+                   (void *)view->arr );
+
+  return 1;
+}
+
+/* create the shared array view metatable (views are indexed by element
+   position and have methods) */
+static void luaproc_setarrays( lua_State *L ) {
+  luaL_newmetatable( L, LUAPROC_ARRAY_HANDLE );
+  lua_pushcfunction( L, luaproc_array_gc );
+  lua_setfield( L, -2, "__gc" );
+  lua_pushcfunction( L, luaproc_array_tostring );
+  lua_setfield( L, -2, "__tostring" );
+  lua_pushcfunction( L, luaproc_array_len );
+  lua_setfield( L, -2, "__len" );
+  lua_pushcfunction( L, luaproc_array_eq );
+  lua_setfield( L, -2, "__eq" );
+  lua_pushcfunction( L, luaproc_array_set );
+  lua_setfield( L, -2, "__newindex" );
+  lua_createtable( L, 0, 10 );
+  lua_pushcfunction( L, luaproc_array_get );
+  lua_setfield( L, -2, "get" );
+  lua_pushcfunction( L, luaproc_array_set );
+  lua_setfield( L, -2, "set" );
+  lua_pushcfunction( L, luaproc_array_len );
+  lua_setfield( L, -2, "len" );
+  lua_pushcfunction( L, luaproc_array_type );
+  lua_setfield( L, -2, "type" );
+  lua_pushcfunction( L, luaproc_array_slice );
+  lua_setfield( L, -2, "slice" );
+  lua_pushcfunction( L, luaproc_array_fill );
+  lua_setfield( L, -2, "fill" );
+  lua_pushcfunction( L, luaproc_array_sum );
+  lua_setfield( L, -2, "sum" );
+  lua_pushcfunction( L, luaproc_array_min );
+  lua_setfield( L, -2, "min" );
+  lua_pushcfunction( L, luaproc_array_max );
+  lua_setfield( L, -2, "max" );
+  lua_pushcfunction( L, luaproc_array_axpy );
+  lua_setfield( L, -2, "axpy" );
+  lua_pushcclosure( L, luaproc_array_index, 1 );
+  lua_setfield( L, -2, "__index" );
+  lua_pop( L, 1 );
+}
+
+/* return the values of the array part of a frozen table node */
+static frozenval *frozen_array( frozennode *node ) {
+  return (frozenval *)( node + 1 );
+}
+
+/* return the entries of the hash part of a frozen table node */
+static frozenentry *frozen_entries( frozennode *node ) {
+  return (frozenentry *)( frozen_array( node ) + node->narr );
+}
+
+/* return the buckets of the hash part of a frozen table node */
+static size_t *frozen_buckets( frozennode *node ) {
+  return (size_t *)( frozen_entries( node ) + node->nhash );
+}
+
+/* convert the key at stack position idx for a frozen table, as lua itself
+   does, pointing str to the bytes of a string (return FALSE if its type
+   cannot be a key) */
+static int frozen_key( lua_State *L, int idx, frozenval *key,
+                       const char **str ) {
+#if (LUA_VERSION_NUM >= 503)
+  int isint;
+#endif
+
+  key->len = 0;
+  switch ( lua_type( L, idx )) {
+    case LUA_TBOOLEAN:
+      key->type = LUAPROC_MSG_BOOLEAN;
+      key->u.i = lua_toboolean( L, idx );
+      return TRUE;
+    case LUA_TNUMBER:
+#if (LUA_VERSION_NUM >= 503)
+      /* floats with an integer value are the same keys as integers */
+      key->u.i = lua_tointegerx( L, idx, &isint );
+      if ( isint ) {
+        key->type = LUAPROC_MSG_INTEGER;
+        return TRUE;
+      }
+#endif
+      key->type = LUAPROC_MSG_NUMBER;
+      key->u.n = lua_tonumber( L, idx );
+      if ( key->u.n == 0 ) {
+        key->u.n = 0;  /* -0 is the same key as 0 */
+      }
+      return TRUE;
+    case LUA_TSTRING:
+      key->type = LUAPROC_MSG_STRING;
+      *str = lua_tolstring( L, idx, &key->len );
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+/* return the position of a frozen table key in an array part of a given
+   size (0 if it is not there) */
+static size_t frozen_arrayindex( const frozenval *key, size_t narr ) {
+  if ( key->type == LUAPROC_MSG_INTEGER ) {
+    if (( key->u.i >= 1 ) && ( (size_t)key->u.i <= narr )) {
+      return (size_t)key->u.i;
+    }
+  } else if ( key->type == LUAPROC_MSG_NUMBER ) {
+    if (( key->u.n >= 1 ) && ( key->u.n <= (lua_Number)narr ) &&
+        ( key->u.n == (lua_Number)(size_t)key->u.n )) {
+      return (size_t)key->u.n;
+    }
+  }
+  return 0;
+}
+
+/* return the hash of a frozen table key (str points to a string's bytes) */
+static unsigned int frozen_hash( const frozenval *key, const char *str ) {
+  switch ( key->type ) {
+    case LUAPROC_MSG_STRING:
+      return channel_hash( str, key->len );
+    case LUAPROC_MSG_INTEGER:
+      return channel_hash( (const char *)&key->u.i, sizeof( lua_Integer ));
+    case LUAPROC_MSG_NUMBER:
+      return channel_hash( (const char *)&key->u.n, sizeof( lua_Number ));
+    default:
+      return (unsigned int)key->u.i;
+  }
+}
+
+/* return the entry (plus one) of a key in the hash part of a frozen table
+   node (0 if it is not there) */
+static size_t frozen_find( frozen *block, frozennode *node,
+                           const frozenval *key, const char *str ) {
+
+  frozenentry *entries = frozen_entries( node );
+  frozenval *k;
+  size_t e;
+
+  if ( node->nbuckets == 0 ) {
+    return 0;
+  }
+  e = frozen_buckets( node )[frozen_hash( key, str ) &
+                             ( node->nbuckets - 1 )];
+  for ( ; e != 0; e = entries[e - 1].next ) {
+    k = &entries[e - 1].key;
+    if ( k->type != key->type ) {
+      continue;
+    }
+    switch ( k->type ) {
+      case LUAPROC_MSG_STRING:
+        if (( k->len == key->len ) &&
+            ( memcmp( block->data + k->u.off, str, k->len ) == 0 )) {
+          return e;
+        }
+        break;
+      case LUAPROC_MSG_NUMBER:
+        if ( k->u.n == key->u.n ) {
+          return e;
+        }
+        break;
+      default:
+        if ( k->u.i == key->u.i ) {
+          return e;
+        }
+        break;
+    }
+  }
+
+  return 0;
+}
+
+/* push a value of a frozen table (nested tables are pushed as views) */
+static void frozen_push( lua_State *L, frozen *block, const frozenval *v ) {
+  switch ( v->type ) {
+    case LUAPROC_MSG_BOOLEAN:
+      lua_pushboolean( L, (int)v->u.i );
+      break;
+    case LUAPROC_MSG_INTEGER:
+      lua_pushinteger( L, v->u.i );
+      break;
+    case LUAPROC_MSG_NUMBER:
+      lua_pushnumber( L, v->u.n );
+      break;
+    case LUAPROC_MSG_STRING:
+      lua_pushlstring( L, block->data + v->u.off, v->len );
+      break;
+    case LUAPROC_MSG_TABLE:
+      luaproc_pushfrozen( L, block, v->u.off );
+      break;
+    default:
+      lua_pushnil( L );
+      break;
+  }
+}
+
+/* make room for n more bytes (aligned for a node, if asked to) at the end of
+   a block being frozen, zeroed, and return their offset in *off */
+static int freeze_reserve( freezer *f, size_t n, int align, size_t *off ) {
+
+  size_t start = f->size, cap;
+  char *data;
+
+  if ( align ) {
+    start = ( start + 15 ) & ~(size_t)15;
+  }
+  if ( start + n > f->cap ) {
+    cap = ( f->cap * 2 > start + n ) ? f->cap * 2 : start + n;
+    if (( data = (char *)realloc( f->data, cap )) == NULL ) {
+      f->error = "not enough memory";
+      return FALSE;
+    }
+    f->data = data;
+    f->cap = cap;
+  }
+  memset( f->data + f->size, 0, start + n - f->size );
+  f->size = start + n;
+  *off = start;
+
+  return TRUE;
+}
+
+/* copy a string's bytes to a block being frozen */
+static int freeze_string( freezer *f, const char *str, size_t len,
+                          size_t *off ) {
+  if ( !freeze_reserve( f, len, FALSE, off )) {
+    return FALSE;
+  }
+  memcpy( f->data + *off, str, len );
+  return TRUE;
+}
+
+static int freeze_value( freezer *f, int idx, frozenval *v, int depth );
+
+/* freeze a table (at absolute stack position idx) into a node and return its
+   offset. a table frozen before in the same block (a cycle or a shared
+   table) is the same node */
+static int freeze_table( freezer *f, int idx, size_t *off, int depth ) {
+
+  lua_State *L = f->L;
+  frozennode *node;
+  frozenentry *entry;
+  frozenval key, value;
+  const char *str = NULL;
+  size_t narr, nhash = 0, nbuckets = 0, i, e = 0, *bucket;
+
+  if ( depth > LUAPROC_MSG_MAXDEPTH ) {
+    f->error = "tables nested too deeply";
+    return FALSE;
+  }
+  if ( lua_checkstack( L, 4 ) == 0 ) {
+    f->error = "not enough space in the stack";
+    return FALSE;
+  }
+  if ( f->seen == 0 ) {
+    lua_newtable( L );
+    f->seen = lua_gettop( L );
+  }
+  lua_pushvalue( L, idx );
+  lua_rawget( L, f->seen );
+  *off = (size_t)lua_tointeger( L, -1 );
+  lua_pop( L, 1 );
+  if ( *off > 0 ) {
+    (*off)--;
+    return TRUE;
+  }
+
+  /* size the node: keys 1 to the table's length go in its array part */
+  narr = (size_t)lua_rawlen( L, idx );
+  lua_pushnil( L );
+  while ( lua_next( L, idx ) != 0 ) {
+    if ( !frozen_key( L, -2, &key, &str )) {
+      f->error = "failed to freeze key of unsupported type '%s'";
+      f->tname = luaL_typename( L, -2 );
+      return FALSE;
+    }
+    if ( frozen_arrayindex( &key, narr ) == 0 ) {
+      nhash++;
+    }
+    lua_pop( L, 1 );
+  }
+  if ( nhash > 0 ) {
+    for ( nbuckets = 1; nbuckets < nhash; nbuckets *= 2 );
+  }
+  if ( !freeze_reserve( f, sizeof( frozennode ) + narr * sizeof( frozenval ) +
+                           nhash * sizeof( frozenentry ) +
+                           nbuckets * sizeof( size_t ), TRUE, off )) {
+    return FALSE;
+  }
+  node = (frozennode *)( f->data + *off );
+  node->narr = narr;
+  node->nhash = nhash;
+  node->nbuckets = nbuckets;
+  lua_pushvalue( L, idx );
+  lua_pushinteger( L, (lua_Integer)*off + 1 );
+  lua_rawset( L, f->seen );
+
+  /* the block may move as values are frozen, so the node is found again by
+     its offset after each one */
+  for ( i = 0; i < narr; i++ ) {
+    lua_rawgeti( L, idx, (int)i + 1 );
+    if ( !freeze_value( f, lua_gettop( L ), &value, depth )) {
+      return FALSE;
+    }
+    frozen_array( (frozennode *)( f->data + *off ))[i] = value;
+    lua_pop( L, 1 );
+  }
+  lua_pushnil( L );
+  while ( lua_next( L, idx ) != 0 ) {
+    frozen_key( L, -2, &key, &str );
+    if ( frozen_arrayindex( &key, narr ) != 0 ) {
+      lua_pop( L, 1 );
+      continue;
+    }
+    if ((( key.type == LUAPROC_MSG_STRING ) &&
+         ( !freeze_string( f, str, key.len, &key.u.off ))) ||
+        ( !freeze_value( f, lua_gettop( L ), &value, depth ))) {
+      return FALSE;
+    }
+    node = (frozennode *)( f->data + *off );
+    entry = frozen_entries( node ) + e;
+    entry->key = key;
+    entry->value = value;
+    bucket = frozen_buckets( node ) + ( frozen_hash( &key, str ) &
+                                        ( nbuckets - 1 ));
+    entry->next = *bucket;
+    *bucket = ++e;
+    lua_pop( L, 1 );
+  }
+
+  return TRUE;
+}
+
+/* freeze the value at absolute stack position idx, nested in 'depth'
+   tables */
+static int freeze_value( freezer *f, int idx, frozenval *v, int depth ) {
+
+  lua_State *L = f->L;
+  const char *str;
+
+  v->len = 0;
+  v->u.off = 0;
+  switch ( lua_type( L, idx )) {
+    case LUA_TNIL:
+      v->type = LUAPROC_MSG_NIL;
+      break;
+    case LUA_TBOOLEAN:
+      v->type = LUAPROC_MSG_BOOLEAN;
+      v->u.i = lua_toboolean( L, idx );
+      break;
+    case LUA_TNUMBER:
+      if ( isinteger( L, idx )) {
+        v->type = LUAPROC_MSG_INTEGER;
+        v->u.i = lua_tointeger( L, idx );
+      } else {
+        v->type = LUAPROC_MSG_NUMBER;
+        v->u.n = lua_tonumber( L, idx );
+      }
+      break;
+    case LUA_TSTRING:
+      v->type = LUAPROC_MSG_STRING;
+      str = lua_tolstring( L, idx, &v->len );
+      return freeze_string( f, str, v->len, &v->u.off );
+    case LUA_TTABLE:
+      v->type = LUAPROC_MSG_TABLE;
+      return freeze_table( f, idx, &v->u.off, depth + 1 );
+    default:
+      f->error = "failed to freeze value of unsupported type '%s'";
+      f->tname = luaL_typename( L, idx );
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* freeze a table (and the tables in it) into an immutable block shared by
+   lua processes and return a view of it */
+static int luaproc_freeze( lua_State *L ) {
+
+  freezer f;
+  frozen *block;
+  size_t root;
+  int ok;
+
+  luaL_checktype( L, 1, LUA_TTABLE );
+  lua_settop( L, 1 );
+
+  f.L = L;
+  f.size = 0;
+  f.cap = 256;
+  f.seen = 0;
+  f.error = NULL;
+  f.tname = NULL;
+  if (( f.data = (char *)malloc( f.cap )) == NULL ) {
+    f.error = "not enough memory";
+  }
+  ok = ( f.data != NULL ) && freeze_table( &f, 1, &root, 0 );
+  lua_settop( L, 1 );
+
+  block = ok ? (frozen *)malloc( sizeof( frozen )) : NULL;
+  if ( block == NULL ) {
+    free( f.data );
+    lua_pushnil( L );
+    lua_pushfstring( L, ( f.error != NULL ) ? f.error : "not enough memory",
+                     f.tname );
+    return 2;
+  }
+  /* give back the room left over after growing */
+  if ( f.cap > f.size ) {
+    block->data = (char *)realloc( f.data, f.size );
+    if ( block->data == NULL ) {
+      block->data = f.data;
+    }
+  } else {
+    block->data = f.data;
+  }
+  block->refs = 0;
+  block->size = f.size;
+  luaproc_pushfrozen( L, block, root );
+
+  return 1;
+}
+
+/* return the value of a key in a frozen table */
+static int luaproc_frozen_index( lua_State *L ) {
+
+  frozenview *view = (frozenview *)luaL_checkudata( L, 1,
+                                                    LUAPROC_FROZEN_HANDLE );
+  frozennode *node = (frozennode *)( view->block->data + view->node );
+  frozenval key;
+  const char *str = NULL;
+  size_t i;
+
+  if ( !frozen_key( L, 2, &key, &str )) {
+    lua_pushnil( L );
+  } else if (( i = frozen_arrayindex( &key, node->narr )) != 0 ) {
+    frozen_push( L, view->block, frozen_array( node ) + i - 1 );
+  } else if (( i = frozen_find( view->block, node, &key, str )) != 0 ) {
+    frozen_push( L, view->block, &frozen_entries( node )[i - 1].value );
+  } else {
+    lua_pushnil( L );
+  }
+
+  return 1;
+}
+
+/* refuse to change a frozen table */
+static int luaproc_frozen_newindex( lua_State *L ) {
+  return luaL_error( L, "attempt to modify a frozen table" );
+}
+
+/* return the length (of the array part) of a frozen table */
+static int luaproc_frozen_len( lua_State *L ) {
+
+  frozenview *view = (frozenview *)luaL_checkudata( L, 1,
+                                                    LUAPROC_FROZEN_HANDLE );
+
+  lua_pushinteger( L, (lua_Integer)( (frozennode *)( view->block->data +
+                                                     view->node ))->narr );
+  return 1;
+}
+
+/* return the key and value that follow a key in a frozen table (as next
+   does): the array part first, then the hash part */
+static int luaproc_frozen_next( lua_State *L ) {
+
+  frozenview *view = (frozenview *)luaL_checkudata( L, 1,
+                                                    LUAPROC_FROZEN_HANDLE );
+  frozennode *node = (frozennode *)( view->block->data + view->node );
+  frozenentry *entry;
+  frozenval key;
+  const char *str = NULL;
+  size_t pos = 0, e;
+
+  lua_settop( L, 2 );
+  if ( !lua_isnil( L, 2 )) {
+    if ( !frozen_key( L, 2, &key, &str )) {
+      return luaL_error( L, "invalid key to 'next'" );
+    }
+    if (( pos = frozen_arrayindex( &key, node->narr )) == 0 ) {
+      if (( e = frozen_find( view->block, node, &key, str )) == 0 ) {
+        return luaL_error( L, "invalid key to 'next'" );
+      }
+      pos = node->narr + e;
+    }
+  }
+
+  for ( ; pos < node->narr; pos++ ) {
+    if ( frozen_array( node )[pos].type != LUAPROC_MSG_NIL ) {
+      lua_pushinteger( L, (lua_Integer)pos + 1 );
+      frozen_push( L, view->block, frozen_array( node ) + pos );
+      return 2;
+    }
+  }
+  if ( pos - node->narr < node->nhash ) {
+    entry = frozen_entries( node ) + ( pos - node->narr );
+    frozen_push( L, view->block, &entry->key );
+    frozen_push( L, view->block, &entry->value );
+    return 2;
+  }
+
+  lua_pushnil( L );
+  return 1;
+}
+
+/* return an iterator over a frozen table's keys and values (or, for anything
+   else, what the standard pairs function does) */
+static int luaproc_pairs( lua_State *L ) {
+  lua_settop( L, 1 );
+  if ( luaproc_tofrozen( L, 1 ) != NULL ) {
+    lua_pushcfunction( L, luaproc_frozen_next );
+    lua_insert( L, 1 );
+    lua_pushnil( L );
+    return 3;
+  }
+  lua_getglobal( L, "pairs" );
+  lua_insert( L, 1 );
+  lua_call( L, 1, 3 );
+  return 3;
+}
+
+/* are two views of the same frozen table? */
+static int luaproc_frozen_eq( lua_State *L ) {
+
+  frozenview *a = luaproc_tofrozen( L, 1 );
+  frozenview *b = luaproc_tofrozen( L, 2 );
+
+  lua_pushboolean( L, ( a != NULL ) && ( b != NULL ) &&
+                      ( a->block == b->block ) && ( a->node == b->node ));
+
+  return 1;
+}
+
+/* drop the reference of a collected frozen table view */
+static int luaproc_frozen_gc( lua_State *L ) {
+
+  frozenview *view = (frozenview *)lua_touserdata( L, 1 );
+
+  if ( view->block != NULL ) {
+    frozen_unref( view->block );
+    view->block = NULL;
+  }
+
+  return 0;
+}
+
+/* return a frozen table view's string representation (views of the same
+   table share it) */
+static int luaproc_frozen_tostring( lua_State *L ) {
+
+  frozenview *view = (frozenview *)luaL_checkudata( L, 1,
+                                                    LUAPROC_FROZEN_HANDLE );
+
+  lua_pushfstring( L, "frozen table (%p)",
+                   (void *)( view->block->data + view->node ));
+
+  return 1;
+}
+
+/* create the frozen table view metatable (views are indexed like the tables
+   they were frozen from, and cannot be changed) */
+static void luaproc_setfrozen( lua_State *L ) {
+  luaL_newmetatable( L, LUAPROC_FROZEN_HANDLE );
+  lua_pushcfunction( L, luaproc_frozen_gc );
+  lua_setfield( L, -2, "__gc" );
+  lua_pushcfunction( L, luaproc_frozen_tostring );
+  lua_setfield( L, -2, "__tostring" );
+  lua_pushcfunction( L, luaproc_frozen_index );
+  lua_setfield( L, -2, "__index" );
+  lua_pushcfunction( L, luaproc_frozen_newindex );
+  lua_setfield( L, -2, "__newindex" );
+  lua_pushcfunction( L, luaproc_frozen_len );
+  lua_setfield( L, -2, "__len" );
+  lua_pushcfunction( L, luaproc_frozen_eq );
+  lua_setfield( L, -2, "__eq" );
+  lua_pushcfunction( L, luaproc_pairs );
+  lua_setfield( L, -2, "__pairs" );
+  lua_pushliteral( L, "frozen" );
+  lua_setfield( L, -2, "__metatable" );
+  lua_pop( L, 1 );
+}
+
+/* create the channel handle metatable (handles have send and receive
+   methods) */
+static void luaproc_sethandles( lua_State *L ) {
+  luaL_newmetatable( L, LUAPROC_CHANNEL_HANDLE );
+  lua_pushcfunction( L, luaproc_handle_gc );
+  lua_setfield( L, -2, "__gc" );
+  lua_pushcfunction( L, luaproc_handle_tostring );
+  lua_setfield( L, -2, "__tostring" );
+  lua_createtable( L, 0, 4 );
+  lua_pushcfunction( L, luaproc_send );
+  lua_setfield( L, -2, "send" );
+  lua_pushcfunction( L, luaproc_receive );
+  lua_setfield( L, -2, "receive" );
+  lua_pushcfunction( L, luaproc_send_batch );
+  lua_setfield( L, -2, "sendbatch" );
+  lua_pushcfunction( L, luaproc_receive_batch );
+  lua_setfield( L, -2, "receivebatch" );
+  lua_setfield( L, -2, "__index" );
+  lua_pop( L, 1 );
+}
+
+/* create the lua process handle metatable (handles have a join method) and
+   luaproc.joinall in the luaproc table on the top of the stack */
+static void luaproc_setprocesshandles( lua_State *L ) {
+  luaL_newmetatable( L, LUAPROC_PROCESS_HANDLE );
+  lua_pushcfunction( L, luaproc_process_gc );
+  lua_setfield( L, -2, "__gc" );
+  lua_pushcfunction( L, luaproc_process_tostring );
+  lua_setfield( L, -2, "__tostring" );
+  lua_createtable( L, 0, 1 );
+  lua_pushcfunction( L, luaproc_join );
+  lua_setfield( L, -2, "join" );
+  lua_setfield( L, -2, "__index" );
+  lua_pop( L, 1 );
+  if ( luaL_loadbuffer( L, luaproc_joinall_code,
+                        sizeof( luaproc_joinall_code ) - 1,
+                        "=luaproc.joinall" ) != 0 ) {
+    lua_error( L );
+  }
+  lua_pushcfunction( L, luaproc_join );
+  lua_call( L, 1, 1 );
+  lua_setfield( L, -2, "joinall" );
+}
+
+/* create luaproc.blocking in the luaproc table on the top of the stack */
+static void luaproc_setblocking( lua_State *L ) {
+  if ( luaL_loadbuffer( L, luaproc_blocking_code,
+                        sizeof( luaproc_blocking_code ) - 1,
+                        "=luaproc.blocking" ) != 0 ) {
+    lua_error( L );
+  }
+  lua_pushcfunction( L, luaproc_offload );
+  lua_pushcfunction( L, luaproc_offload_return );
+  lua_call( L, 2, 1 );
+  lua_setfield( L, -2, "blocking" );
+}
+
+/* create the luaproc.shared table in the luaproc table on the top of the
+   stack */
+static void luaproc_setstore( lua_State *L ) {
+  luaL_newlib( L, luaproc_store_funcs );
+  if ( luaL_loadbuffer( L, luaproc_store_pairs_code,
+                        sizeof( luaproc_store_pairs_code ) - 1,
+                        "=luaproc.shared.pairs" ) != 0 ) {
+    lua_error( L );
+  }
+  lua_pushcfunction( L, luaproc_store_keys );
+  lua_pushcfunction( L, luaproc_store_get );
+  lua_call( L, 2, 1 );
+  lua_setfield( L, -2, "pairs" );
+  lua_setfield( L, -2, "shared" );
+}
+
+/* set time (in microseconds) idle workers look for lua processes to execute
+   before going to sleep */
+static int luaproc_set_spin( lua_State *L ) {
+  lua_Integer n = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, n >= 0, 1, "spin time must not be negative" );
+  sched_set_spin( n );
+  return 0;
+}
+
+/* set whether the main lua state's thread runs lua processes while the main
+   lua state is blocked */
+static int luaproc_set_mainworker( lua_State *L ) {
+  luaL_checktype( L, 1, LUA_TBOOLEAN );
+  sched_set_mainhelp( lua_toboolean( L, 1 ));
+  return 0;
+}
+
+/* return the number of ready lua processes of each priority */
+static int luaproc_get_queue_depths( lua_State *L ) {
+
+  int prio, depths[LUAPROC_SCHED_PRIORITY_LEVELS];
+
+  sched_get_queue_depths( depths );
+  lua_createtable( L, 0, LUAPROC_SCHED_PRIORITY_LEVELS );
+  for ( prio = 0; prio < LUAPROC_SCHED_PRIORITY_LEVELS; prio++ ) {
+    lua_pushnumber( L, depths[prio] );
+    lua_setfield( L, -2, luaproc_priorities[prio] );
+  }
+
+  return 1;
+}
+
+/* suspend the calling lua process for a number of milliseconds */
+static int luaproc_sleep( lua_State *L ) {
+
+  struct timespec ts;
+  luaproc *self;
+  lua_Integer ms = luaL_checkinteger( L, 1 );
+
+  luaL_argcheck( L, ms >= 0, 1, "sleep time must not be negative" );
+
+  /* outside lua processes' main coroutines there is nothing to yield to, so
+     block the calling thread */
+  self = luaproc_getself( L );
+  if (( L == mainlp.lstate ) || ( self == NULL ) || ( L != self->lstate ) ||
+      ( sched_is_offload_thread( ))) {
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = ( ms % 1000 ) * 1000000L;
+    while (( nanosleep( &ts, &ts ) != 0 ) && ( errno == EINTR ));
+    return 0;
+  }
+
+  /* otherwise yield; the scheduler arms the timer */
+  self->timer.expires = sched_time() + (unsigned long)ms;
+  self->status = LUAPROC_STATUS_SLEEPING;
+
+  return lua_yield( L, 0 );
+}
+
+/* suspend the calling lua process until a file descriptor is ready for
+   reading or writing */
+static int luaproc_waitfd( lua_State *L ) {
+
+  static const char *const modes[] = { "r", "w", NULL };
+  struct pollfd pfd;
+  luaproc *self;
+  int ret;
+  int fd = (int)luaL_checkinteger( L, 1 );
+  int write = luaL_checkoption( L, 2, NULL, modes );
+  lua_Integer timeout = -1;
+
+  luaL_argcheck( L, fd >= 0, 1, "file descriptor must not be negative" );
+  if ( !lua_isnoneornil( L, 3 )) {
+    timeout = luaL_checkinteger( L, 3 );
+    luaL_argcheck( L, timeout >= 0, 3, "timeout must not be negative" );
+  }
+
+#ifdef __linux__
+  /* park lua processes' main coroutines on the scheduler's poller (unless
+     they only want to check the file descriptor) */
+  self = luaproc_getself( L );
+  if (( timeout != 0 ) && ( L != mainlp.lstate ) && ( self != NULL ) &&
+      ( L == self->lstate ) && ( !sched_is_offload_thread( ))) {
+    self->fdwait.fd = fd;
+    self->fdwait.write = write;
+    self->fdwait.timed = ( timeout > 0 );
+    if ( timeout > 0 ) {
+      self->timer.expires = sched_time() + (unsigned long)timeout;
+    }
+    self->status = LUAPROC_STATUS_WAITFD;
+    return lua_yield( L, 0 );
+  }
+#else
+  (void)self;
+#endif
+
+  /* otherwise poll, blocking the calling thread */
+  pfd.fd = fd;
+  pfd.events = write ? POLLOUT : POLLIN;
+  if ( timeout > INT_MAX ) {
+    timeout = INT_MAX;
+  }
+  while ((( ret = poll( &pfd, 1, (int)timeout )) < 0 ) && ( errno == EINTR ));
+  if (( ret > 0 ) && ( !( pfd.revents & POLLNVAL ))) {
+    lua_pushboolean( L, TRUE );
+    return 1;
+  }
+  lua_pushnil( L );
+  if ( ret == 0 ) {
+    lua_pushfstring( L, "timed out waiting for file descriptor %d", fd );
+  } else {
+    lua_pushstring( L, strerror( ret > 0 ? EBADF : errno ));
+  }
+  return 2;
+}
+
+/* wait until there are no more active lua processes */
+static int luaproc_wait( lua_State *L ) {
+  if ( L == mainlp.lstate ) {
+    sched_main_wait_all();
+  } else {
+    sched_wait();
+  }
+  return 0;
+}
+
+/* set number of workers (creates or destroys accordingly) */
+static int luaproc_set_numworkers( lua_State *L ) {
+
+  lua_Integer numworkers;
+  int i, ncpus, *cpus, ret;
+
+  /* validate parameter is a positive number */
+  numworkers = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, numworkers > 0, 1, "number of workers must be positive" );
+
+  /* pin workers to a set of cpus, if requested */
+  if ( !lua_isnoneornil( L, 2 )) {
+    luaL_checktype( L, 2, LUA_TTABLE );
+    lua_getfield( L, 2, "cpus" );
+    if ( !lua_isnil( L, -1 )) {
+      if ( !lua_istable( L, -1 )) {
+        luaL_error( L, "option 'cpus' must be a table" );
+      }
+      ncpus = lua_rawlen( L, -1 );
+      cpus = (int *)lua_newuserdata( L, ( ncpus + 1 ) * sizeof( int ));
+      for ( i = 0; i < ncpus; i++ ) {
+        lua_rawgeti( L, -2, i + 1 );
+        if (( !lua_isnumber( L, -1 )) || ( lua_tointeger( L, -1 ) < 0 )) {
+          luaL_error( L, "option 'cpus' must only contain cpu numbers" );
+        }
+        cpus[i] = lua_tointeger( L, -1 );
+        lua_pop( L, 1 );
+      }
+      ret = sched_set_affinity( cpus, ncpus );
+      if ( ret == LUAPROC_SCHED_AFFINITY_ERROR ) {
+        luaL_error( L, "failed to set worker cpu affinity" );
+      } else if ( ret != LUAPROC_SCHED_OK ) {
+        luaL_error( L, "not enough memory" );
+      }
+      lua_pop( L, 1 );
+    }
+    lua_pop( L, 1 );
+  }
+
+  /* set number of threads; signal error on failure */
+  ret = sched_set_numworkers( numworkers );
+  if ( ret == LUAPROC_SCHED_PTHREAD_ERROR ) {
+      luaL_error( L, "failed to create worker" );
+  } else if ( ret == LUAPROC_SCHED_AFFINITY_ERROR ) {
+      luaL_error( L, "failed to set worker cpu affinity" );
+  }
+
+  return 0;
+}
+
+/* size the worker pool automatically, or stop doing so */
+static int luaproc_set_autoscale( lua_State *L ) {
+
+  lua_Integer min, max, hysteresis;
+  int ret;
+
+  /* disable autoscaling */
+  if ( lua_isnoneornil( L, 1 ) ||
+       (( lua_isboolean( L, 1 )) && ( !lua_toboolean( L, 1 )))) {
+    sched_set_autoscale( 0, 0, 0 );
+    return 0;
+  }
+
+  /* validate parameters */
+  min = luaL_checkinteger( L, 1 );
+  max = luaL_checkinteger( L, 2 );
+  hysteresis = luaL_optinteger( L, 3, LUAPROC_SCHED_AUTOSCALE_HYSTERESIS );
+  luaL_argcheck( L, min > 0, 1, "minimum number of workers must be positive" );
+  luaL_argcheck( L, max >= min, 2, "maximum number of workers must not be "
+                 "lower than the minimum" );
+  luaL_argcheck( L, hysteresis >= 0, 3, "hysteresis must not be negative" );
+
+  /* enable autoscaling; signal error on failure */
+  ret = sched_set_autoscale( min, max, hysteresis );
+  if ( ret == LUAPROC_SCHED_PTHREAD_ERROR ) {
+    luaL_error( L, "failed to create worker" );
+  } else if ( ret == LUAPROC_SCHED_AFFINITY_ERROR ) {
+    luaL_error( L, "failed to set worker cpu affinity" );
+  }
+
+  return 0;
+}
+
+/* return the number of active workers */
+static int luaproc_get_numworkers( lua_State *L ) {
+  lua_pushnumber( L, sched_get_numworkers( ));
+  return 1;
+}
+
+/* create and schedule a new lua process */
+static int luaproc_create_newproc( lua_State *L ) {
+
+  size_t len;
+  luaproc *lp;
+  luaL_Buffer buff;
+  const char *code;
+  char *bin;
+  message *upvalues;
+  int d;
+  int quantum = LUAPROC_SCHED_QUANTUM_DEFAULT;
+  int timeslice = LUAPROC_SCHED_QUANTUM_DEFAULT;
+  int priority = LUAPROC_SCHED_PRIORITY_NORMAL;
+  int join = FALSE;
+  int lt = lua_type( L, 1 );
+  joinable **handle;
+
+  /* read options, if any */
+  if ( !lua_isnoneornil( L, 2 )) {
+    luaL_checktype( L, 2, LUA_TTABLE );
+    quantum = luaproc_getopt_int( L, 2, "quantum", quantum );
+    timeslice = luaproc_getopt_int( L, 2, "timeslice", timeslice );
+    priority = luaproc_getopt_option( L, 2, "priority", luaproc_priorities,
+                                      priority );
+    lua_getfield( L, 2, "join" );
+    join = lua_toboolean( L, -1 );
+    lua_pop( L, 1 );
+  }
+
+  /* check function argument type - must be function or string; in case it is
+     a string, compile it here (so syntax errors are raised to the caller) */
+  if ( lt == LUA_TSTRING ) {
+    code = lua_tolstring( L, 1, &len );
+    if ( luaL_loadbuffer( L, code, len, code ) != 0 ) {
+      lua_error( L );
+    }
+    lua_replace( L, 1 );
+  } else if ( lt != LUA_TFUNCTION ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "cannot use '%s' to create a new process",
+                     luaL_typename( L, 1 ));
+    return 2;
+  }
+
+  /* save its upvalues and dump it into a binary string: the lua process is
+     only set up by the worker that first runs it (see luaproc_start) */
+  lua_settop( L, 1 );
+  if ( !luaproc_saveupvalues( L, 1, &upvalues )) {
+    return 2;
+  }
+  luaL_buffinit( L, &buff );
+  d = dump( L, luaproc_buff_writer, &buff, FALSE );
+  if ( d != 0 ) {
+    if ( upvalues != NULL ) {
+      message_unref( upvalues );
+    }
+    lua_pushnil( L );
+    lua_pushfstring( L, "error %d dumping function to binary string", d );
+    return 2;
+  }
+  luaL_pushresult( &buff );
+  code = lua_tolstring( L, -1, &len );
+  if (( bin = (char *)malloc( len )) == NULL ) {
+    if ( upvalues != NULL ) {
+      message_unref( upvalues );
+    }
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough memory" );
+    return 2;
+  }
+  memcpy( bin, code, len );
+
+  /* a joinable lua process is returned a handle to, which keeps its
+     results */
+  if ( join ) {
+    handle = (joinable **)lua_newuserdata( L, sizeof( joinable * ));
+    *handle = (joinable *)malloc( sizeof( joinable ));
+    if ( *handle == NULL ) {
+      free( bin );
+      if ( upvalues != NULL ) {
+        message_unref( upvalues );
+      }
+      lua_pushnil( L );
+      lua_pushliteral( L, "not enough memory" );
+      return 2;
+    }
+    pthread_mutex_init( &(*handle)->mutex, NULL );
+    (*handle)->refs = 2;  /* the handle and the lua process */
+    (*handle)->done = FALSE;
+    (*handle)->result = NULL;
+    list_init( &(*handle)->waiting );
+    luaL_getmetatable( L, LUAPROC_PROCESS_HANDLE );
+    lua_setmetatable( L, -2 );
+  } else {
+    lua_pushboolean( L, TRUE );
+  }
+
+  /* get exclusive access to recycled lua processes list */
+  pthread_mutex_lock( &mutex_recycle_list );
+
+  /* check if a lua process can be recycled */
+  if ( recyclemax > 0 ) {
+    lp = list_remove( &recycle_list );
+    /* otherwise create a new lua process */
+    if ( lp == NULL ) {
+      lp = luaproc_new( L );
+    }
+  } else {
+    lp = luaproc_new( L );
+  }
+
+  /* release exclusive access to recycled lua processes list */
+  pthread_mutex_unlock( &mutex_recycle_list );
+
+  /* init lua process */
+  lp->status = LUAPROC_STATUS_IDLE;
+  lp->args   = 0;
+  lp->chan   = NULL;
+  lp->quantum = quantum;
+  lp->timeslice = timeslice;
+  lp->priority = priority;
+  lp->result = join ? *handle : NULL;
+  lp->code = bin;
+  lp->codelen = len;
+  lp->upvalues = upvalues;
+
+  sched_inc_lpcount();   /* increase active lua process count */
+  sched_queue_proc( lp );  /* schedule lua process for execution */
+
+  return 1;
+}
+
+/* send a message to a lua process */
+static int luaproc_send( lua_State *L ) {
+
+  int ret;
+  channel *chan;
+  luaproc *dstlp, *self;
+  const char *chname;
+
+  chan = luaproc_checkchannel( L, 1, &chname );
+  /* if channel is not found, return an error to lua */
+  if ( chan == NULL ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' does not exist", chname );
+    return 2;
+  }
+
+  /* messages sent to a broadcast channel go to all of its subscriptions */
+  if ( chan->broadcast ) {
+    return luaproc_publish( L, chan );
+  }
+
+  /* remove first lua process, if any, from channel's receivers */
+  dstlp = channel_take_receiver( chan );
+  
+  if ( dstlp != NULL ) { /* found a receiver? */
+    /* try to move values between lua states' stacks */
+    ret = luaproc_copyvalues( L, dstlp->lstate, 2 );
+    /* -1 because channel name (or a select's cases) is on the stack */
+    dstlp->args = lua_gettop( dstlp->lstate ) - 1; 
+    /* unblock the receiving lua process (to run next on this worker) */
+    luaproc_wakeup( dstlp );
+    /* unlock channel access */
+    luaproc_unlock_channel( chan );
+    if ( ret == TRUE ) { /* was send successful? */
+      lua_pushboolean( L, TRUE );
+      return 1;
+    } else { /* nil and error msg already in stack */
+      return 2;
+    }
+
+  } else if ( chan->count < chan->capacity ) {  /* room in the buffer? */
+    ret = luaproc_buffer_push( chan, L, 2 );
+    luaproc_unlock_channel( chan );
+    if ( ret == TRUE ) {
+      lua_pushboolean( L, TRUE );
+      return 1;
+    } else { /* nil and error msg already in stack */
+      return 2;
+    }
+
+  } else { 
+    if ( sched_is_offload_thread( )) {
+      /* a lua process on an offload thread cannot be suspended */
+      luaproc_unlock_channel( chan );
+      lua_pushnil( L );
+      lua_pushliteral( L, "cannot wait on channels outside a lua process' "
+                          "main coroutine" );
+      return 2;
+    } else if ( L == mainlp.lstate ) {
+      /* sending process is the parent (main) Lua state - block it */
+      mainlp.chan = chan;
+      mainlp.status = LUAPROC_STATUS_BLOCKED_SEND;
+      luaproc_queue_sender( &mainlp );
+      luaproc_main_wait( chan, &chan->send, -1 );
+      return mainlp.args;
+    } else {
+      /* sending process is a standard luaproc - set status, block and yield */
+      self = luaproc_getself( L );
+      if ( self != NULL ) {
+        self->status = LUAPROC_STATUS_BLOCKED_SEND;
+        self->chan   = chan;
+      }
+      /* yield. channel will be unlocked by the scheduler */
+      return lua_yield( L, lua_gettop( L ));
+    }
+  }
+}
+
+/* receive a message from a lua process */
+static int luaproc_receive( lua_State *L ) {
+
+  int ret, nargs, first, index, async = FALSE;
+  lua_Integer timeout = -1;
+  channel *chan;
+  luaproc *srclp, *self;
+  const char *chname;
+
+  /* get number of arguments passed to function */
+  nargs = lua_gettop( L );
+
+  /* second argument is either the async flag or an options table */
+  if ( lua_istable( L, 2 )) {
+    timeout = luaproc_getopt_int( L, 2, "timeout", -1 );
+  } else {
+    async = lua_toboolean( L, 2 );
+  }
+
+  chan = luaproc_checkchannel( L, 1, &chname );
+  /* if channel is not found, return an error to Lua */
+  if ( chan == NULL ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' does not exist", chname );
+    return 2;
+  }
+  /* messages are received from subscriptions to broadcast channels */
+  if ( chan->broadcast ) {
+    luaproc_unlock_channel( chan );
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' is a broadcast channel", chname );
+    return 2;
+  }
+
+  /* take the oldest buffered message, if any, making room for a blocked
+     sender */
+  if ( chan->count > 0 ) {
+    ret = luaproc_buffer_pop( chan, L );
+    luaproc_buffer_refill( chan );
+    luaproc_unlock_channel( chan );
+    if ( ret == TRUE ) {
+      return lua_gettop( L ) - nargs;
+    } else { /* nil and error msg already in stack */
+      return 2;
+    }
+  }
+
+  /* remove first lua process, if any, from channels' senders */
+  srclp = channel_take_sender( chan, -1, &first, &index );
+
+  if ( srclp != NULL ) {  /* found a sender? */
+    /* try to move values between lua states' stacks */
+    ret = luaproc_copyvalues( srclp->lstate, L, first );
+    /* unblock the sending lua process (to run next on this worker) */
+    luaproc_release_sender( srclp, index, ret );
+    /* unlock channel access */
+    luaproc_unlock_channel( chan );
+    /* disconsider channel name, async flag and any other args passed 
+       to the receive function when returning its results */
+    return lua_gettop( L ) - nargs; 
+
+  } else {  /* otherwise test if receive was synchronous or asynchronous */
+    /* asynchronous receive (a zero timeout is the same) */
+    if (( async ) || ( timeout == 0 )) {
+      /* unlock channel access */
+      luaproc_unlock_channel( chan );
+      /* return an error */
+      lua_pushnil( L );
+      lua_pushfstring( L, "no senders waiting on channel '%s'", chname );
+      return 2;
+    } else { /* synchronous receive */
+      if ( sched_is_offload_thread( )) {
+        /* a lua process on an offload thread cannot be suspended */
+        luaproc_unlock_channel( chan );
+        lua_pushnil( L );
+        lua_pushliteral( L, "cannot wait on channels outside a lua process' "
+                            "main coroutine" );
+        return 2;
+      } else if ( L == mainlp.lstate ) {
+        /*  receiving process is the parent (main) Lua state - block it */
+        mainlp.chan = chan;
+        mainlp.status = LUAPROC_STATUS_BLOCKED_RECV;
+        /* keep only the channel name, below the values to be received */
+        lua_settop( L, 1 );
+        luaproc_queue_receiver( &mainlp );
+        if ( !luaproc_main_wait( chan, &chan->recv, timeout )) {
+          lua_pushnil( L );
+          lua_pushfstring( L, "timed out waiting for sender on channel '%s'",
+                           chname );
+          return 2;
+        }
+        return mainlp.args;
+      } else {
+        /* receiving process is a standard luaproc - set status, block and 
+           yield */
+        self = luaproc_getself( L );
+        if ( self != NULL ) {
+          self->status = LUAPROC_STATUS_BLOCKED_RECV;
+          self->chan   = chan;
+          if ( timeout > 0 ) {
+            /* the scheduler arms the timer when it queues the receiver */
+            self->timer.expires = sched_time() + (unsigned long)timeout;
+            self->timed = TRUE;
+          }
+        }
+        /* keep only the channel name, below the values to be received */
+        lua_settop( L, 1 );
+        /* yield. channel will be unlocked by the scheduler */
+        return lua_yield( L, lua_gettop( L ));
+      }
+    }
+  }
+}
+
+/* send each value of an array as a message, under a single lock of the
+   channel, and return how many were sent (without blocking) */
+static int luaproc_send_batch( lua_State *L ) {
+
+  int i, n, ret;
+  channel *chan;
+  luaproc *dstlp;
+  const char *chname;
+
+  luaL_checktype( L, 2, LUA_TTABLE );
+  lua_settop( L, 2 );
+
+  /* check value types before sending any of them */
+  n = (int)lua_rawlen( L, 2 );
+  for ( i = 1; i <= n; i++ ) {
+    lua_rawgeti( L, 2, i );
+    if (( lua_type( L, 3 ) != LUA_TBOOLEAN ) &&
+        ( lua_type( L, 3 ) != LUA_TNUMBER ) &&
+        ( lua_type( L, 3 ) != LUA_TSTRING ) &&
+        ( lua_type( L, 3 ) != LUA_TTABLE ) &&
+        ( luaproc_tobuffer( L, 3 ) == NULL ) &&
+        ( luaproc_toarray( L, 3 ) == NULL ) &&
+        ( luaproc_tofrozen( L, 3 ) == NULL ) &&
+        ( luaproc_tomoving( L, 3 ) == NULL )) {
+      lua_pushnil( L );
+      lua_pushfstring( L, "failed to send value of unsupported type '%s'",
+                       luaL_typename( L, 3 ));
+      return 2;
+    }
+    lua_pop( L, 1 );
+  }
+
+  chan = luaproc_checkchannel( L, 1, &chname );
+  /* if channel is not found, return an error to lua */
+  if ( chan == NULL ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' does not exist", chname );
+    return 2;
+  }
+  if ( chan->broadcast ) {
+    luaproc_unlock_channel( chan );
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' is a broadcast channel", chname );
+    return 2;
+  }
+
+  /* hand messages to waiting receivers first, then buffer the rest */
+  for ( i = 1; i <= n; i++ ) {
+    lua_rawgeti( L, 2, i );
+    if (( dstlp = channel_take_receiver( chan )) != NULL ) {
+      ret = luaproc_copyvalues( L, dstlp->lstate, 3 );
+      dstlp->args = lua_gettop( dstlp->lstate ) - 1;
+      luaproc_wakeup( dstlp );
+    } else if ( chan->count < chan->capacity ) {
+      ret = luaproc_buffer_push( chan, L, 3 );
+    } else {
+      break;
+    }
+    lua_settop( L, 2 );
+    if ( ret != TRUE ) {
+      break;
+    }
+  }
+
+  luaproc_unlock_channel( chan );
+  lua_pushinteger( L, i - 1 );
+
+  return 1;
+}
+
+/* receive up to a maximum number of single value messages, under a single
+   lock of the channel, and return them in an array (without blocking) */
+static int luaproc_receive_batch( lua_State *L ) {
+
+  int n = 0, first, index;
+  lua_Integer max = luaL_checkinteger( L, 2 );
+  channel *chan;
+  luaproc *srclp;
+  const char *chname;
+
+  luaL_argcheck( L, max > 0, 2, "maximum must be positive" );
+
+  chan = luaproc_checkchannel( L, 1, &chname );
+  /* if channel is not found, return an error to lua */
+  if ( chan == NULL ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' does not exist", chname );
+    return 2;
+  }
+  if ( chan->broadcast ) {
+    luaproc_unlock_channel( chan );
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' is a broadcast channel", chname );
+    return 2;
+  }
+
+  /* the array takes the channel's place at the bottom of the stack, below
+     the values being received (the channel stays referenced until it is
+     unlocked) */
+  lua_createtable( L, ( max < chan->count ) ? (int)max : chan->count, 0 );
+  lua_replace( L, 1 );
+  lua_settop( L, 1 );
+
+  /* take buffered messages first, then those of waiting senders; stop at the
+     first message that is not a single value, which is left for a receive */
+  while ( n < max ) {
+    if ( chan->count > 0 ) {
+      if (( chan->buffer[chan->first]->nvalues != 1 ) ||
+          ( !luaproc_buffer_pop( chan, L ))) {
+        break;
+      }
+      luaproc_buffer_refill( chan );
+    } else if (( srclp = channel_take_sender( chan, 1, &first,
+                                              &index )) != NULL ) {
+      if ( !luaproc_copyvalues( srclp->lstate, L, first )) {
+        luaproc_release_sender( srclp, index, FALSE );
+        lua_settop( L, 1 );  /* drop the error; the message is lost */
+        continue;
+      }
+      luaproc_release_sender( srclp, index, TRUE );
+    } else {
+      break;
+    }
+    lua_rawseti( L, 1, ++n );
+  }
+
+  luaproc_unlock_channel( chan );
+  lua_settop( L, 1 );
+
+  return 1;
+}
+
+/* compare channels by address (the order selects lock them in) */
+static int luaproc_chancmp( const void *a, const void *b ) {
+
+  channel *ca = *(channel *const *)a;
+  channel *cb = *(channel *const *)b;
+
+  return ( ca < cb ) ? -1 : ( ca > cb );
+}
+
+/* release a select that did not wait, along with the channel references
+   taken by its first ncases cases */
+static void luaproc_select_free( selection *sel, int ncases ) {
+
+  int i;
+
+  for ( i = 0; i < ncases; i++ ) {
+    channel_unref( sel->cases[i].chan );
+  }
+  free( sel );
+}
+
+/* unlock the channels of a select */
+static void luaproc_select_unlock( selection *sel ) {
+
+  int i;
+
+  for ( i = 0; i < sel->nchans; i++ ) {
+    pthread_mutex_unlock( &sel->chans[i]->mutex );
+  }
+}
+
+/* register a select case on its (locked) channel, dropping the cases of
+   selects completed meanwhile */
+static void luaproc_select_register( selcase *c ) {
+
+  channel *chan = c->chan;
+  selcase *prev = NULL, *cur;
+
+  while (( cur = ( prev == NULL ) ? chan->selects : prev->next ) != NULL ) {
+    if ( __atomic_load_n( &cur->sel->state, __ATOMIC_ACQUIRE ) !=
+         LUAPROC_SELECT_WAITING ) {
+      channel_select_unlink( chan, prev );
+    } else {
+      prev = cur;
+    }
+  }
+  c->next = NULL;
+  if ( chan->lastselect == NULL ) {
+    chan->selects = c;
+  } else {
+    chan->lastselect->next = c;
+  }
+  chan->lastselect = c;
+}
+
+/* wait on several channel operations and complete the first one possible */
+static int luaproc_select( lua_State *L ) {
+
+  int i, n, ret, timedout = FALSE;
+  lua_Integer timeout = -1;
+  struct timespec until;
+  selection *sel;
+  selcase *c;
+  luaproc *self;
+  const char *op, *chname;
+
+  luaL_checktype( L, 1, LUA_TTABLE );
+  if ( !lua_isnoneornil( L, 2 )) {
+    timeout = luaL_checkinteger( L, 2 );
+    luaL_argcheck( L, timeout >= 0, 2, "timeout must not be negative" );
+  }
+  /* keep only the cases, below the values to be returned */
+  lua_settop( L, 1 );
+
+  /* check the cases before referencing any channel */
+  n = (int)lua_rawlen( L, 1 );
+  luaL_argcheck( L, n > 0, 1, "no cases given" );
+  for ( i = 1; i <= n; i++ ) {
+    lua_rawgeti( L, 1, i );
+    if ( !lua_istable( L, 2 )) {
+      return luaL_error( L, "bad select case #%d (table expected)", i );
+    }
+    lua_rawgeti( L, 2, 1 );
+    op = lua_tostring( L, 3 );
+    if (( op == NULL ) || (( strcmp( op, "send" ) != 0 ) &&
+                           ( strcmp( op, "recv" ) != 0 ))) {
+      return luaL_error( L, "bad select case #%d (invalid operation)", i );
+    }
+    lua_rawgeti( L, 2, 2 );
+    if (( !lua_isstring( L, 4 )) && ( luaproc_tohandle( L, 4 ) == NULL )) {
+      return luaL_error( L, "bad select case #%d (channel expected)", i );
+    }
+    lua_settop( L, 1 );
+  }
+
+  sel = (selection *)malloc( sizeof( selection ) +
+                             n * ( sizeof( selcase ) + sizeof( channel * )));
+  if ( sel == NULL ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough memory" );
+    return 2;
+  }
+  sel->cases = (selcase *)( sel + 1 );
+  sel->chans = (channel **)( sel->cases + n );
+  sel->ncases = n;
+  sel->state = LUAPROC_SELECT_WAITING;
+
+  /* reference the channels of the cases */
+  for ( i = 0; i < n; i++ ) {
+    c = &sel->cases[i];
+    lua_rawgeti( L, 1, i + 1 );
+    lua_rawgeti( L, 2, 1 );
+    lua_rawgeti( L, 2, 2 );
+    c->sel = sel;
+    c->index = i + 1;
+    c->send = ( strcmp( lua_tostring( L, 3 ), "send" ) == 0 );
+    c->nvalues = c->send ? (int)lua_rawlen( L, 2 ) - 2 : 0;
+    c->chan = luaproc_refchannel( L, 4, &chname );
+    if (( c->chan == NULL ) || ( c->chan->broadcast )) {
+      lua_pushnil( L );
+      lua_pushfstring( L, ( c->chan == NULL ) ?
+                          "channel '%s' does not exist" :
+                          "channel '%s' is a broadcast channel", chname );
+      luaproc_select_free( sel, ( c->chan == NULL ) ? i : i + 1 );
+      return 2;
+    }
+    sel->chans[i] = c->chan;
+    lua_settop( L, 1 );
+  }
+
+  /* lock each distinct channel, in address order so concurrent selects
+     cannot deadlock */
+  qsort( sel->chans, n, sizeof( channel * ), luaproc_chancmp );
+  sel->nchans = 1;
+  for ( i = 1; i < n; i++ ) {
+    if ( sel->chans[i] != sel->chans[sel->nchans - 1] ) {
+      sel->chans[sel->nchans++] = sel->chans[i];
+    }
+  }
+  for ( i = 0; i < sel->nchans; i++ ) {
+    pthread_mutex_lock( &sel->chans[i]->mutex );
+  }
+  for ( i = 0; i < n; i++ ) {
+    if ( sel->cases[i].chan->destroyed ) {
+      lua_pushnil( L );
+      lua_pushfstring( L, "channel '%s' does not exist",
+                       sel->cases[i].chan->name );
+      luaproc_select_unlock( sel );
+      luaproc_select_free( sel, n );
+      return 2;
+    }
+  }
+
+  /* complete the first case that can be completed right away, if any */
+  for ( i = 0; i < n; i++ ) {
+    ret = luaproc_select_try( L, &sel->cases[i] );
+    if ( ret > 0 ) {
+      luaproc_select_unlock( sel );
+      luaproc_select_free( sel, n );
+      return ret;
+    }
+  }
+
+  /* otherwise wait, unless not allowed to or unable to */
+  self = luaproc_getself( L );
+  if (( timeout == 0 ) || (( L != mainlp.lstate ) && (( self == NULL ) ||
+      ( L != self->lstate ) || ( sched_is_offload_thread( ))))) {
+    luaproc_select_unlock( sel );
+    luaproc_select_free( sel, n );
+    lua_pushnil( L );
+    if ( timeout == 0 ) {
+      lua_pushliteral( L, "no channel is ready" );
+    } else {
+      lua_pushliteral( L, "cannot wait on channels outside a lua process' "
+                          "main coroutine" );
+    }
+    return 2;
+  }
+
+  /* register the cases on their channels; they are dropped from there once
+     the select is completed, as they are found */
+  sel->lp = ( L == mainlp.lstate ) ? &mainlp : self;
+  sel->refs = n + 1;
+  for ( i = 0; i < n; i++ ) {
+    luaproc_select_register( &sel->cases[i] );
+  }
+  sel->lp->status = LUAPROC_STATUS_BLOCKED_SELECT;
+  sel->lp->sel = sel;
+
+  if ( L != mainlp.lstate ) {
+    if ( timeout > 0 ) {
+      /* the scheduler arms the timer when it queues the selector */
+      self->timer.expires = sched_time() + (unsigned long)timeout;
+      self->timed = TRUE;
+    }
+    /* yield. channels will be unlocked by the scheduler */
+    return lua_yield( L, lua_gettop( L ));
+  }
+
+  /* the main lua state keeps its own reference to the select, to time it
+     out */
+  sel->refs++;
+  if ( timeout > 0 ) {
+    luaproc_deadline( &until, timeout );
+  }
+  /* start the wait before unlocking the channels, so the wakeup cannot be
+     missed */
+  sched_main_block();
+  luaproc_queue_selector( &mainlp );
+  while ( !sched_main_wait(( timeout < 0 ) ? NULL : &until )) {
+    /* timed out, unless an operation claimed the select meanwhile (and is
+       about to wake the main lua state up) */
+    if ( select_claim( sel )) {
+      timedout = TRUE;
+      break;
+    }
+    timeout = -1;
+  }
+  select_unref( sel );
+
+  if ( timedout ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "timed out waiting for channels" );
+    return 2;
+  }
+
+  return mainlp.args;
+}
+
+/* create a new (broadcast) channel named after the string at stack position
+   1 and push a handle to it */
+static int luaproc_new_channel( lua_State *L, int capacity, int broadcast ) {
+
+  const char *chname = luaL_checkstring( L, 1 );
+  size_t len = strlen( chname );
+  unsigned int hash = channel_hash( chname, len );
+  chanshard *sh = channel_shard( hash );
+  channel *chan;
+
+  /* get exclusive access to the channel's shard */
+  pthread_mutex_lock( &sh->mutex );
+
+  if ( channel_unlocked_get( sh, chname, len, hash ) != NULL ) {
+    pthread_mutex_unlock( &sh->mutex );
+    /* return an error to lua */
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' already exists", chname );
+    return 2;
+  }
+  chan = channel_create( chname, len, hash, capacity );
+  if ( chan != NULL ) {
+    chan->broadcast = broadcast;
+  }
+  if (( chan != NULL ) && ( !channel_insert( sh, chan ))) {
+    channel_unref( chan );
+    chan = NULL;
+  }
+  if ( chan != NULL ) {
+    channel_ref( chan );  /* for the returned handle */
+  }
+
+  /* release exclusive access to the channel's shard */
+  pthread_mutex_unlock( &sh->mutex );
+
+  if ( chan == NULL ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough memory" );
+    return 2;
+  }
+  luaproc_pushhandle( L, chan );
+
+  return 1;
+}
+
+/* create a new channel */
+static int luaproc_create_channel( lua_State *L ) {
+
+  lua_Integer capacity = luaL_optinteger( L, 2, 0 );
+
+  luaL_argcheck( L, ( capacity >= 0 ) && ( capacity <= INT_MAX ), 2,
+                 "capacity must not be negative" );
+
+  return luaproc_new_channel( L, (int)capacity, FALSE );
+}
+
+/* create a new broadcast channel */
+static int luaproc_create_broadcast( lua_State *L ) {
+  return luaproc_new_channel( L, 0, TRUE );
+}
+
+/* subscribe to a broadcast channel, with a buffer of a given capacity */
+static int luaproc_subscribe( lua_State *L ) {
+
+  static const char *const policies[] = { "block", "dropoldest", NULL };
+  lua_Integer capacity = luaL_checkinteger( L, 2 );
+  int dropoldest = luaL_checkoption( L, 3, "block", policies );
+  channel *chan, *sub, **subs;
+  const char *chname;
+  int max;
+
+  luaL_argcheck( L, ( capacity > 0 ) && ( capacity <= INT_MAX ), 2,
+                 "capacity must be positive" );
+
+  chan = luaproc_checkchannel( L, 1, &chname );
+  if ( chan == NULL ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' does not exist", chname );
+    return 2;
+  }
+  if ( !chan->broadcast ) {
+    luaproc_unlock_channel( chan );
+    lua_pushnil( L );
+    lua_pushfstring( L, "channel '%s' is not a broadcast channel", chname );
+    return 2;
+  }
 
-  /* check if a lua process can be recycled */
-  if ( recyclemax > 0 ) {
-    lp = list_remove( &recycle_list );
-    /* otherwise create a new lua process */
-    if ( lp == NULL ) {
-      lp = luaproc_new( L );
+  /* a subscription is an unnamed buffered channel, in the broadcast
+     channel's list */
+  if ( chan->nsubs == chan->maxsubs ) {
+    max = ( chan->maxsubs == 0 ) ? 4 : chan->maxsubs * 2;
+    subs = (channel **)realloc( chan->subs, max * sizeof( channel * ));
+    if ( subs != NULL ) {
+      chan->subs = subs;
+      chan->maxsubs = max;
     }
-  } else {
-    lp = luaproc_new( L );
   }
+  sub = NULL;
+  if ( chan->nsubs < chan->maxsubs ) {
+    sub = channel_create( chan->name, chan->namelen, chan->hash,
+                          (int)capacity );
+  }
+  if ( sub == NULL ) {
+    luaproc_unlock_channel( chan );
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough memory" );
+    return 2;
+  }
+  sub->subscription = TRUE;
+  sub->owner = chan;
+  channel_ref( chan );
+  sub->dropoldest = dropoldest;
+  chan->subs[chan->nsubs++] = sub;  /* takes the subscription's reference */
+  channel_ref( sub );  /* for the returned handle */
+  luaproc_unlock_channel( chan );
+  luaproc_pushhandle( L, sub );
 
-  /* release exclusive access to recycled lua processes list */
-  pthread_mutex_unlock( &mutex_recycle_list );
+  return 1;
+}
 
-  /* init lua process */
-  lp->status = LUAPROC_STATUS_IDLE;
-  lp->args   = 0;
-  lp->chan   = NULL;
+/* cancel a subscription to a broadcast channel */
+static int luaproc_unsubscribe( lua_State *L ) {
 
-  /* load code in lua process */
-  luaproc_loadbuffer( L, lp, code, len );
+  channel **handle = luaproc_tohandle( L, 1 );
 
-  /* if lua process is being created from a function, copy its upvalues and
-     remove dumped binary string from stack */
-  if ( lt == LUA_TFUNCTION ) {
-    if ( luaproc_copyupvalues( L, lp->lstate, 2 ) == FALSE ) {
-      luaproc_recycle_insert( lp ); 
-      return 2;
-    }
-    lua_pop( L, 1 );
+  luaL_argcheck( L, ( handle != NULL ) && ( *handle != NULL ), 1,
+                 "subscription expected" );
+  if (( !(*handle)->subscription ) || ( !channel_unsubscribe( L, *handle ))) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "not subscribed" );
+    return 2;
   }
-
-  sched_inc_lpcount();   /* increase active lua process count */
-  sched_queue_proc( lp );  /* schedule lua process for execution */
   lua_pushboolean( L, TRUE );
 
   return 1;
 }
 
-/* send a message to a lua process */
-static int luaproc_send( lua_State *L ) {
+/* return a handle to an existing channel */
+static int luaproc_get_channel_handle( lua_State *L ) {
 
-  int ret;
-  channel *chan;
-  luaproc *dstlp, *self;
   const char *chname = luaL_checkstring( L, 1 );
+  channel *chan = channel_get( chname );  /* referenced for the handle */
 
-  chan = channel_locked_get( chname );
-  /* if channel is not found, return an error to lua */
   if ( chan == NULL ) {
     lua_pushnil( L );
     lua_pushfstring( L, "channel '%s' does not exist", chname );
     return 2;
   }
+  luaproc_pushhandle( L, chan );
 
-  /* remove first lua process, if any, from channel's receive list */
-  dstlp = list_remove( &chan->recv );
-  
-  if ( dstlp != NULL ) { /* found a receiver? */
-    /* try to move values between lua states' stacks */
-    ret = luaproc_copyvalues( L, dstlp->lstate );
-    /* -1 because channel name is on the stack */
-    dstlp->args = lua_gettop( dstlp->lstate ) - 1; 
-    if ( dstlp->lstate == mainlp.lstate ) {
-      /* if sending process is the parent (main) Lua state, unblock it */
-      pthread_mutex_lock( &mutex_mainls );
-      pthread_cond_signal( &cond_mainls_sendrecv );
-      pthread_mutex_unlock( &mutex_mainls );
-    } else {
-      /* schedule receiving lua process for execution */
-      sched_queue_proc( dstlp );
-    }
-    /* unlock channel access */
-    luaproc_unlock_channel( chan );
-    if ( ret == TRUE ) { /* was send successful? */
-      lua_pushboolean( L, TRUE );
-      return 1;
-    } else { /* nil and error msg already in stack */
-      return 2;
-    }
-
-  } else { 
-    if ( L == mainlp.lstate ) {
-      /* sending process is the parent (main) Lua state - block it */
-      mainlp.chan = chan;
-      luaproc_queue_sender( &mainlp );
-      luaproc_unlock_channel( chan );
-      pthread_mutex_lock( &mutex_mainls );
-      pthread_cond_wait( &cond_mainls_sendrecv, &mutex_mainls );
-      pthread_mutex_unlock( &mutex_mainls );
-      return mainlp.args;
-    } else {
-      /* sending process is a standard luaproc - set status, block and yield */
-      self = luaproc_getself( L );
-      if ( self != NULL ) {
-        self->status = LUAPROC_STATUS_BLOCKED_SEND;
-        self->chan   = chan;
-      }
-      /* yield. channel will be unlocked by the scheduler */
-      return lua_yield( L, lua_gettop( L ));
-    }
-  }
+  return 1;
 }
 
-/* receive a message from a lua process */
-static int luaproc_receive( lua_State *L ) {
-
-  int ret, nargs;
-  channel *chan;
-  luaproc *srclp, *self;
-  const char *chname = luaL_checkstring( L, 1 );
-
-  /* get number of arguments passed to function */
-  nargs = lua_gettop( L );
+/* destroy a channel */
+static int luaproc_destroy_channel( lua_State *L ) {
 
-  chan = channel_locked_get( chname );
-  /* if channel is not found, return an error to Lua */
-  if ( chan == NULL ) {
+  channel *chan, **handle;
+  const char *chname;
+  size_t len;
+  unsigned int hash;
+  chanshard *sh;
+
+  handle = luaproc_tohandle( L, 1 );
+  chname = ( handle != NULL ) ? (*handle)->name : luaL_checkstring( L, 1 );
+  len = strlen( chname );
+  hash = channel_hash( chname, len );
+  sh = channel_shard( hash );
+
+  /* get exclusive access to the channel's shard */
+  pthread_mutex_lock( &sh->mutex );
+
+  chan = channel_unlocked_get( sh, chname, len, hash );
+  if (( chan == NULL ) || (( handle != NULL ) && ( chan != *handle ))) {
+    /* release exclusive access to the channel's shard */
+    pthread_mutex_unlock( &sh->mutex );
+    /* return an error to lua */
     lua_pushnil( L );
     lua_pushfstring( L, "channel '%s' does not exist", chname );
     return 2;
   }
 
-  /* remove first lua process, if any, from channels' send list */
-  srclp = list_remove( &chan->send );
+  /* remove channel from table (its reference is dropped when the channel is
+     unlocked below) */
+  channel_remove( sh, chan );
 
-  if ( srclp != NULL ) {  /* found a sender? */
-    /* try to move values between lua states' stacks */
-    ret = luaproc_copyvalues( srclp->lstate, L );
-    if ( ret == TRUE ) { /* was receive successful? */
-      lua_pushboolean( srclp->lstate, TRUE );
-      srclp->args = 1;
-    } else {  /* nil and error_msg already in stack */
-      srclp->args = 2;
-    }
-    if ( srclp->lstate == mainlp.lstate ) {
-      /* if sending process is the parent (main) Lua state, unblock it */
-      pthread_mutex_lock( &mutex_mainls );
-      pthread_cond_signal( &cond_mainls_sendrecv );
-      pthread_mutex_unlock( &mutex_mainls );
+  pthread_mutex_unlock( &sh->mutex );
+
+  pthread_mutex_lock( &chan->mutex );
+  channel_destroy( L, chan );
+
+  /* unlock channel; it is released when no handle references it anymore */
+  luaproc_unlock_channel( chan );
+
+  lua_pushboolean( L, TRUE );
+  return 1;
+}
+
+/* set (or, if msg is NULL, remove) the value of a shared store entry found in
+   a shard (e is NULL if the key is not there), inserting the spare entry for
+   the key otherwise. what is left to release is returned in *spare and *old
+   (return FALSE if out of memory). caller MUST lock the shard */
+static int store_unlocked_put( kvshard *sh, kventry *e, kventry **spare,
+                               message *msg, message **old ) {
+
+  *old = NULL;
+  if ( e != NULL ) {
+    *old = e->value;
+    if ( msg != NULL ) {
+      e->value = msg;
     } else {
-      /* otherwise, schedule process for execution */
-      sched_queue_proc( srclp );
+      store_remove( sh, e );
+      *spare = e;
     }
-    /* unlock channel access */
-    luaproc_unlock_channel( chan );
-    /* disconsider channel name, async flag and any other args passed 
-       to the receive function when returning its results */
-    return lua_gettop( L ) - nargs; 
+  } else if ( msg != NULL ) {
+    if ( !store_insert( sh, *spare )) {
+      return FALSE;
+    }
+    *spare = NULL;
+  }
 
-  } else {  /* otherwise test if receive was synchronous or asynchronous */
-    if ( lua_toboolean( L, 2 )) { /* asynchronous receive */
-      /* unlock channel access */
-      luaproc_unlock_channel( chan );
-      /* return an error */
-      lua_pushnil( L );
-      lua_pushfstring( L, "no senders waiting on channel '%s'", chname );
-      return 2;
-    } else { /* synchronous receive */
-      if ( L == mainlp.lstate ) {
-        /*  receiving process is the parent (main) Lua state - block it */
-        mainlp.chan = chan;
-        luaproc_queue_receiver( &mainlp );
-        luaproc_unlock_channel( chan );
-        pthread_mutex_lock( &mutex_mainls );
-        pthread_cond_wait( &cond_mainls_sendrecv, &mutex_mainls );
-        pthread_mutex_unlock( &mutex_mainls );
-        return mainlp.args;
-      } else {
-        /* receiving process is a standard luaproc - set status, block and 
-           yield */
-        self = luaproc_getself( L );
-        if ( self != NULL ) {
-          self->status = LUAPROC_STATUS_BLOCKED_RECV;
-          self->chan   = chan;
+  return TRUE;
+}
+
+/* serialize the value at stack position idx for the shared store, along with
+   a spare entry for its key (the value is NULL if nil). on failure, push nil
+   and an error message and return FALSE */
+static int store_prepare( lua_State *L, int idx, const char *key, size_t len,
+                          unsigned int hash, message **msg,
+                          kventry **spare ) {
+
+  *msg = NULL;
+  *spare = NULL;
+  if ( lua_isnil( L, idx )) {
+    return TRUE;
+  }
+  if (( *msg = luaproc_encode( L, idx, FALSE )) == NULL ) {
+    return FALSE;
+  }
+  /* the entry is allocated beforehand, in case the key is new */
+  *spare = (kventry *)malloc( sizeof( kventry ) + len );
+  if ( *spare == NULL ) {
+    message_unref( *msg );
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough memory" );
+    return FALSE;
+  }
+  (*spare)->value = *msg;
+  (*spare)->keylen = len;
+  (*spare)->hash = hash;
+  memcpy( *spare + 1, key, len );
+
+  return TRUE;
+}
+
+/* is the (atomic) value at stack position idx equal to a shared store value
+   (NULL if none)? */
+static int store_equal( lua_State *L, int idx, message *value ) {
+
+  char *data;
+  const char *str;
+  size_t len, vlen;
+  lua_Integer i;
+  lua_Number n;
+
+  if ( value == NULL ) {
+    return lua_isnil( L, idx );
+  }
+  data = (char *)( value + 1 );
+  switch ( lua_type( L, idx )) {
+    case LUA_TBOOLEAN:
+      return (( *data == LUAPROC_MSG_BOOLEAN ) &&
+              ( !data[1] == !lua_toboolean( L, idx )));
+    case LUA_TNUMBER:
+      if ( *data == LUAPROC_MSG_INTEGER ) {
+        memcpy( &i, data + 1, sizeof( lua_Integer ));
+        if ( isinteger( L, idx )) {
+          return ( i == lua_tointeger( L, idx ));
         }
-        /* yield. channel will be unlocked by the scheduler */
-        return lua_yield( L, lua_gettop( L ));
+        return ( (lua_Number)i == lua_tonumber( L, idx ));
       }
-    }
+      if ( *data == LUAPROC_MSG_NUMBER ) {
+        memcpy( &n, data + 1, sizeof( lua_Number ));
+        return ( n == lua_tonumber( L, idx ));
+      }
+      return FALSE;
+    case LUA_TSTRING:
+      if ( *data != LUAPROC_MSG_STRING ) {
+        return FALSE;
+      }
+      str = lua_tolstring( L, idx, &len );
+      memcpy( &vlen, data + 1, sizeof( size_t ));
+      return (( vlen == len ) &&
+              ( memcmp( data + 1 + sizeof( size_t ), str, len ) == 0 ));
+    default:
+      return FALSE;
   }
 }
 
-/* create a new channel */
-static int luaproc_create_channel( lua_State *L ) {
+/* return the value of a shared store key (nil if none) */
+static int luaproc_store_get( lua_State *L ) {
 
-  const char *chname = luaL_checkstring( L, 1 );
+  size_t len;
+  const char *key = luaL_checklstring( L, 1, &len );
+  unsigned int hash = channel_hash( key, len );
+  kvshard *sh = store_shard( hash );
+  kventry *e;
+  message *msg = NULL;
+
+  pthread_mutex_lock( &sh->mutex );
+  if (( e = store_unlocked_get( sh, key, len, hash )) != NULL ) {
+    msg = e->value;
+    __atomic_add_fetch( &msg->refs, 1, __ATOMIC_RELAXED );
+  }
+  pthread_mutex_unlock( &sh->mutex );
 
-  channel *chan = channel_locked_get( chname );
-  if (chan != NULL) {  /* does channel exist? */
-    /* unlock the channel mutex locked by channel_locked_get */
-    luaproc_unlock_channel( chan );
-    /* return an error to lua */
+  if ( msg == NULL ) {
     lua_pushnil( L );
-    lua_pushfstring( L, "channel '%s' already exists", chname );
-    return 2;
-  } else {  /* create channel */
-    channel_create( chname );
-    lua_pushboolean( L, TRUE );
     return 1;
   }
+  /* the value is deserialized outside the lock, from the reference taken */
+  if ( !luaproc_checkmessage( L, msg )) {
+    message_unref( msg );
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough space in the stack" );
+    return 2;
+  }
+  luaproc_decode( L, msg );
+
+  return 1;
 }
 
-/* destroy a channel */
-static int luaproc_destroy_channel( lua_State *L ) {
+/* set the value of a shared store key (nil removes it) */
+static int luaproc_store_set( lua_State *L ) {
 
-  channel *chan;
-  list *blockedlp;
-  luaproc *lp;
-  const char *chname = luaL_checkstring( L,  1 );
+  size_t len;
+  const char *key = luaL_checklstring( L, 1, &len );
+  unsigned int hash = channel_hash( key, len );
+  kvshard *sh = store_shard( hash );
+  kventry *spare;
+  message *msg, *old;
+  int ok;
+
+  luaL_checkany( L, 2 );
+  lua_settop( L, 2 );
+  if ( !store_prepare( L, 2, key, len, hash, &msg, &spare )) {
+    return 2;
+  }
 
-  /* get exclusive access to channels list */
-  pthread_mutex_lock( &mutex_channel_list );
+  pthread_mutex_lock( &sh->mutex );
+  ok = store_unlocked_put( sh, store_unlocked_get( sh, key, len, hash ),
+                           &spare, msg, &old );
+  pthread_mutex_unlock( &sh->mutex );
 
-  /*
-     try to get channel and lock it; if lock fails, release external
-     lock ('mutex_channel_list') to try again when signaled -- this avoids
-     keeping the external lock busy for too long. during this release,
-     the channel may have been destroyed, so it must try to get it again.
-  */
-  while ((( chan = channel_unlocked_get( chname )) != NULL ) &&
-          ( pthread_mutex_trylock( &chan->mutex ) != 0 )) {
-    pthread_cond_wait( &chan->can_be_used, &mutex_channel_list );
-  }
-
-  if ( chan == NULL ) {  /* found channel? */
-    /* release exclusive access to channels list */
-    pthread_mutex_unlock( &mutex_channel_list );
-    /* return an error to lua */
+  if ( old != NULL ) {
+    message_unref( old );
+  }
+  free( spare );
+  if ( !ok ) {
+    message_unref( msg );
     lua_pushnil( L );
-    lua_pushfstring( L, "channel '%s' does not exist", chname );
+    lua_pushliteral( L, "not enough memory" );
     return 2;
   }
 
-  /* remove channel from table */
-  lua_getglobal( chanls, LUAPROC_CHANNELS_TABLE );
-  lua_pushnil( chanls );
-  lua_setfield( chanls, -2, chname );
-  lua_pop( chanls, 1 );
+  lua_pushboolean( L, TRUE );
+  return 1;
+}
 
-  pthread_mutex_unlock( &mutex_channel_list );
+/* set the value of a shared store key (nil removes it) only if its current
+   value is the expected one (nil if none), and return whether it was */
+static int luaproc_store_cas( lua_State *L ) {
 
-  /*
-     wake up workers there are waiting to use the channel.
-     they will not find the channel, since it was removed,
-     and will not get this condition anymore.
-   */
-  pthread_cond_broadcast( &chan->can_be_used );
+  size_t len;
+  const char *key = luaL_checklstring( L, 1, &len );
+  unsigned int hash = channel_hash( key, len );
+  kvshard *sh = store_shard( hash );
+  kventry *e, *spare;
+  message *msg, *old = NULL;
+  int type = lua_type( L, 2 );
+  int equal, ok = TRUE;
+
+  luaL_argcheck( L, ( type == LUA_TNIL ) || ( type == LUA_TBOOLEAN ) ||
+                    ( type == LUA_TNUMBER ) || ( type == LUA_TSTRING ), 2,
+                 "nil, boolean, number or string expected" );
+  luaL_checkany( L, 3 );
+  lua_settop( L, 3 );
+  if ( !store_prepare( L, 3, key, len, hash, &msg, &spare )) {
+    return 2;
+  }
 
-  /*
-     dequeue lua processes waiting on the channel, return an error message
-     to each of them indicating channel was destroyed and schedule them
-     for execution (unblock them).
-   */
-  if ( chan->send.head != NULL ) {
-    lua_pushfstring( L, "channel '%s' destroyed while waiting for receiver", 
-                     chname );
-    blockedlp = &chan->send;
+  pthread_mutex_lock( &sh->mutex );
+  e = store_unlocked_get( sh, key, len, hash );
+  equal = store_equal( L, 2, ( e != NULL ) ? e->value : NULL );
+  if ( equal ) {
+    ok = store_unlocked_put( sh, e, &spare, msg, &old );
+  }
+  pthread_mutex_unlock( &sh->mutex );
+
+  if ( old != NULL ) {
+    message_unref( old );
+  }
+  free( spare );
+  if (( !equal || !ok ) && ( msg != NULL )) {
+    message_unref( msg );
+  }
+  if ( !ok ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough memory" );
+    return 2;
+  }
+
+  lua_pushboolean( L, equal );
+  return 1;
+}
+
+/* add a number (1 by default) to the numeric value of a shared store key (0
+   if none) and return the result */
+static int luaproc_store_incr( lua_State *L ) {
+
+  size_t len;
+  const char *key = luaL_checklstring( L, 1, &len );
+  unsigned int hash = channel_hash( key, len );
+  kvshard *sh = store_shard( hash );
+  kventry *e;
+  message *msg = NULL, *old = NULL;
+  lua_Number dn = luaL_optnumber( L, 2, 1 );
+  lua_Integer di = 1, i = 0;
+  lua_Number n = 0;
+  int isint = lua_isnoneornil( L, 2 ) || isinteger( L, 2 );
+  char *data = NULL;
+
+  if ( !lua_isnoneornil( L, 2 ) && isint ) {
+    di = lua_tointeger( L, 2 );
+  }
+
+  pthread_mutex_lock( &sh->mutex );
+  e = store_unlocked_get( sh, key, len, hash );
+  if ( e != NULL ) {
+    msg = e->value;
+    data = (char *)( msg + 1 );
+    if ( *data == LUAPROC_MSG_INTEGER ) {
+      memcpy( &i, data + 1, sizeof( lua_Integer ));
+      n = (lua_Number)i;
+    } else if ( *data == LUAPROC_MSG_NUMBER ) {
+      memcpy( &n, data + 1, sizeof( lua_Number ));
+      isint = FALSE;
+    } else {
+      pthread_mutex_unlock( &sh->mutex );
+      lua_pushnil( L );
+      lua_pushfstring( L, "value of key '%s' is not a number", key );
+      return 2;
+    }
+  }
+  /* integers wrap around rather than overflow */
+  i = (lua_Integer)( (unsigned long long)i + (unsigned long long)di );
+  n = n + dn;
+
+  if (( e != NULL ) && ( *data == ( isint ? LUAPROC_MSG_INTEGER :
+                                            LUAPROC_MSG_NUMBER )) &&
+      ( __atomic_load_n( &msg->refs, __ATOMIC_ACQUIRE ) == 1 )) {
+    /* nobody else is reading the value (references are only taken with the
+       shard locked), so it is updated in place */
+    message_setnumber( msg, isint, i, n );
+  } else if (( msg = message_number( isint, i, n )) == NULL ) {
+    pthread_mutex_unlock( &sh->mutex );
+    lua_pushnil( L );
+    lua_pushliteral( L, "not enough memory" );
+    return 2;
+  } else if ( e != NULL ) {
+    old = e->value;
+    e->value = msg;
   } else {
-    lua_pushfstring( L, "channel '%s' destroyed while waiting for sender", 
-                     chname );
-    blockedlp = &chan->recv;
+    /* the key is new */
+    e = (kventry *)malloc( sizeof( kventry ) + len );
+    if ( e != NULL ) {
+      e->value = msg;
+      e->keylen = len;
+      e->hash = hash;
+      memcpy( e + 1, key, len );
+      if ( !store_insert( sh, e )) {
+        free( e );
+        e = NULL;
+      }
+    }
+    if ( e == NULL ) {
+      pthread_mutex_unlock( &sh->mutex );
+      message_unref( msg );
+      lua_pushnil( L );
+      lua_pushliteral( L, "not enough memory" );
+      return 2;
+    }
   }
-  while (( lp = list_remove( blockedlp )) != NULL ) {
-    /* return an error to each process */
-    lua_pushnil( lp->lstate );
-    lua_pushstring( lp->lstate, lua_tostring( L, -1 ));
-    lp->args = 2;
-    sched_queue_proc( lp ); /* schedule process for execution */
+  pthread_mutex_unlock( &sh->mutex );
+
+  if ( old != NULL ) {
+    message_unref( old );
+  }
+  if ( isint ) {
+    lua_pushinteger( L, i );
+  } else {
+    lua_pushnumber( L, n );
   }
 
-  /* unlock channel mutex and destroy both mutex and condition */
-  pthread_mutex_unlock( &chan->mutex );
-  pthread_mutex_destroy( &chan->mutex );
-  pthread_cond_destroy( &chan->can_be_used );
+  return 1;
+}
+
+/* return an array of the keys in the shared store (at some point in time for
+   each shard) */
+static int luaproc_store_keys( lua_State *L ) {
+
+  kventry *e;
+  int i, b, n = 0;
+
+  lua_newtable( L );
+  for ( i = 0; i < LUAPROC_STORE_SHARDS; i++ ) {
+    pthread_mutex_lock( &store[i].mutex );
+    for ( b = 0; b < store[i].size; b++ ) {
+      for ( e = store[i].buckets[b]; e != NULL; e = e->next ) {
+        lua_pushlstring( L, (char *)( e + 1 ), e->keylen );
+        lua_rawseti( L, -2, ++n );
+      }
+    }
+    pthread_mutex_unlock( &store[i].mutex );
+  }
 
-  lua_pushboolean( L, TRUE );
   return 1;
 }
 
@@ -887,6 +5820,41 @@ void luaproc_set_numargs( luaproc *lp, int n ) {
   lp->args = n;
 }
 
+/* return a lua process' quantum (in instructions) */
+int luaproc_get_quantum( luaproc *lp ) {
+  return lp->quantum;
+}
+
+/* return a lua process' time slice (in milliseconds) */
+int luaproc_get_timeslice( luaproc *lp ) {
+  return lp->timeslice;
+}
+
+/* return a lua process' priority */
+int luaproc_get_priority( luaproc *lp ) {
+  return lp->priority;
+}
+
+/* return the worker that last ran a lua process (NULL if none) */
+void *luaproc_get_worker( luaproc *lp ) {
+  return lp->worker;
+}
+
+/* set the worker that last ran a lua process */
+void luaproc_set_worker( luaproc *lp, void *worker ) {
+  lp->worker = worker;
+}
+
+/* return a lua process' timer wheel entry */
+timer *luaproc_get_timer( luaproc *lp ) {
+  return &lp->timer;
+}
+
+/* return a lua process' file descriptor wait */
+fdwait *luaproc_get_fdwait( luaproc *lp ) {
+  return &lp->fdwait;
+}
+
 /**********************************
  * register structs and functions *
  **********************************/
@@ -923,21 +5891,46 @@ static void luaproc_openlualibs( lua_State *L ) {
 
 LUALIB_API int luaopen_luaproc( lua_State *L ) {
 
+  int i;
+
   /* register luaproc functions */
   luaL_newlib( L, luaproc_funcs );
+  luaproc_setblocking( L );
+  luaproc_sethandles( L );
+  luaproc_setprocesshandles( L );
+  luaproc_setbuffers( L );
+  luaproc_setarrays( L );
+  luaproc_setstore( L );
+  luaproc_setfrozen( L );
 
   /* wrap main state inside a lua process */
   mainlp.lstate = L;
   mainlp.status = LUAPROC_STATUS_IDLE;
   mainlp.args   = 0;
   mainlp.chan   = NULL;
+  mainlp.sel    = NULL;
+  mainlp.pub    = NULL;
+  mainlp.priority = LUAPROC_SCHED_PRIORITY_NORMAL;
+  mainlp.timer.level = -1;
+  mainlp.timed  = FALSE;
+  mainlp.fdwait.slot = -1;
   mainlp.next   = NULL;
   /* initialize recycle list */
   list_init( &recycle_list );
-  /* initialize channels table and lua_State used to store it */
-  chanls = luaL_newstate();
-  lua_newtable( chanls );
-  lua_setglobal( chanls, LUAPROC_CHANNELS_TABLE );
+  /* initialize channel table shards */
+  for ( i = 0; i < LUAPROC_CHANNEL_SHARDS; i++ ) {
+    pthread_mutex_init( &channels[i].mutex, NULL );
+    channels[i].buckets = NULL;
+    channels[i].size = 0;
+    channels[i].count = 0;
+  }
+  /* initialize shared store shards */
+  for ( i = 0; i < LUAPROC_STORE_SHARDS; i++ ) {
+    pthread_mutex_init( &store[i].mutex, NULL );
+    store[i].buckets = NULL;
+    store[i].size = 0;
+    store[i].count = 0;
+  }
   /* create finalizer to join workers when Lua exits */
   lua_newuserdata( L, 0 );
   lua_setfield( L, LUA_REGISTRYINDEX, "LUAPROC_FINALIZER_UDATA" );
@@ -962,6 +5955,13 @@ static int luaproc_loadlib( lua_State *L ) {
 
   /* register luaproc functions */
   luaL_newlib( L, luaproc_funcs );
+  luaproc_setblocking( L );
+  luaproc_sethandles( L );
+  luaproc_setprocesshandles( L );
+  luaproc_setbuffers( L );
+  luaproc_setarrays( L );
+  luaproc_setstore( L );
+  luaproc_setfrozen( L );
 
   return 1;
 }
@@ -15,6 +15,12 @@
 #define LUAPROC_STATUS_BLOCKED_SEND   2
 #define LUAPROC_STATUS_BLOCKED_RECV   3
 #define LUAPROC_STATUS_FINISHED       4
+#define LUAPROC_STATUS_OFFLOAD        5
+#define LUAPROC_STATUS_SLEEPING       6
+#define LUAPROC_STATUS_WAITFD         7
+#define LUAPROC_STATUS_BLOCKED_SELECT 8
+#define LUAPROC_STATUS_BLOCKED_PUBLISH 9
+#define LUAPROC_STATUS_BLOCKED_JOIN   10
 
 /*******************
  * structure types *
@@ -31,6 +37,57 @@ typedef struct stlist {
   int nodes;
 } list;
 
+/* lock-free intrusive (fifo) queue; any thread may insert, but removals must
+   hold the queue's consumer lock */
+typedef struct stqueue {
+  luaproc *head;
+  luaproc *tail;
+  luaproc *stub;
+  int nodes;
+  int consumer;
+} queue;
+
+/* timer wheel entry (each lua process has one) */
+typedef struct sttimer {
+  struct sttimer *prev;
+  struct sttimer *next;
+  luaproc *lp;
+  unsigned long expires;  /* deadline, in scheduler time (milliseconds) */
+  int level;              /* wheel level the entry is in (-1 if none) */
+} timer;
+
+/* file descriptor wait (each lua process has one) */
+typedef struct stfdwait {
+  int fd;
+  int write;  /* wait for the fd to be writable (rather than readable)? */
+  int timed;  /* is the lua process' timer armed for this wait? */
+  int slot;   /* scheduler's poller registration (-1 if none) */
+} fdwait;
+
+/**************************************************
+ * userdata of C libraries that moves in messages *
+ *************************************************/
+
+/* metatable field of a userdata that can move between lua states in
+   messages: a light userdata pointing to its luaproc_transfer */
+#define LUAPROC_TRANSFER_FIELD "__luaproc_transfer"
+
+/* how a userdata moves: ownership of its native object passes from the
+   sender's userdata to a new userdata in the receiver's lua state, without
+   copying the object. the struct MUST outlive every lua state that uses it
+   (it is usually static) */
+typedef struct stluaproc_transfer {
+  /* take the object out of a userdata (its block, as returned by
+     lua_touserdata), which must no longer free it, and return it */
+  void *( *detach )( void *udata );
+  /* push a new userdata, along with its metatable, that owns an object
+     (the stack has room for two values) */
+  void ( *attach )( lua_State *L, void *object );
+  /* free an object that no lua state owns, because its message was never
+     received */
+  void ( *release )( void *object );
+} luaproc_transfer;
+
 /***********************
  * function prototypes *
  **********************/
@@ -47,6 +104,30 @@ void luaproc_queue_sender( luaproc *lp );
 /* queue a lua process that tried to receive a message */
 void luaproc_queue_receiver( luaproc *lp );
 
+/* let a lua process that blocked on a select wait on its channels */
+void luaproc_queue_selector( luaproc *lp );
+
+/* let a lua process that blocked on a publish wait for room in
+   subscriptions */
+void luaproc_queue_publisher( luaproc *lp );
+
+/* let a lua process that blocked joining another one wait for it to finish */
+void luaproc_queue_joiner( luaproc *lp );
+
+/* keep the results of a finished (or, if not ok, failed) lua process for
+   those joining it */
+void luaproc_finish( luaproc *lp, int ok );
+
+/* handle an expired lua process timer (returns FALSE to be retried later) */
+int luaproc_timeout( luaproc *lp );
+
+/* push the result of a file descriptor wait (error is NULL if ready) */
+void luaproc_set_fdresult( luaproc *lp, const char *error );
+
+/* set a lua process that has not run yet up, on the worker about to run it
+   (returns a lua error status, with the error message pushed, on failure) */
+int luaproc_start( luaproc *lp );
+
 /* add a lua process to the recycle list */
 void luaproc_recycle_insert( luaproc *lp );
 
@@ -65,6 +146,27 @@ int luaproc_get_numargs( luaproc *lp );
 /* set the number of arguments expected by a lua process */
 void luaproc_set_numargs( luaproc *lp, int n );
 
+/* return a lua process' quantum (in instructions) */
+int luaproc_get_quantum( luaproc *lp );
+
+/* return a lua process' time slice (in milliseconds) */
+int luaproc_get_timeslice( luaproc *lp );
+
+/* return a lua process' priority */
+int luaproc_get_priority( luaproc *lp );
+
+/* return the worker that last ran a lua process (NULL if none) */
+void *luaproc_get_worker( luaproc *lp );
+
+/* set the worker that last ran a lua process */
+void luaproc_set_worker( luaproc *lp, void *worker );
+
+/* return a lua process' timer wheel entry */
+timer *luaproc_get_timer( luaproc *lp );
+
+/* return a lua process' file descriptor wait */
+fdwait *luaproc_get_fdwait( luaproc *lp );
+
 /* initialize an empty list */
 void list_init( list *l );
 
@@ -77,6 +179,33 @@ luaproc* list_remove( list *l );
 /* return a list's node count */
 int list_count( list *l );
 
+/* remove a given lua process from a list (returns FALSE if not found) */
+int list_unlink( list *l, luaproc *lp );
+
+/* initialize an empty queue (returns FALSE if out of memory) */
+int queue_init( queue *q );
+
+/* release resources used by an empty queue */
+void queue_destroy( queue *q );
+
+/* insert a lua process in a queue (lock-free) */
+void queue_insert( queue *q, luaproc *lp );
+
+/* remove and return the first lua process in a queue */
+luaproc *queue_remove( queue *q );
+
+/* try to acquire a queue's consumer lock (returns FALSE if busy) */
+int queue_trylock( queue *q );
+
+/* acquire a queue's consumer lock */
+void queue_lock( queue *q );
+
+/* release a queue's consumer lock */
+void queue_unlock( queue *q );
+
+/* return a queue's (approximate) node count */
+int queue_count( queue *q );
+
 /* }====================================================================== */
 
 
@@ -0,0 +1,36 @@
+-- load luaproc
+luaproc = require "luaproc"
+
+-- channel operations that would wait cannot suspend a lua process while
+-- luaproc.blocking runs it on an offload thread
+luaproc.newchannel( "x" )
+luaproc.newchannel( "result" )
+luaproc.newbroadcast( "news" )
+local news = luaproc.subscribe( "news", 1 )
+
+luaproc.newproc( function()
+  local luaproc = _G.luaproc
+  luaproc.send( "result", "send", luaproc.blocking( function()
+    return luaproc.send( "x", 42 )
+  end ))
+  luaproc.send( "result", "receive", luaproc.blocking( function()
+    return luaproc.receive( "x" )
+  end ))
+  -- the first message fills the subscription, the second one would wait
+  luaproc.send( "result", "publish", luaproc.blocking( function()
+    luaproc.send( "news", 1 )
+    return luaproc.send( "news", 2 )
+  end ))
+  -- the lua process keeps working once back on the workers
+  luaproc.send( "result", "done" )
+end )
+
+for _, op in ipairs({ "send", "receive", "publish" }) do
+  local name, ok, err = luaproc.receive( "result" )
+  print( name, ( name == op ) and ( ok == nil ) and err and "refused" or
+                 "NOT refused" )
+end
+print( luaproc.receive( "result" ))
+
+-- nothing was left waiting on the channel
+print( luaproc.receive( "x", true ))
@@ -0,0 +1,33 @@
+-- load luaproc
+luaproc = require "luaproc"
+
+-- a single worker, so a busy lua process holds it unless it is preempted
+luaproc.setnumworkers( 1 )
+luaproc.newchannel( "order", 2 )
+
+-- a busy lua process, created from a function or from a string of lua code
+local function busy()
+  local x = 0
+  for i = 1, 3e7 do
+    x = x + i
+  end
+  luaproc.send( "order", "busy" )
+end
+
+local code = [[
+  local x = 0
+  for i = 1, 3e7 do
+    x = x + i
+  end
+  luaproc.send( "order", "busy" )
+]]
+
+for _, proc in ipairs({ busy, code }) do
+  luaproc.newproc( proc, { quantum = 100000 } )
+  -- a lua process queued behind it runs first only if it is preempted
+  luaproc.newproc( [[ luaproc.send( "order", "quick" ) ]] )
+  local first = luaproc.receive( "order" )
+  luaproc.receive( "order" )
+  print( type( proc ), ( first == "quick" ) and "preempted" or
+                       "NOT preempted" )
+end
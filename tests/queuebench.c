@@ -0,0 +1,174 @@
+/*
+** ready queue microbenchmark: compares the lock-free intrusive queue used by
+** the scheduler with the mutex protected list it replaced
+** See Copyright Notice in luaproc.h
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+/* include the implementation to get access to the lua process struct */
+#include "../src/luaproc.c"
+
+/* total number of operations per run (split among threads) */
+#define BENCH_OPS      ( 1 << 20 )
+/* maximum number of threads */
+#define BENCH_THREADS  64
+
+/* benchmarked queue implementations */
+#define BENCH_LIST     0
+#define BENCH_QUEUE    1
+
+/* benchmark run parameters */
+typedef struct stbench {
+  int impl;
+  int nthreads;
+  luaproc *nodes;
+  list l;
+  pthread_mutex_t mutex;
+  queue q;
+  int producers;  /* producers still running (mpsc runs) */
+} bench;
+
+/* per thread arguments */
+typedef struct stbencharg {
+  bench *b;
+  int id;
+} bencharg;
+
+/* insert a node using the benchmarked implementation */
+static void bench_insert( bench *b, luaproc *lp ) {
+  if ( b->impl == BENCH_LIST ) {
+    pthread_mutex_lock( &b->mutex );
+    list_insert( &b->l, lp );
+    pthread_mutex_unlock( &b->mutex );
+  } else {
+    queue_insert( &b->q, lp );
+  }
+}
+
+/* remove a node using the benchmarked implementation */
+static luaproc *bench_remove( bench *b ) {
+  luaproc *lp;
+  if ( b->impl == BENCH_LIST ) {
+    pthread_mutex_lock( &b->mutex );
+    lp = list_remove( &b->l );
+    pthread_mutex_unlock( &b->mutex );
+  } else {
+    queue_lock( &b->q );
+    lp = queue_remove( &b->q );
+    queue_unlock( &b->q );
+  }
+  return lp;
+}
+
+/* many producers and many consumers: each thread inserts a node and then
+   removes one (not necessarily the same) */
+static void *bench_mpmc( void *args ) {
+  bencharg *a = (bencharg *)args;
+  bench *b = a->b;
+  int i, ops = BENCH_OPS / b->nthreads;
+  luaproc *lp = &b->nodes[a->id];
+  for ( i = 0; i < ops; i++ ) {
+    bench_insert( b, lp );
+    while (( lp = bench_remove( b )) == NULL ) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+/* many producers, one consumer (as in a worker's ready queue): producers
+   insert their share of nodes */
+static void *bench_producer( void *args ) {
+  bencharg *a = (bencharg *)args;
+  bench *b = a->b;
+  int i, ops = BENCH_OPS / b->nthreads;
+  luaproc *nodes = &b->nodes[a->id * ops];
+  for ( i = 0; i < ops; i++ ) {
+    bench_insert( b, &nodes[i] );
+  }
+  __atomic_sub_fetch( &b->producers, 1, __ATOMIC_SEQ_CST );
+  return NULL;
+}
+
+/* the single consumer removes nodes until producers are done and the queue
+   is empty */
+static void *bench_consumer( void *args ) {
+  bench *b = (bench *)args;
+  while (( bench_remove( b ) != NULL ) ||
+         ( __atomic_load_n( &b->producers, __ATOMIC_SEQ_CST ) > 0 ));
+  return NULL;
+}
+
+/* return the current time in seconds */
+static double bench_now( void ) {
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* run a benchmark and return its throughput (million operations/s) */
+static double bench_run( int impl, int nthreads, int mpsc ) {
+
+  bench b;
+  bencharg args[BENCH_THREADS];
+  pthread_t threads[BENCH_THREADS], consumer;
+  double start, elapsed;
+  int i;
+
+  memset( &b, 0, sizeof( bench ));
+  b.impl = impl;
+  b.nthreads = nthreads;
+  b.producers = nthreads;
+  b.nodes = (luaproc *)calloc( BENCH_OPS, sizeof( struct stluaproc ));
+  list_init( &b.l );
+  pthread_mutex_init( &b.mutex, NULL );
+  queue_init( &b.q );
+
+  start = bench_now();
+  if ( mpsc ) {
+    pthread_create( &consumer, NULL, bench_consumer, &b );
+  }
+  for ( i = 0; i < nthreads; i++ ) {
+    args[i].b = &b;
+    args[i].id = i;
+    pthread_create( &threads[i], NULL, mpsc ? bench_producer : bench_mpmc,
+                    &args[i] );
+  }
+  for ( i = 0; i < nthreads; i++ ) {
+    pthread_join( threads[i], NULL );
+  }
+  if ( mpsc ) {
+    pthread_join( consumer, NULL );
+  }
+  elapsed = bench_now() - start;
+
+  queue_destroy( &b.q );
+  pthread_mutex_destroy( &b.mutex );
+  free( b.nodes );
+
+  return ( BENCH_OPS / nthreads * nthreads ) / elapsed / 1e6;
+}
+
+int main( void ) {
+
+  int n, mpsc;
+  double l, q;
+
+  for ( mpsc = 1; mpsc >= 0; mpsc-- ) {
+    printf( "%s (Mops/s)\n", mpsc ? "many producers, one consumer" :
+                                    "many producers, many consumers" );
+    printf( "%8s %12s %12s %8s\n", "threads", "mutex+list", "lock-free",
+            "speedup" );
+    for ( n = 1; n <= BENCH_THREADS; n *= 2 ) {
+      l = bench_run( BENCH_LIST, n, mpsc );
+      q = bench_run( BENCH_QUEUE, n, mpsc );
+      printf( "%8d %12.2f %12.2f %7.2fx\n", n, l, q, q / l );
+    }
+    printf( "\n" );
+  }
+
+  return 0;
+}